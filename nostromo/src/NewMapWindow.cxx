@@ -52,6 +52,8 @@ int NewMapWindow::handle(int event)
     int ret = 0;
     char lbl[256];
     static struct timeval start;
+    nost_key_config_data* key;
+    nost_key_stroke_data* stroke;
 
     switch(event) {
         case FL_KEYDOWN:
@@ -76,21 +78,22 @@ int NewMapWindow::handle(int event)
                   break;
                 default:
                   /* Stuff the keystroke into the current queue */
-                  if(nost_cfg->configs[nost_cfg->current_config].keys[current_mode][current_key].key_count < MAX_KEYSTROKES) {
-                      int cur = nost_cfg->configs[nost_cfg->current_config].keys[current_mode][current_key].key_count++;
+                  key = key_config(nost_cfg->current_config, current_key);
+                  if(key != NULL && (stroke = add_stroke(nost_cfg, key)) != NULL) {
+                      int cur = key->key_count - 1;
                       if(cur) {
                           struct timeval stop;
                           gettimeofday(&stop, NULL);
                           int delay = (((stop.tv_sec - start.tv_sec) * 1000000) + (stop.tv_usec - start.tv_usec)) / 1000;
-                          nost_cfg->configs[nost_cfg->current_config].keys[current_mode][current_key].data[cur].delay = delay;
+                          stroke->delay = delay;
                       } else {
-                          nost_cfg->configs[nost_cfg->current_config].keys[current_mode][current_key].data[cur].delay = 0;
+                          stroke->delay = 0;
                       }
-                      nost_cfg->configs[nost_cfg->current_config].keys[current_mode][current_key].data[cur].type = STROKE_KEY;
-                      nost_cfg->configs[nost_cfg->current_config].keys[current_mode][current_key].data[cur].code = fl_xevent->xkey.keycode;
-                      nost_cfg->configs[nost_cfg->current_config].keys[current_mode][current_key].data[cur].state = fl_xevent->xkey.state;
-                      nost_cfg->configs[nost_cfg->current_config].keys[current_mode][current_key].data[cur].display = strdup(create_key_display(&fl_xevent->xkey, nost_cfg->configs[nost_cfg->current_config].keys[current_mode][current_key].data[cur].delay));
-                      create_key_map_browser->add(nost_cfg->configs[nost_cfg->current_config].keys[current_mode][current_key].data[cur].display);
+                      stroke->type = STROKE_KEY;
+                      stroke->code = fl_xevent->xkey.keycode;
+                      stroke->state = fl_xevent->xkey.state;
+                      stroke->display = arena_intern(&nost_cfg->mem, create_key_display(&fl_xevent->xkey, stroke->delay));
+                      create_key_map_browser->add(stroke->display);
                       create_key_map_browser->middleline(create_key_map_browser->size());
                       gettimeofday(&start, NULL);
                   }
@@ -105,21 +108,22 @@ int NewMapWindow::handle(int event)
         case FL_PUSH:
             if(Fl::event_inside(create_key_map_browser)) {
                 /* Stuff the keystroke into the current queue */
-                if(nost_cfg->configs[nost_cfg->current_config].keys[current_mode][current_key].key_count < MAX_KEYSTROKES) {
-                    int cur = nost_cfg->configs[nost_cfg->current_config].keys[current_mode][current_key].key_count++;
+                key = key_config(nost_cfg->current_config, current_key);
+                if(key != NULL && (stroke = add_stroke(nost_cfg, key)) != NULL) {
+                    int cur = key->key_count - 1;
                     if(cur) {
                         struct timeval stop;
                         gettimeofday(&stop, NULL);
                         int delay = (((stop.tv_sec - start.tv_sec) * 1000000) + (stop.tv_usec - start.tv_usec)) / 1000;
-                        nost_cfg->configs[nost_cfg->current_config].keys[current_mode][current_key].data[cur].delay = delay;
+                        stroke->delay = delay;
                     } else {
-                        nost_cfg->configs[nost_cfg->current_config].keys[current_mode][current_key].data[cur].delay = 0;
+                        stroke->delay = 0;
                     }
-                    nost_cfg->configs[nost_cfg->current_config].keys[current_mode][current_key].data[cur].type = STROKE_MOUSE;
-                    nost_cfg->configs[nost_cfg->current_config].keys[current_mode][current_key].data[cur].code = fl_xevent->xbutton.button;
-                    sprintf(lbl, "%s\t%dms", button_names[Fl::event_button()], nost_cfg->configs[nost_cfg->current_config].keys[current_mode][current_key].data[cur].delay);
-                    nost_cfg->configs[nost_cfg->current_config].keys[current_mode][current_key].data[cur].display = strdup(lbl);
-                    create_key_map_browser->add(nost_cfg->configs[nost_cfg->current_config].keys[current_mode][current_key].data[cur].display);
+                    stroke->type = STROKE_MOUSE;
+                    stroke->code = fl_xevent->xbutton.button;
+                    sprintf(lbl, "%s\t%dms", button_names[Fl::event_button()], stroke->delay);
+                    stroke->display = arena_intern(&nost_cfg->mem, lbl);
+                    create_key_map_browser->add(stroke->display);
                     create_key_map_browser->middleline(create_key_map_browser->size());
                     gettimeofday(&start, NULL);
                 }
@@ -0,0 +1,225 @@
+/*
+    Nostromo_n50 configuration tools to support Belkin's Nostromo n50
+    Copyright (C) 2003 Paul Bohme and others
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+/**
+ * @file arena.cxx
+ **/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+
+/** Everything handed out is aligned to this */
+#define ARENA_ALIGN 8
+
+/** Interned string slots to start with */
+#define INITIAL_STRING_SLOTS 64
+
+struct arena_block {
+    arena_block* next;
+    size_t size;            /**< Bytes in data */
+    size_t used;
+    char data[1];
+};
+
+/**
+ * Start an empty arena.  Nothing is allocated until it's used.
+ **/
+void arena_init(arena* a)
+{
+    memset(a, 0, sizeof(arena));
+}
+
+/**
+ * Carve zeroed memory out of the arena.
+ * @return The memory, or NULL if out of memory.
+ **/
+void* arena_alloc(arena* a, size_t size)
+{
+    arena_block* b = a->blocks;
+    size_t room;
+    int big;
+    void* p;
+
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    if(size == 0) {
+        size = ARENA_ALIGN;
+    }
+
+    if(b == NULL || b->size - b->used < size) {
+        big = size > ARENA_BLOCK_SIZE / 4;
+        room = big ? size : ARENA_BLOCK_SIZE;
+        if((b = (arena_block*)malloc(offsetof(arena_block, data) + room)) == NULL) {
+            return NULL;
+        }
+        b->size = room;
+        b->used = 0;
+        a->reserved += room;
+
+        /* A block for one big request goes behind the head, which may still have room */
+        if(big && a->blocks) {
+            b->next = a->blocks->next;
+            a->blocks->next = b;
+        } else {
+            b->next = a->blocks;
+            a->blocks = b;
+        }
+    }
+
+    p = b->data + b->used;
+    b->used += size;
+    a->used += size;
+    memset(p, 0, size);
+    return p;
+}
+
+static size_t hash_string(const char* s)
+{
+    size_t h = 5381;
+
+    while(*s) {
+        h = h * 33 + (unsigned char)*s++;
+    }
+    return h;
+}
+
+/**
+ * Double the interned string table.
+ **/
+static int grow_strings(arena* a)
+{
+    size_t slots = a->string_slots ? a->string_slots * 2 : INITIAL_STRING_SLOTS;
+    const char** strings = (const char**)calloc(slots, sizeof(const char*));
+    size_t n, i;
+
+    if(strings == NULL) {
+        return -1;
+    }
+    for(n = 0; n < a->string_slots; n++) {
+        if(a->strings[n]) {
+            for(i = hash_string(a->strings[n]) & (slots - 1); strings[i]; i = (i + 1) & (slots - 1));
+            strings[i] = a->strings[n];
+        }
+    }
+    free(a->strings);
+    a->strings = strings;
+    a->string_slots = slots;
+    return 0;
+}
+
+/**
+ * The arena's copy of a string, made the first time it's seen.
+ * @return The copy, or NULL if out of memory.
+ **/
+const char* arena_intern(arena* a, const char* str)
+{
+    size_t i;
+    size_t len;
+    char* copy;
+
+    if(str == NULL) {
+        return NULL;
+    }
+    /* Kept at most half full */
+    if(a->num_strings * 2 >= a->string_slots && grow_strings(a) < 0) {
+        return NULL;
+    }
+
+    for(i = hash_string(str) & (a->string_slots - 1); a->strings[i]; i = (i + 1) & (a->string_slots - 1)) {
+        if(!strcmp(a->strings[i], str)) {
+            return a->strings[i];
+        }
+    }
+
+    len = strlen(str) + 1;
+    if((copy = (char*)arena_alloc(a, len)) == NULL) {
+        return NULL;
+    }
+    memcpy(copy, str, len);
+    a->strings[i] = copy;
+    a->num_strings++;
+    return copy;
+}
+
+/**
+ * Take over everything in another arena, which is left empty.  Lets
+ * a thread load into an arena of its own and hand the result over
+ * without copying.  Its strings are interned here too, unless there's
+ * already a copy; either way what pointed at them still does.
+ * @return 0, or -1 if out of memory, when from is left as it was.
+ **/
+int arena_merge(arena* into, arena* from)
+{
+    arena_block* last;
+    size_t n, i;
+
+    while((into->num_strings + from->num_strings) * 2 >= into->string_slots) {
+        if(grow_strings(into) < 0) {
+            return -1;
+        }
+    }
+    for(n = 0; n < from->string_slots; n++) {
+        if(from->strings[n] == NULL) {
+            continue;
+        }
+        for(i = hash_string(from->strings[n]) & (into->string_slots - 1); into->strings[i];
+            i = (i + 1) & (into->string_slots - 1)) {
+            if(!strcmp(into->strings[i], from->strings[n])) {
+                break;
+            }
+        }
+        if(into->strings[i] == NULL) {
+            into->strings[i] = from->strings[n];
+            into->num_strings++;
+        }
+    }
+
+    /* Behind the head, which keeps taking allocations */
+    if(from->blocks) {
+        for(last = from->blocks; last->next; last = last->next);
+        if(into->blocks) {
+            last->next = into->blocks->next;
+            into->blocks->next = from->blocks;
+        } else {
+            into->blocks = from->blocks;
+        }
+    }
+    into->used += from->used;
+    into->reserved += from->reserved;
+
+    free(from->strings);
+    arena_init(from);
+    return 0;
+}
+
+/**
+ * Free everything in the arena, which is left empty and reusable.
+ **/
+void arena_release(arena* a)
+{
+    arena_block* b;
+
+    while((b = a->blocks) != NULL) {
+        a->blocks = b->next;
+        free(b);
+    }
+    free(a->strings);
+    arena_init(a);
+}
@@ -0,0 +1,60 @@
+/*
+    Nostromo_n50 configuration tools to support Belkin's Nostromo n50
+    Copyright (C) 2003 Paul Bohme and others
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+#ifndef ARENA_H
+#define ARENA_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+
+/**
+ * @file arena.h
+ * Bump allocation for data that all goes away together, like a set of
+ * loaded configs.  Nothing is freed on its own; arena_release() hands
+ * back every block at once.  Strings can be interned, so each distinct
+ * one is stored once however many keys share it.
+ **/
+
+/** Usual size of a block, bigger requests get a block to themselves */
+#define ARENA_BLOCK_SIZE 16384
+
+typedef struct arena_block arena_block;
+
+typedef struct {
+    arena_block* blocks;    /**< Newest first, allocations come from the head */
+    size_t used;            /**< Bytes handed out */
+    size_t reserved;        /**< Bytes in blocks */
+    const char** strings;   /**< Interned strings, open addressed */
+    size_t num_strings;
+    size_t string_slots;    /**< Size of strings, a power of two */
+} arena;
+
+void arena_init(arena* a);
+void* arena_alloc(arena* a, size_t size);
+const char* arena_intern(arena* a, const char* str);
+int arena_merge(arena* into, arena* from);
+void arena_release(arena* a);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // ARENA_H
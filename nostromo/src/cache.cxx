@@ -0,0 +1,578 @@
+/*
+    Nostromo_n50 configuration tools to support Belkin's Nostromo n50
+    Copyright (C) 2003 Paul Bohme and others
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+/**
+ * @file cache.cxx
+ * Writing, mapping and checking the compiled config image.
+ **/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/mman.h>
+
+#include "cache.h"
+
+/** Programs start on this boundary within the image */
+#define IMAGE_ALIGN 8
+
+/**
+ * FNV-1a, carried on from a previous hash.
+ **/
+static uint64_t hash_bytes(uint64_t h, const void* p, size_t len)
+{
+    const unsigned char* c = (const unsigned char*)p;
+
+    while(len--) {
+        h ^= *c++;
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+#define HASH_INIT 0xcbf29ce484222325ULL
+
+/**
+ * What the image's checksum covers: the rest of the index after the
+ * checksum itself.
+ **/
+static uint64_t index_checksum(const config_image* image)
+{
+    size_t start = offsetof(config_image, checksum) + sizeof(image->checksum);
+
+    return hash_bytes(HASH_INIT, (const char*)image + start, image->index_size - start);
+}
+
+/**
+ * What a config's checksum covers: its key hashes and its program.
+ **/
+static uint64_t config_checksum(const config_image* image, const config_ref* ref)
+{
+    uint64_t h = HASH_INIT;
+
+    h = hash_bytes(h, (const char*)image + ref->key_hashes, ref->num_keys * sizeof(uint64_t));
+    return hash_bytes(h, (const char*)image + ref->program, ref->program_size);
+}
+
+/**
+ * Hash a file's contents.
+ * @return The hash, or 0 if it couldn't be read.
+ **/
+uint64_t hash_file(const char* fname)
+{
+    char buf[65536];
+    uint64_t h = HASH_INIT;
+    ssize_t len;
+    int fd;
+
+    if((fd = open(fname, O_RDONLY | O_CLOEXEC)) < 0) {
+        return 0;
+    }
+    while((len = read(fd, buf, sizeof(buf))) > 0) {
+        h = hash_bytes(h, buf, len);
+    }
+    close(fd);
+    return len < 0 ? 0 : h;
+}
+
+/**
+ * Hash each key of a config, over just what the compiler looks at:
+ * renaming a key or changing how a stroke is displayed doesn't
+ * change its hash.
+ * @param hashes config_keys() of them, mode by mode.
+ **/
+void hash_keys(const nost_config_data* cfg, uint64_t* hashes)
+{
+    const nost_key_config_data* key;
+    const nost_key_stroke_data* stroke;
+    uint64_t h;
+    int m, k, s;
+
+    for(m = 0; m < cfg->num_modes; m++) {
+        for(k = 0; k < MAX_KEYS; k++) {
+            key = &cfg->modes[m].keys[k];
+            h = HASH_INIT;
+            h = hash_bytes(h, &key->type, sizeof(key->type));
+            h = hash_bytes(h, &key->repeat, sizeof(key->repeat));
+            h = hash_bytes(h, &key->repeat_delay, sizeof(key->repeat_delay));
+            h = hash_bytes(h, &key->remote, sizeof(key->remote));
+            h = hash_bytes(h, key->targets ? key->targets : "", key->targets ? strlen(key->targets) + 1 : 1);
+            h = hash_bytes(h, &key->layer, sizeof(key->layer));
+            h = hash_bytes(h, &key->key_count, sizeof(key->key_count));
+            for(s = 0; s < key->key_count; s++) {
+                stroke = &key->data[s];
+                h = hash_bytes(h, &stroke->type, sizeof(stroke->type));
+                h = hash_bytes(h, &stroke->code, sizeof(stroke->code));
+                h = hash_bytes(h, &stroke->state, sizeof(stroke->state));
+                h = hash_bytes(h, &stroke->delay, sizeof(stroke->delay));
+            }
+            hashes[m * MAX_KEYS + k] = h;
+        }
+    }
+}
+
+/**
+ * Hash a whole config from its key hashes.
+ **/
+uint64_t hash_config(const nost_config_data* cfg, const uint64_t* key_hashes)
+{
+    uint64_t h = HASH_INIT;
+    int m;
+
+    h = hash_bytes(h, &cfg->model, sizeof(cfg->model));
+    h = hash_bytes(h, &cfg->num_modes, sizeof(cfg->num_modes));
+    for(m = 0; m < cfg->num_modes; m++) {
+        h = hash_bytes(h, &cfg->modes[m].leds, sizeof(cfg->modes[m].leds));
+    }
+    return hash_bytes(h, key_hashes, config_keys(cfg) * sizeof(uint64_t));
+}
+
+/**
+ * Round up to the next program boundary.
+ **/
+static size_t image_align(size_t n)
+{
+    return (n + IMAGE_ALIGN - 1) & ~(size_t)(IMAGE_ALIGN - 1);
+}
+
+/**
+ * Copy a string into the image.
+ * @return Its offset.
+ **/
+static uint32_t put_string(char* base, size_t* at, const char* str)
+{
+    size_t offset = *at;
+    size_t len = strlen(str ? str : "") + 1;
+
+    memcpy(base + offset, str ? str : "", len);
+    *at += len;
+    return offset;
+}
+
+/**
+ * Lay configs and their compiled programs out as an image.
+ * @param entries One for each of data's configs.
+ * @param src The XML file the configs came from.
+ * @param src_hash hash_file() of it.
+ * @return The image, to free(), or NULL if out of memory.
+ **/
+config_image* build_image(const nost_data* data, const image_entry* entries, const nost_modifiers* mods,
+                          const struct stat* src, uint64_t src_hash)
+{
+    const nost_config_data* cfg;
+    config_image* image;
+    config_ref* refs;
+    char* base;
+    size_t size;
+    size_t at;
+    int n;
+
+    /* Header, table and strings, then each config's key hashes and program */
+    size = sizeof(config_image) + data->num_configs * sizeof(config_ref);
+    size += strlen(data->server ? data->server : "") + 1;
+    size += strlen(data->transport ? data->transport : "") + 1;
+    size += strlen(data->remote_name ? data->remote_name : "") + 1;
+    size += strlen(data->output ? data->output : "") + 1;
+    for(n = 0; n < data->num_configs; n++) {
+        size += strlen(entries[n].cfg->name ? entries[n].cfg->name : "") + 1;
+        size += strlen(entries[n].cfg->file ? entries[n].cfg->file : "") + 1;
+    }
+    for(n = 0; n < data->num_configs; n++) {
+        size = image_align(size) + entries[n].num_keys * sizeof(uint64_t);
+        size = image_align(size) + program_size(entries[n].program);
+    }
+    if(size > UINT32_MAX) {
+        return NULL;
+    }
+
+    if((image = (config_image*)calloc(1, size)) == NULL) {
+        return NULL;
+    }
+    base = (char*)image;
+
+    memcpy(image->magic, CACHE_MAGIC, sizeof(image->magic));
+    image->version = CACHE_VERSION;
+    image->header_size = sizeof(config_image);
+    image->size = size;
+    image->src_mtime_sec = src->st_mtim.tv_sec;
+    image->src_mtime_nsec = src->st_mtim.tv_nsec;
+    image->src_size = src->st_size;
+    image->src_ino = src->st_ino;
+    image->src_hash = src_hash;
+    image->lib_mtime_sec = data->library_stamp.mtime_sec;
+    image->lib_mtime_nsec = data->library_stamp.mtime_nsec;
+    image->lib_ino = data->library_stamp.ino;
+    image->shift = mods->shift;
+    image->control = mods->control;
+    image->alt = mods->alt;
+    image->network_enabled = data->network_enabled;
+    image->port = data->port;
+    image->playout_delay = data->playout_delay;
+    image->current_config = data->current_config;
+    image->num_configs = data->num_configs;
+    image->configs = sizeof(config_image);
+
+    at = image->configs + data->num_configs * sizeof(config_ref);
+    refs = (config_ref*)(base + image->configs);
+    image->server = put_string(base, &at, data->server);
+    image->transport = put_string(base, &at, data->transport);
+    image->remote_name = put_string(base, &at, data->remote_name);
+    image->output = put_string(base, &at, data->output);
+    for(n = 0; n < data->num_configs; n++) {
+        cfg = entries[n].cfg;
+        refs[n].name = put_string(base, &at, cfg->name);
+        refs[n].file = put_string(base, &at, cfg->file);
+        refs[n].model = cfg->model;
+        refs[n].hash = entries[n].hash;
+        if(cfg->file) {
+            refs[n].mtime_sec = cfg->stamp.mtime_sec;
+            refs[n].mtime_nsec = cfg->stamp.mtime_nsec;
+            refs[n].file_size = cfg->stamp.size;
+            refs[n].ino = cfg->stamp.ino;
+        }
+    }
+    image->index_size = at;
+
+    for(n = 0; n < data->num_configs; n++) {
+        at = image_align(at);
+        refs[n].key_hashes = at;
+        refs[n].num_keys = entries[n].num_keys;
+        memcpy(base + at, entries[n].key_hashes, entries[n].num_keys * sizeof(uint64_t));
+        at += entries[n].num_keys * sizeof(uint64_t);
+
+        at = image_align(at);
+        refs[n].program = at;
+        refs[n].program_size = program_size(entries[n].program);
+        memcpy(base + at, entries[n].program, refs[n].program_size);
+        at += refs[n].program_size;
+
+        refs[n].checksum = config_checksum(image, &refs[n]);
+    }
+
+    image->checksum = index_checksum(image);
+    return image;
+}
+
+/**
+ * Save an image.  It's written to a temporary and renamed into place,
+ * so a reader sees either the old image or the whole new one.
+ * @return 0 on success, -1 on error.
+ **/
+int write_image(const char* fname, const config_image* image)
+{
+    char tmp[PATH_MAX+1];
+    const char* p = (const char*)image;
+    size_t left = image->size;
+    ssize_t len;
+    int fd;
+
+    snprintf(tmp, sizeof(tmp), "%s.XXXXXX", fname);
+    if((fd = mkstemp(tmp)) < 0) {
+        return -1;
+    }
+
+    while(left > 0) {
+        if((len = write(fd, p, left)) < 0) {
+            break;
+        }
+        p += len;
+        left -= len;
+    }
+
+    if(close(fd) < 0 || left > 0 || rename(tmp, fname) < 0) {
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Is a string offset in the index and terminated before its end?
+ **/
+static int valid_string(const config_image* image, uint32_t offset)
+{
+    return offset >= image->header_size && offset < image->index_size
+        && memchr((const char*)image + offset, 0, image->index_size - offset) != NULL;
+}
+
+/**
+ * Check that the index is intact and everything in it is where it
+ * says, so that a bad file can't send the daemon outside of the
+ * mapping.  The configs themselves are left to verify_config().
+ **/
+static int valid_image(const config_image* image, size_t size)
+{
+    const config_ref* ref;
+    int n;
+
+    if(size < sizeof(config_image)
+    || memcmp(image->magic, CACHE_MAGIC, sizeof(image->magic))
+    || image->version != CACHE_VERSION
+    || image->header_size != sizeof(config_image)
+    || image->size != size
+    || image->index_size < sizeof(config_image)
+    || image->index_size > size
+    || image->checksum != index_checksum(image)) {
+        return 0;
+    }
+
+    if(image->num_configs <= 0
+    || image->configs < image->header_size
+    || image->configs + (uint64_t)image->num_configs * sizeof(config_ref) > image->index_size
+    || !valid_string(image, image->server)
+    || !valid_string(image, image->transport)
+    || !valid_string(image, image->remote_name)
+    || !valid_string(image, image->output)) {
+        return 0;
+    }
+
+    for(n = 0; n < image->num_configs; n++) {
+        ref = image_config(image, n);
+        if(!valid_string(image, ref->name)
+        || !valid_string(image, ref->file)
+        || ref->key_hashes % sizeof(uint64_t)
+        || ref->key_hashes < image->index_size
+        || ref->key_hashes + (uint64_t)ref->num_keys * sizeof(uint64_t) > size
+        || ref->program % IMAGE_ALIGN
+        || ref->program < image->index_size
+        || ref->program_size < offsetof(nost_program, modes)
+        || (uint64_t)ref->program + ref->program_size > size) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * Check one config of an image that's passed valid_image(): that its
+ * hashes and program are as written, and that the program only points
+ * within itself.  Until this passes, the config can't be run.
+ **/
+int verify_config(const config_image* image, int n)
+{
+    const config_ref* ref = image_config(image, n);
+    const nost_program* prog = image_program(image, n);
+    const nost_key_program* key;
+    int mode, k;
+
+    if(ref->checksum != config_checksum(image, ref)) {
+        return 0;
+    }
+    if(prog->num_modes < 0 || prog->num_modes > MAX_LAYERS
+    || ref->num_keys != (uint32_t)prog->num_modes * MAX_KEYS
+    || prog->num_actions < 0
+    || prog->actions != offsetof(nost_program, modes) + prog->num_modes * sizeof(nost_layer_program)
+    || prog->names != prog->actions + (uint64_t)prog->num_actions * sizeof(nost_action)
+    || (uint64_t)prog->names + prog->names_size > ref->program_size
+    || (prog->names_size && ((const char*)prog)[prog->names + prog->names_size - 1] != 0)) {
+        return 0;
+    }
+    for(mode = 0; mode < prog->num_modes; mode++) {
+        for(k = 0; k < MAX_KEYS; k++) {
+            key = &prog->modes[mode].keys[k];
+            if((uint64_t)key->first + key->press_count + key->release_count > (uint64_t)prog->num_actions) {
+                return 0;
+            }
+            /* Routes are terminated by the last name's terminator at worst */
+            if(key->route && (key->route < prog->names || key->route >= (uint64_t)prog->names + prog->names_size)) {
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+/**
+ * Map an image whose index is good, whether or not it's up to date.
+ * An out of date one still has programs worth reusing.
+ * @param mods The output's modifier keycodes, or NULL to accept any.
+ * @return The mapped image, or NULL if there's no good one.
+ **/
+const config_image* open_image(const char* fname, const nost_modifiers* mods)
+{
+    const config_image* image;
+    struct stat st;
+    void* p;
+    int fd;
+
+    if((fd = open(fname, O_RDONLY | O_CLOEXEC)) < 0) {
+        return NULL;
+    }
+    if(fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(config_image)) {
+        close(fd);
+        return NULL;
+    }
+    p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(p == MAP_FAILED) {
+        return NULL;
+    }
+    image = (const config_image*)p;
+
+    if(!valid_image(image, st.st_size)
+    || (mods && (image->shift != mods->shift
+              || image->control != mods->control
+              || image->alt != mods->alt))) {
+        munmap(p, st.st_size);
+        return NULL;
+    }
+    return image;
+}
+
+/**
+ * Whether config n of an image was compiled from the library file
+ * a config is in, as it is now.
+ **/
+int same_file(const config_image* image, int n, const nost_config_data* cfg)
+{
+    const config_ref* ref = image_config(image, n);
+
+    return cfg->file && !strcmp(image_string(image, ref->file), cfg->file)
+        && ref->mtime_sec == cfg->stamp.mtime_sec && ref->mtime_nsec == cfg->stamp.mtime_nsec
+        && ref->file_size == cfg->stamp.size && ref->ino == cfg->stamp.ino;
+}
+
+/**
+ * Whether the profile library is as the image was built from: no
+ * profile has come or gone, and none of its files have changed.
+ **/
+static int library_current(const config_image* image, const char* src_name)
+{
+    char path[PATH_MAX+1];
+    const config_ref* ref;
+    const char* file;
+    struct stat st;
+    int fd, n;
+    int ret = 1;
+
+    library_path(src_name, path, sizeof(path));
+    if((fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+        return image->lib_ino == 0;
+    }
+    if(fstat(fd, &st) < 0
+    || image->lib_mtime_sec != st.st_mtim.tv_sec
+    || image->lib_mtime_nsec != st.st_mtim.tv_nsec
+    || image->lib_ino != (uint64_t)st.st_ino) {
+        close(fd);
+        return 0;
+    }
+
+    for(n = 0; n < image->num_configs && ret; n++) {
+        ref = image_config(image, n);
+        file = image_string(image, ref->file);
+        if(*file && (fstatat(fd, file, &st, 0) < 0
+                  || ref->mtime_sec != st.st_mtim.tv_sec
+                  || ref->mtime_nsec != st.st_mtim.tv_nsec
+                  || ref->file_size != (uint64_t)st.st_size
+                  || ref->ino != (uint64_t)st.st_ino)) {
+            ret = 0;
+        }
+    }
+    close(fd);
+    return ret;
+}
+
+/**
+ * Map the image for a config file, if there's a good one that's up
+ * to date with it and with the profile library beside it.  A config
+ * file that was touched or saved over but not changed still counts as
+ * up to date, that costs hashing it.  Profiles only cost a stat each.
+ * @param src_name The XML file.
+ * @param mods The output's modifier keycodes, or NULL to accept any.
+ * @return The mapped image, or NULL if it has to be rebuilt.
+ **/
+const config_image* map_image(const char* fname, const char* src_name, const nost_modifiers* mods)
+{
+    const config_image* image;
+    struct stat src;
+
+    if(stat(src_name, &src) < 0) {
+        return NULL;
+    }
+    if((image = open_image(fname, mods)) == NULL) {
+        return NULL;
+    }
+
+    if(image->src_size != (uint64_t)src.st_size || !library_current(image, src_name)) {
+        unmap_image(image);
+        return NULL;
+    }
+
+    /* Saved by rename or just touched, look at what's in it */
+    if((image->src_ino != (uint64_t)src.st_ino
+     || image->src_mtime_sec != src.st_mtim.tv_sec
+     || image->src_mtime_nsec != src.st_mtim.tv_nsec)
+    && image->src_hash != hash_file(src_name)) {
+        unmap_image(image);
+        return NULL;
+    }
+    return image;
+}
+
+/**
+ * Let go of a map_image() image.
+ **/
+void unmap_image(const config_image* image)
+{
+    munmap((void*)image, image->size);
+}
+
+/**
+ * Find a config by name, looking at the hint first since configs
+ * mostly stay where they were.
+ * @return Its index, or -1 if there's no such config.
+ **/
+int image_find_config(const config_image* image, const char* name, int hint)
+{
+    int n;
+
+    if(hint >= 0 && hint < image->num_configs
+    && !strcmp(image_string(image, image_config(image, hint)->name), name)) {
+        return hint;
+    }
+    for(n = 0; n < image->num_configs; n++) {
+        if(!strcmp(image_string(image, image_config(image, n)->name), name)) {
+            return n;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Find a config by its library file, looking at the hint first.
+ * @return Its index, or -1 if no config came from that file.
+ **/
+int image_find_file(const config_image* image, const char* file, int hint)
+{
+    int n;
+
+    if(hint >= 0 && hint < image->num_configs
+    && !strcmp(image_string(image, image_config(image, hint)->file), file)) {
+        return hint;
+    }
+    for(n = 0; n < image->num_configs; n++) {
+        if(!strcmp(image_string(image, image_config(image, n)->file), file)) {
+            return n;
+        }
+    }
+    return -1;
+}
@@ -0,0 +1,194 @@
+/*
+    Nostromo_n50 configuration tools to support Belkin's Nostromo n50
+    Copyright (C) 2003 Paul Bohme and others
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include "program.h"
+
+/**
+ * @file cache.h
+ * The compiled configs saved as one flat image next to the config
+ * file, so that a start or reload with an unchanged config maps it
+ * and runs from it in place instead of parsing XML.  Everything in
+ * the image is found by byte offset from its start, there are no
+ * pointers in it.  It is only a cache: if it's missing, damaged or
+ * older than the XML it is rebuilt from the XML.
+ *
+ * The front of the image is an index of the configs, checked when
+ * it's mapped.  Each config's hashes and program come after it and
+ * are checked the first time that config is used, so however many
+ * profiles there are, only the ones run are ever paged in.
+ **/
+
+#define CACHE_FILE_NAME CFG_FILE_NAME ".cache"
+
+#define CACHE_MAGIC "NOSTIMG"   /**< 8 bytes with the terminator */
+#define CACHE_VERSION 7         /**< Bump whenever the layout of anything in the image changes */
+
+/**
+ * Keys in a config, each of which is hashed.
+ **/
+inline int config_keys(const nost_config_data* cfg)
+{
+    return cfg->num_modes * MAX_KEYS;
+}
+
+/**
+ * Where one config lives in the image.  The hashes cover only what
+ * goes into the program, so a reload can tell which configs and keys
+ * need compiling again.
+ **/
+typedef struct {
+    uint64_t hash;          /**< Of the model, the modes' LEDs and every key hash */
+    uint64_t checksum;      /**< Of its key hashes and program */
+    uint32_t name;          /**< Offset of the name string */
+    uint32_t file;          /**< Offset of its library file's name, "" if it's in the config file */
+    int64_t mtime_sec;      /**< The library file it was compiled from */
+    int64_t mtime_nsec;
+    uint64_t file_size;
+    uint64_t ino;
+    int32_t model;          /**< model_type */
+    uint32_t program;       /**< Offset of the nost_program */
+    uint32_t program_size;  /**< Bytes of it */
+    uint32_t key_hashes;    /**< Offset of num_keys uint64_t, mode by mode */
+    uint32_t num_keys;
+} config_ref;
+
+/**
+ * Start of the image.  The config table and strings follow, then each
+ * config's key hashes and program.
+ **/
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;   /**< sizeof(config_image) when written */
+    uint64_t size;          /**< Bytes in the whole image */
+    uint64_t index_size;    /**< Bytes of header, table and strings */
+    uint64_t checksum;      /**< Of the rest of the index after this field */
+
+    /* The XML it was built from */
+    int64_t src_mtime_sec;
+    int64_t src_mtime_nsec;
+    uint64_t src_size;
+    uint64_t src_ino;
+    uint64_t src_hash;
+
+    /* The profile library's directory, which changes when a profile comes or goes */
+    int64_t lib_mtime_sec;
+    int64_t lib_mtime_nsec;
+    uint64_t lib_ino;
+
+    /* Programs are only good for the output they were compiled for */
+    int32_t shift;
+    int32_t control;
+    int32_t alt;
+
+    int32_t network_enabled;
+    int32_t port;
+    int32_t playout_delay;
+    uint32_t server;        /**< Offset of the string */
+    uint32_t transport;     /**< Offset of the string */
+    uint32_t remote_name;   /**< Offset of the string, empty for the hostname */
+    uint32_t output;        /**< Offset of the string */
+    int32_t current_config;
+    int32_t num_configs;
+    uint32_t configs;       /**< Offset of num_configs config_refs */
+} config_image;
+
+/**
+ * Configs as loaded, every one of them compiled.
+ **/
+typedef struct {
+    const config_image* image;
+    int mapped;             /**< image is the cache file mmapped, otherwise malloc'd */
+    signed char* checked;   /**< Per config, 1 once verify_config() passes, -1 if it fails */
+} config_set;
+
+/**
+ * What the daemon is running: a config set and which of its configs
+ * is selected.  Never changed once published, a switch or reload
+ * publishes a new one.
+ **/
+typedef struct {
+    config_set* set;
+    int selected;
+} config_snapshot;
+
+/**
+ * What goes into the image for one config: compiled now, or carried
+ * over from an older image.
+ **/
+typedef struct {
+    const nost_config_data* cfg;    /**< Name, model and library file */
+    const nost_program* program;
+    const uint64_t* key_hashes;
+    int num_keys;
+    uint64_t hash;                  /**< hash_config() */
+} image_entry;
+
+uint64_t hash_file(const char* fname);
+void hash_keys(const nost_config_data* cfg, uint64_t* hashes);
+uint64_t hash_config(const nost_config_data* cfg, const uint64_t* key_hashes);
+config_image* build_image(const nost_data* data, const image_entry* entries, const nost_modifiers* mods,
+                          const struct stat* src, uint64_t src_hash);
+int write_image(const char* fname, const config_image* image);
+const config_image* open_image(const char* fname, const nost_modifiers* mods);
+const config_image* map_image(const char* fname, const char* src_name, const nost_modifiers* mods);
+void unmap_image(const config_image* image);
+int verify_config(const config_image* image, int n);
+int image_find_config(const config_image* image, const char* name, int hint);
+int image_find_file(const config_image* image, const char* file, int hint);
+int same_file(const config_image* image, int n, const nost_config_data* cfg);
+
+/**
+ * A string stored in the image.
+ **/
+inline const char* image_string(const config_image* image, uint32_t offset)
+{
+    return (const char*)image + offset;
+}
+
+/**
+ * Config n's entry in the image.
+ **/
+inline const config_ref* image_config(const config_image* image, int n)
+{
+    return (const config_ref*)((const char*)image + image->configs) + n;
+}
+
+/**
+ * Config n's compiled program.
+ **/
+inline const nost_program* image_program(const config_image* image, int n)
+{
+    return (const nost_program*)((const char*)image + image_config(image, n)->program);
+}
+
+/**
+ * Config n's key hashes.
+ **/
+inline const uint64_t* image_key_hashes(const config_image* image, int n)
+{
+    return (const uint64_t*)((const char*)image + image_config(image, n)->key_hashes);
+}
+
+#endif // CACHE_H
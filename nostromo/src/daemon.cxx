@@ -30,6 +30,7 @@
 #include <fcntl.h>
 #include <sys/ioctl.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <linux/input.h>
 #include <signal.h>
 #include <errno.h>
@@ -38,16 +39,24 @@
 #include <pwd.h>
 #include <time.h>
 #include <netdb.h>
+#include <arpa/inet.h>
 #include <syslog.h>
 #include <pthread.h>
+#include <stdint.h>
+#include <sys/timerfd.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/inotify.h>
 #include <gtk/gtk.h>
 
-#define XK_MISCELLANY
-#include <X11/keysymdef.h>
-#include <X11/extensions/XTest.h>
-#include <X11/X.h>
-
 #include "nost_data.h"
+#include "timer.h"
+#include "program.h"
+#include "histogram.h"
+#include "output.h"
+#include "rcu.h"
+#include "cache.h"
+#include "wire.h"
 
 #define BELKIN_VENDOR_ID 0x050d     /**< Belkin's vendor ID */
 #define NOSTROMO_N50_ID 0x0805      /**< n50 USB ID */
@@ -55,23 +64,78 @@
 
 #define PIDFILE "/tmp/nostromo_n50.pid"
 
-nost_config_data* cfg;
-nost_data* all_cfg = NULL;
+/** The compiled configs the loop is running */
+const config_image* cfg_image = NULL;
+
+/**
+ * The published form of the above, for readers off the event loop
+ * (the docklet).  The loop itself uses the plain pointers, it's the
+ * only thread that changes them.
+ **/
+config_snapshot* active_snapshot = NULL;
+
+/** Where injected events go (XTest, uinput) */
+output_sink* output = NULL;
+
+/**
+ * Something the event loop watches.  ready() gets the epoll events
+ * when the fd has something for us.
+ **/
+struct event_source {
+    int fd;
+    void (*ready)(event_source* src, uint32_t events);
+};
+
+/** Most physical devices handled at once */
+#define MAX_DEVICES 8
+
+/** Deepest stack of mode shift keys held at once */
+#define MAX_SHIFT_LAYERS 8
 
-Display* display;
+/**
+ * A mode shift key being held, and the mode to go back to when it's
+ * let go.
+ **/
+typedef struct {
+    int key;
+    int restore;
+} shift_layer;
 
-mode_type current_mode;
-mode_type last_mode;
+/**
+ * Runtime state of one physical device, shared by all of its event
+ * nodes (an n52 shows up as two).  Everything that changes as keys
+ * are hit lives here, the configs themselves are never written.
+ **/
+typedef struct device_state {
+    char phys[64];              /**< Physical path, less the /inputN */
+    int index;                  /**< Slot, 0 to MAX_DEVICES - 1 */
+    int id;                     /**< Type of device (n50/n52) */
+    int config;                 /**< Config it runs, in the active set */
+    int mode;                   /**< Active mode */
+    shift_layer layers[MAX_SHIFT_LAYERS]; /**< Shift keys held, innermost last */
+    int num_layers;
+    unsigned long pressed;      /**< Bit per key held down */
+    int key_mode[MAX_KEYS];     /**< Mode each held key went down in */
+    unsigned char leds[3];      /**< LED state, red/green/blue */
+    int led_fd;                 /**< Node that takes LED writes, -1 for none */
+    struct device_state* next;
+} device_state;
+
+/** Every physical device seen, kept across unplugs */
+static device_state* devices = NULL;
 
 /*** jimbo - for nostromo state ***/
 #define NOSTROMO_KEY_OFFSET 304
 typedef struct {
+    event_source src;       /**< Must be first, the event loop hands it back */
+    device_state* dev;      /**< Device this node belongs to */
     unsigned char dpad[2];
     unsigned char wheel;
-    unsigned char leds[3];      //bitfields
-    int shift_state;
     int indev;
     int id;                 /**< Type of device (n50/n52) */
+    int mono_clock;         /**< Kernel stamps events with CLOCK_MONOTONIC */
+    struct timespec event_time; /**< Kernel timestamp of the event being handled */
+    struct timespec read_time;  /**< When we read it */
 } nostromo_state;
 
 #define NOSTROMO_X_AXIS 1
@@ -90,673 +154,2637 @@ typedef struct {
 
 int mode = 0;
 
-void set_nostromo_leds(nostromo_state * nost);
+void set_nostromo_leds(device_state* dev);
+void change_mode(device_state* dev, int mode);
 void send_key_sequence(nostromo_state* nost, int key, int release, int from_timer = 0);
+void reload();
+
+int srvfd = 0;  /**< Handle of server socket we're listening on */
+
+/** Send buffer for a TCP remote, a few hundred frames; more queued than that is stale */
+#define REMOTE_SNDBUF 16384
+
+/** Most remotes connected at once, each has a bit in a route */
+#define MAX_REMOTES 16
+
+/** Route bit for playing events here, past every remote's */
+#define ROUTE_LOCAL 0x80000000u
+
+/** Keepalives a UDP remote can miss before it's taken to be gone */
+#define REMOTE_MISSED_KEEPALIVES 3
+
+/** Extra copies of a UDP datagram with releases in it, and the gap between them (ms) */
+#define RESEND_COPIES 2
+#define RESEND_DELAY 10
 
-/** 
- * n52's have 2 devices, and only one of them accepts
- * commands for the LEDs. 
+/** Datagrams held for resending, enough for every one sent in RESEND_COPIES * RESEND_DELAY */
+#define RESEND_SLOTS 16
+
+/** Timer ids resends are queued under, one per remote, past every key's */
+#define RESEND_TIMER_ID (MAX_DEVICES * MAX_KEYS + 1)
+
+/** Timer ids a UDP remote's keepalive is waited for under, one per remote */
+#define EXPIRE_TIMER_ID (RESEND_TIMER_ID + MAX_REMOTES)
+
+/**
+ * A datagram waiting to go out again.
  **/
-nostromo_state* n52_LEDs = NULL;
+typedef struct {
+    uint32_t seq;       /**< Its sequence number, the timer checks it's still this one */
+    int left;           /**< Copies still to send */
+    size_t len;
+    unsigned char buf[WIRE_MAX_DATAGRAM];
+} resend_slot;
 
-int shift_keycode;  /**< SHIFT keycode (shouldn't change, but I'm paranoid) */
-int control_keycode;/**< CTRL keycode (shouldn't change, but I'm paranoid) */
-int meta_keycode;   /**< ALT keycode (shouldn't change, but I'm paranoid) */
+/** Frames for a TCP remote held for the next flush or until it can take them, a few full ones */
+#define REMOTE_OUT_SIZE (5 * (WIRE_HEADER_SIZE + WIRE_MAX_PAYLOAD))
 
-int sockfd = 0; /**< Socket (if connected) to send keystrokes to */
-int srvfd = 0;  /**< Handle of server socket we're listening on */
+/** Macro definitions only go in a TCP remote's queue while it holds less than this, events get the rest */
+#define MACRO_ROOM (WIRE_HEADER_SIZE + WIRE_MAX_PAYLOAD)
+
+/**
+ * A batch of actions a remote has been sent to run itself, by its
+ * macro id.
+ **/
+typedef struct {
+    uint32_t key;       /**< Macro id + 1, 0 for an empty slot */
+    int sent;           /**< All of it's queued, it can be started */
+} macro_slot;
+
+/**
+ * A macro waiting its turn to be sent a remote.
+ **/
+typedef struct {
+    uint32_t id;        /**< Its macro id, where its actions are in the image */
+    int count;          /**< How many actions */
+} macro_def;
+
+/**
+ * One connected remote's side of the wire protocol.  Events for it
+ * are batched up like local ones and go out as one frame per flush.
+ * Each has its own queue; one that can't keep up only holds up itself.
+ **/
+typedef struct {
+    event_source src;   /**< Must be first, the event loop hands it back; the stream over TCP */
+    int active;         /**< Slot's taken, its hello may not be in yet */
+    int ready;          /**< Its hello checked out, events can go */
+    char name[WIRE_MAX_NAME + 1];   /**< What it calls itself, its address if it doesn't say */
+    struct sockaddr_in addr;    /**< Where it's connected from, or said hello from over UDP */
+    uint32_t seq;       /**< Next datagram's sequence number */
+    uint32_t caps;      /**< Capabilities both sides have */
+    int count;          /**< Events in events */
+    uint64_t stamp;     /**< When the first of them was queued, in microseconds */
+    int releases;       /**< How many of them are releases */
+    unsigned char events[WIRE_MAX_PAYLOAD];
+    unsigned char out[REMOTE_OUT_SIZE]; /**< Whole frames for a TCP remote */
+    size_t out_len;
+    int waiting;        /**< Its stream's full, out goes when it can take more */
+    wire_reader in;
+    resend_slot resend[RESEND_SLOTS];
+    int next_resend;    /**< Slot the next datagram with releases goes in */
+    macro_slot* macros; /**< Open addressed on the id, what's been sent it this load */
+    int num_macros;
+    int macros_size;    /**< Slots in macros, a power of 2 */
+    macro_def* defs;    /**< Macros still to go to it, oldest first */
+    int num_defs;
+    int defs_size;
+    int next_def;       /**< The one going out */
+    int def_sent;       /**< How many of its events have */
+} remote_client;
+
+static remote_client remotes[MAX_REMOTES];
+
+/** The route bit of every remote that's ready */
+static unsigned remotes_ready = 0;
+
+/** Remotes are on UDP, datagrams to and from srvfd; otherwise each has a stream */
+static int remote_udp = 0;
 
 int open_readers();
+void add_timer(timer_type type, int id, int key, int arg, int delay, void* data);
+void remove_timer(int id);
+static void rewatch(event_source* src, uint32_t events);
+static void drop_remote(remote_client* c, const char* why);
+static void send_macros(remote_client* c);
 
 /**
- * Send a fake key hit, either to the local server
- * or the remote socket.
+ * A remote's route bit.
  **/
-void send_key(int key, int flags, int remote)
+static unsigned remote_bit(const remote_client* c)
 {
-    key_stroke_type type = STROKE_KEY;
-    if(sockfd > 0 && remote) {
-        printf("Sending key hit to remote\n");
-        if(send(sockfd, &type, sizeof(type), 0) < 0 ||
-           send(sockfd, &key, sizeof(key), 0) < 0 ||
-           send(sockfd, &flags, sizeof(flags), 0) < 0) {
-            syslog(LOG_INFO, "lost remote connection: %m");
-            close(sockfd);
-            sockfd = 0;
-       }
-    } else {
-        printf("%s(%d, %08x)\n", __FUNCTION__, key, flags);
-        XTestFakeKeyEvent(display, key, flags, 0);
-        XFlush(display);
+    return 1u << (c - remotes);
+}
+
+/**
+ * The timestamp for a remote's batch, if it wants them.
+ **/
+static const uint64_t* remote_stamp(const remote_client* c)
+{
+    return (c->caps & WIRE_CAP_TIMED) ? &c->stamp : NULL;
+}
+
+/**
+ * Send a UDP remote's batch, as one datagram.  If it has releases in
+ * it it's kept to go again, if they're lost keys stay down.
+ **/
+static void send_datagram(remote_client* c)
+{
+    unsigned char header[WIRE_HEADER_SIZE + WIRE_SEQ_SIZE + WIRE_STAMP_SIZE];
+    resend_slot* slot;
+    struct iovec iov[2];
+    struct msghdr msg;
+
+    iov[0].iov_base = header;
+    iov[0].iov_len = wire_put_datagram(header, c->seq, c->count, remote_stamp(c));
+    iov[1].iov_base = c->events;
+    iov[1].iov_len = c->count * WIRE_EVENT_SIZE;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = &c->addr;
+    msg.msg_namelen = sizeof(c->addr);
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+
+    /* Nothing to be done if it's dropped, that's what the copies are for */
+    sendmsg(srvfd, &msg, MSG_DONTWAIT);
+
+    if(c->releases) {
+        slot = &c->resend[c->next_resend];
+        c->next_resend = (c->next_resend + 1) % RESEND_SLOTS;
+        memcpy(slot->buf, header, iov[0].iov_len);
+        memcpy(slot->buf + iov[0].iov_len, c->events, iov[1].iov_len);
+        slot->len = iov[0].iov_len + iov[1].iov_len;
+        slot->seq = c->seq;
+        slot->left = RESEND_COPIES;
+        add_timer(TIMER_RESEND, RESEND_TIMER_ID + (c - remotes), -1, (int)slot->seq, RESEND_DELAY, slot);
     }
+    c->seq++;
 }
 
 /**
- * Send a mouse button hit, at whatever the current mouse pos is.
+ * A copy of a datagram is due.
+ * @param seq Which one it was, the slot may have been reused since.
  **/
-void send_mouse_click(int button, int press) {
-    key_stroke_type type = STROKE_MOUSE;
-    if(sockfd > 0) {
-        printf("Sending mouse hit to remote\n");
-        if(send(sockfd, &type, sizeof(type), 0) < 0 ||
-           send(sockfd, &button, sizeof(button), 0) < 0 ||
-           send(sockfd, &press, sizeof(press), 0) < 0) {
-            syslog(LOG_INFO, "lost remote connection: %m");
-            close(sockfd);
-            sockfd = 0;
-       }
-    } else {
-        XTestFakeButtonEvent(display, button, press, CurrentTime);
-        XFlush(display);
+static void resend_datagram(remote_client* c, resend_slot* slot, uint32_t seq)
+{
+    if(!c->ready || !remote_udp || slot->seq != seq || slot->left <= 0) {
+        return;
+    }
+    sendto(srvfd, slot->buf, slot->len, MSG_DONTWAIT,
+           (struct sockaddr*)&c->addr, sizeof(c->addr));
+    if(--slot->left > 0) {
+        add_timer(TIMER_RESEND, RESEND_TIMER_ID + (c - remotes), -1, (int)seq, RESEND_DELAY, slot);
     }
 }
 
-static pthread_mutex_t timer_mtx = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t timer_cnd = PTHREAD_COND_INITIALIZER;
+/**
+ * Have the event loop say when a TCP remote's stream can take more,
+ * or stop saying.
+ **/
+static void wait_writable(remote_client* c, int wait)
+{
+    if(c->waiting != wait) {
+        c->waiting = wait;
+        rewatch(&c->src, EPOLLIN | EPOLLRDHUP | (wait ? EPOLLOUT : 0));
+    }
+}
 
 /**
- * Actions that we can schedule to happen in the future.  They are scheduled
- * in response to user actions (key presses) and delayed until wanted.
+ * Send what's waiting for a TCP remote, as much as its stream will
+ * take without blocking.  The rest stays queued until it can take it.
  **/
-typedef enum {
-    TIMER_REPEAT_KEY,   /**< Repeat key sequence when timer expires */
-    TIMER_PRESS_KEY,    /**< Press/release single key when timer expires */
-    TIMER_MOUSE_CLICK,  /**< Press/release mouse button when timer expires */
-} timer_type;
+static void send_out(remote_client* c)
+{
+    size_t at = 0;
+    ssize_t len;
+
+    /* Comes back short if a signal gets in or the send buffer fills */
+    while(at < c->out_len) {
+        if((len = write(c->src.fd, c->out + at, c->out_len - at)) < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            if(errno == EAGAIN) {
+                break;
+            }
+            drop_remote(c, "lost remote connection");
+            return;
+        }
+        at += len;
+    }
+    memmove(c->out, c->out + at, c->out_len - at);
+    c->out_len -= at;
+    wait_writable(c, c->out_len > 0);
+}
 
 /**
- * A simple way to schedule things to happen in the future.
+ * Make room for a frame to a TCP remote.  If its queue is still full
+ * once its stream has taken what it will, it's fallen too far behind
+ * for what's queued to mean anything and is dropped.
+ * @return 0 if the remote's gone.
  **/
-typedef struct timer_entry {
-    struct timer_entry* next;
-    struct timeval expires;
-    int id;
-    timer_type type;
-    int arg;
-    int flag;
-    int delay;
-    int remote;
-} timer_entry;
+static int make_room(remote_client* c, size_t len)
+{
+    if(c->ready && c->out_len + len > sizeof(c->out)) {
+        send_out(c);
+        if(c->ready && c->out_len + len > sizeof(c->out)) {
+            drop_remote(c, "remote fell behind,");
+        }
+    }
+    return c->ready;
+}
 
 /**
- * A list of timers that the timer_thread is waiting for.
+ * Close off the events queued for a TCP remote as a frame, so
+ * anything after them goes after them.
  **/
-timer_entry* timer_list = NULL;
+static void end_events(remote_client* c)
+{
+    size_t len = c->count * WIRE_EVENT_SIZE;
+
+    if(c->count == 0) {
+        return;
+    }
+    c->count = 0;
+    c->releases = 0;
+    if(!make_room(c, WIRE_HEADER_SIZE + WIRE_STAMP_SIZE + len)) {
+        return;
+    }
+    c->out_len += wire_put_events(c->out + c->out_len, len / WIRE_EVENT_SIZE, remote_stamp(c));
+    memcpy(c->out + c->out_len, c->events, len);
+    c->out_len += len;
+}
 
 /**
- * Make something happen sometime in the future.
+ * Room for a frame to a TCP remote, after whatever's queued.
+ * @return Where to write it, or NULL if the remote's gone.
  **/
-void add_timer(timer_type type, int id, int arg, int flag, int delay, int remote)
+static unsigned char* reserve_frame(remote_client* c, size_t len)
 {
-  timer_entry *e = NULL;
-  timer_entry *l = NULL;
-  timer_entry *last = NULL;
-  struct timeval now;
+    unsigned char* p;
 
-  gettimeofday(&now, NULL);
-  e = (timer_entry*)calloc(1, sizeof(timer_entry));
+    end_events(c);
+    if(!make_room(c, len)) {
+        return NULL;
+    }
+    p = c->out + c->out_len;
+    c->out_len += len;
+    return p;
+}
 
-  if(e) {
-    /* Set the wakeup time */
-    e->expires.tv_sec = now.tv_sec + delay / 1000;
-    e->expires.tv_usec = now.tv_usec + (delay % 1000) * 100;
-    e->type = type;
-    e->arg = arg;
-    e->flag = flag;
-    e->delay = delay;
-    e->id = id;
-    e->remote = remote;
-
-    /* Add to timer list */
-    pthread_mutex_lock(&timer_mtx);
-
-    /* Insert in order sorted by wakeup time */
-    last = NULL;
-    for(l = timer_list; l; l = l->next) {
-      if(timercmp(&l->expires, &e->expires, >=)) {
-        if(l == timer_list) {
-          e->next = timer_list;
-          timer_list = e;
-        } else {
-          last->next = e;
-          e->next = l;
+/**
+ * Send a remote's batch, with everything else queued for it in one
+ * write(), or as one datagram.
+ **/
+static void flush_remote(remote_client* c)
+{
+    if(remote_udp) {
+        if(c->count) {
+            send_datagram(c);
+            c->count = 0;
+            c->releases = 0;
         }
-        break;
-      }
-      last = l;
+        return;
     }
-
-    if(l == NULL) {
-      if(last) {                /* Past end, back up and append */
-        last->next = e;
-      } else {                  /* No list head, make one */
-        timer_list = e;
-      }
+    if(c->num_defs) {
+        send_macros(c);
+        return;
+    }
+    end_events(c);
+    if(c->out_len && !c->waiting) {
+        send_out(c);
     }
-
-    pthread_cond_signal(&timer_cnd);
-    pthread_mutex_unlock(&timer_mtx);
-  }
 }
 
 /**
- * Clear a set of timers with matching ids out of the list we 
- * are monitoring.
+ * Send every remote's batch.
  **/
-void remove_timer(int id)
+static void flush_remotes()
 {
-    timer_entry *e = NULL;
-    timer_entry *tmp = NULL;
-    timer_entry *last = NULL;
-
-    pthread_mutex_lock(&timer_mtx);
-    e = timer_list;
-    while(e) {
-        if(e->id == id) {
-            if(e == timer_list) {
-                timer_list = e->next;
-                free(e);
-                last = NULL;
-                e = timer_list;
-            } else {
-                last->next = e->next;
-                free(e);
-                e = last->next;
-            }
-        } else {
-            last = e;
-            e = e->next;
+    int n;
+
+    for(n = 0; n < MAX_REMOTES; n++) {
+        if(remotes_ready & (1u << n)) {
+            flush_remote(&remotes[n]);
         }
     }
-    pthread_cond_signal(&timer_cnd);
-    pthread_mutex_unlock(&timer_mtx);
 }
 
 /**
- * Waits for each timer in its queue to expire, then executes the
- * required action.
+ * Queue an event for a remote, sending the batch if it's full.
  **/
-void* timer_thread(void*)
+static void queue_remote(remote_client* c, int mouse, int code, int press)
 {
-    struct timespec timeout;
-    struct timeval now;
-    timer_entry* t;
+    struct timespec now;
 
-    while(1) {
-        pthread_mutex_lock(&timer_mtx);
-        if(timer_list) {
-            timeout.tv_sec = timer_list->expires.tv_sec;
-            timeout.tv_nsec = timer_list->expires.tv_usec * 1000;
+    if(c->count == 0 && (c->caps & WIRE_CAP_TIMED)) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        c->stamp = now.tv_sec * 1000000ULL + now.tv_nsec / 1000;
+    }
+    wire_put_event(&c->events[c->count * WIRE_EVENT_SIZE], mouse, code, press);
+    if(!press) {
+        c->releases++;
+    }
+    if(++c->count == (remote_udp ? WIRE_MAX_DATAGRAM_EVENTS : WIRE_MAX_EVENTS)) {
+        if(remote_udp) {
+            flush_remote(c);
         } else {
-            gettimeofday(&now, NULL);
-            timeout.tv_sec = now.tv_sec + 3;
-            timeout.tv_nsec = now.tv_usec * 1000;
+            end_events(c);
         }
+    }
+}
 
-        pthread_cond_timedwait(&timer_cnd, &timer_mtx, &timeout);
+/**
+ * The remotes a key's targets name, those that are connected.  If
+ * none are, it's played here as a remote key always was with no
+ * remote.
+ * @param targets program_route(), NULL for every remote.
+ * @return Route bits.
+ **/
+static unsigned resolve_route(const char* targets)
+{
+    unsigned route = 0;
+    const char* end;
+    size_t len;
+    int n;
 
-        t = NULL;
-        if(timer_list) {
-            gettimeofday(&now, NULL);
-            /* See if our earliest timer has expired */
-            if(timercmp(&now, &timer_list->expires, >=)) {
-                t = timer_list;
-                timer_list = timer_list->next;
+    if(targets == NULL) {
+        route = remotes_ready;
+    }
+    for(; targets && *targets; targets = *end ? end + 1 : end) {
+        while(*targets == ' ') {
+            targets++;
+        }
+        end = strchrnul(targets, ',');
+        for(len = end - targets; len && targets[len - 1] == ' '; len--)
+            ;
+        if(len == sizeof(TARGET_LOCAL) - 1 && !strncmp(targets, TARGET_LOCAL, len)) {
+            route |= ROUTE_LOCAL;
+            continue;
+        }
+        for(n = 0; n < MAX_REMOTES; n++) {
+            if((remotes_ready & (1u << n)) && !strncmp(remotes[n].name, targets, len) && remotes[n].name[len] == 0) {
+                route |= 1u << n;
             }
         }
-        pthread_mutex_unlock(&timer_mtx);
+    }
+    return (route & ~ROUTE_LOCAL) ? route : route | ROUTE_LOCAL;
+}
 
-        if(t) {
-            switch(t->type) {
-                case TIMER_REPEAT_KEY:
-                    printf("TIMER_REPEAT_KEY: repeating %d\n", t->arg);
-                    send_key_sequence((nostromo_state*)t->flag, t->arg, 0, 1);
-                    break;
+/**
+ * Where one of a key's actions goes.  Mouse buttons on keys that
+ * aren't remote go to every remote, as they always have.
+ * @param route resolve_route() for the key.
+ **/
+static unsigned action_route(const nost_action* a, unsigned route)
+{
+    if(a->sink & ACTION_REMOTE) {
+        return route;
+    }
+    if((a->sink & ACTION_MOUSE) && remotes_ready) {
+        return remotes_ready;
+    }
+    return ROUTE_LOCAL;
+}
 
-                case TIMER_PRESS_KEY:
-                    printf("TIMER_PRESS_KEY:  %d (flag:%d)\n", t->arg, t->flag);
-                    send_key(t->arg, t->flag, t->remote);
-                    break;
+/**
+ * Where every one of a batch of actions goes.
+ **/
+static unsigned batch_route(const nost_action* actions, int count, unsigned route)
+{
+    unsigned common = ~0u;
+    int n;
 
-                case TIMER_MOUSE_CLICK:
-                    printf("TIMER_MOUSE_CLICK:  %d (flag:%d)\n", t->arg, t->flag);
-                    send_mouse_click(t->arg, t->flag);
-                    break;
-            }
-            free(t);
-        }
+    for(n = 0; n < count && common; n++) {
+        common &= action_route(&actions[n], route);
     }
+    return common;
 }
 
 /**
- * Set a key to be pressed after some delay (or 0 for now)
+ * Whether a remote runs macros itself.  Not over UDP, where a lost
+ * definition or trigger would go unnoticed.
  **/
-void enqueue_key(int id, int key, int flags, int delay, int remote) {
-    add_timer(TIMER_PRESS_KEY, id, key, flags, delay, remote);
+static int remote_runs_macros(const remote_client* c)
+{
+    return c->ready && !remote_udp && (c->caps & WIRE_CAP_MACROS);
 }
 
 /**
- * Set a key to be pressed after some delay (or 0 for now)
+ * Forget every macro the remotes were sent, and tell them to.  Their
+ * ids are where they are in the image, so they go with it.
  **/
-void enqueue_mouse_click(int id, int button, int flags, int delay, int remote) {
-    add_timer(TIMER_MOUSE_CLICK, id, button, flags, delay, remote);
+static void forget_macros()
+{
+    remote_client* c;
+    unsigned char* p;
+
+    for(c = remotes; c < remotes + MAX_REMOTES; c++) {
+        if(c->num_macros == 0) {
+            continue;
+        }
+        memset(c->macros, 0, c->macros_size * sizeof(macro_slot));
+        c->num_macros = 0;
+        c->num_defs = 0;
+        c->next_def = 0;
+        c->def_sent = 0;
+        if(remote_runs_macros(c) && (p = reserve_frame(c, WIRE_HEADER_SIZE)) != NULL) {
+            wire_put_header(p, WIRE_FORGET, 0);
+        }
+    }
 }
 
 /**
- * Send the 'modifier' keycodes, e.g. shift, control, alt.
+ * Find a macro's slot for a remote, making one if it's new.
+ * @return NULL if out of memory.
  **/
-void enqueue_modifiers(int key, int state, int pressed, int delay, int remote)
+static macro_slot* find_macro(remote_client* c, uint32_t id)
 {
-    /* Press necessary modifiers */
-    if(state & ShiftMask) {
-        enqueue_key(key, shift_keycode, pressed, delay, remote);
-    }
-    if(state & ControlMask) {
-        enqueue_key(key, control_keycode, pressed, delay, remote);
+    macro_slot* old = c->macros;
+    int size = c->macros_size;
+    unsigned n;
+    int i;
+
+    /* Kept under half full */
+    if(2 * (c->num_macros + 1) > c->macros_size) {
+        c->macros_size = size ? 2 * size : 256;
+        if((c->macros = (macro_slot*)calloc(c->macros_size, sizeof(macro_slot))) == NULL) {
+            c->macros = old;
+            c->macros_size = size;
+            return NULL;
+        }
+        for(i = 0; i < size; i++) {
+            if(old[i].key) {
+                n = old[i].key * 2654435761u;
+                while(c->macros[n & (c->macros_size - 1)].key) {
+                    n++;
+                }
+                c->macros[n & (c->macros_size - 1)] = old[i];
+            }
+        }
+        free(old);
     }
-    if(state & Mod1Mask) {
-        enqueue_key(key, meta_keycode, pressed, delay, remote);
+
+    n = (id + 1) * 2654435761u;
+    while(c->macros[n & (c->macros_size - 1)].key != 0 &&
+          c->macros[n & (c->macros_size - 1)].key != id + 1) {
+        n++;
     }
+    return &c->macros[n & (c->macros_size - 1)];
 }
 
 /**
- * Set the input mode to the given value.  Value should be one
- * of the MODE constants.
+ * Send a TCP remote as much of its macro backlog, each macro's events
+ * and their offsets in as many frames as it takes, as goes without
+ * holding up its events.  Definitions only go in while its queue is
+ * close to empty, so they never count towards it falling behind; the
+ * rest follow as its stream takes these.
  **/
-void change_mode(nostromo_state* nost, mode_type mode) 
+static void send_macros(remote_client* c)
 {
-    current_mode = mode;
+    const nost_action* actions;
+    macro_slot* slot;
+    macro_def* d;
+    unsigned char* p;
+    size_t len;
+    int n, i;
+
+    end_events(c);
+    while(c->ready && c->next_def < c->num_defs) {
+        d = &c->defs[c->next_def];
+        n = d->count - c->def_sent < (int)WIRE_MAX_MACRO_EVENTS ? d->count - c->def_sent : WIRE_MAX_MACRO_EVENTS;
+        len = WIRE_HEADER_SIZE + WIRE_MACRO_HEADER_SIZE + n * WIRE_MACRO_EVENT_SIZE;
+        if(c->out_len + len > MACRO_ROOM) {
+            if(c->waiting) {
+                break;
+            }
+            send_out(c);
+            continue;
+        }
+        p = c->out + c->out_len;
+        c->out_len += len;
+        p += wire_put_macro(p, d->id, d->count, c->def_sent, n);
+        actions = (const nost_action*)((const char*)cfg_image + d->id);
+        for(i = c->def_sent; i < c->def_sent + n; i++) {
+            p += wire_put_macro_event(p, actions[i].sink & ACTION_MOUSE, actions[i].code,
+                                      actions[i].value, actions[i].offset);
+        }
+        if((c->def_sent += n) == d->count) {
+            if((slot = find_macro(c, d->id)) != NULL) {
+                slot->sent = 1;
+            }
+            c->next_def++;
+            c->def_sent = 0;
+        }
+    }
+    if(c->next_def == c->num_defs) {
+        c->num_defs = 0;
+        c->next_def = 0;
+    }
+    if(c->ready && c->out_len && !c->waiting) {
+        send_out(c);
+    }
+}
 
-    nost->leds[0] =
-    nost->leds[1] =
-    nost->leds[2] = 0;
+/**
+ * Put a macro on the end of a remote's backlog, send_macros() sends it.
+ * @return 0 if out of memory.
+ **/
+static int queue_macro(remote_client* c, uint32_t id, int count)
+{
+    macro_def* defs;
+    int size;
 
-    switch(mode) {
-        case NORMAL_MODE:
-            break;
-        case BLUE_MODE:
-            nost->leds[2] = 1;
-            break;
-        case GREEN_MODE:
-            nost->leds[1] = 1;
-            break;
-        case RED_MODE:
-            nost->leds[0] = 1;
-            break;
+    if(c->num_defs == c->defs_size) {
+        size = c->defs_size ? 2 * c->defs_size : 64;
+        if((defs = (macro_def*)realloc(c->defs, size * sizeof(macro_def))) == NULL) {
+            return 0;
+        }
+        c->defs = defs;
+        c->defs_size = size;
     }
+    c->defs[c->num_defs].id = id;
+    c->defs[c->num_defs].count = count;
+    c->num_defs++;
+    return 1;
+}
+
+/**
+ * Make sure a remote has, or is getting, a batch of actions.  Only
+ * batches where every action goes to it should be, batch_route() says
+ * which.  Until all of it has been queued for it, it's played here.
+ * @return The slot if it can be started, NULL if not yet, or out of
+ *         memory.
+ **/
+static macro_slot* ship_macro(remote_client* c, const nost_action* actions, int count)
+{
+    uint32_t id = (const char*)actions - (const char*)cfg_image;
+    macro_slot* slot;
 
-    set_nostromo_leds(nost);
+    if((slot = find_macro(c, id)) == NULL) {
+        return NULL;
+    }
+    if(slot->key == 0) {
+        /* One that can't be queued stays unsent, and is always played here */
+        slot->key = id + 1;
+        slot->sent = 0;
+        c->num_macros++;
+        queue_macro(c, id, count);
+    }
+    return slot->sent ? slot : NULL;
 }
 
 /**
- * User hit one of the keys on the Nostromo, we need to pump
- * all of the inputs that correspond to whatever the chosen
- * key was.
+ * Have the remotes that get every one of a batch of actions, and can
+ * run it, run it themselves.
+ * @param id Timer id it would have had here, a WIRE_STOP for that
+ *           cancels it.
+ * @param route resolve_route() for the key.
+ * @return Route bits of the remotes that are running it.
  **/
-void send_key_sequence(nostromo_state* nost, int key, int release, int from_timer /* = 0 */)
+static unsigned start_remote_macros(int id, const nost_action* actions, int count, unsigned route)
 {
+    unsigned common = batch_route(actions, count, route) & remotes_ready;
+    unsigned started = 0;
+    macro_slot* slot;
+    unsigned char* p;
     int n;
-    int id = key;
 
-    /* Only timer-created keystrokes have IDs that match the parent */
-    if(!from_timer) {
-        id = 0;
+    for(n = 0; common && n < MAX_REMOTES; n++) {
+        if(!(common & (1u << n)) || !remote_runs_macros(&remotes[n])
+        || (slot = ship_macro(&remotes[n], actions, count)) == NULL) {
+            continue;
+        }
+        if((p = reserve_frame(&remotes[n], WIRE_HEADER_SIZE + WIRE_START_SIZE)) != NULL) {
+            wire_put_start(p, slot->key - 1, id < 0 ? WIRE_NO_GROUP : id);
+            started |= 1u << n;
+        }
     }
+    return started;
+}
 
-    printf("%ld: %s(%p, %d, %d)\n", time(NULL), __FUNCTION__, nost, key, release);
+/**
+ * Cancel what the remotes have left of macros started under a timer id.
+ **/
+static void stop_remote_macros(int id)
+{
+    unsigned char* p;
+    int n;
 
-    if(release && last_mode != NULL_MODE) {
-        switch(cfg->keys[last_mode][key].type) {
-            case NORMAL_SHIFT:
-            case BLUE_SHIFT:
-            case GREEN_SHIFT:
-            case RED_SHIFT:
-                change_mode(nost, last_mode);
-                last_mode = NULL_MODE;
-                return;
+    for(n = 0; n < MAX_REMOTES; n++) {
+        if(remote_runs_macros(&remotes[n]) && (p = reserve_frame(&remotes[n], WIRE_HEADER_SIZE + WIRE_STOP_SIZE)) != NULL) {
+            wire_put_stop(p, id);
         }
     }
+}
 
-    /* Only press keys when it's not a key release being sent */
-    switch(cfg->keys[current_mode][key].type) {
-        case SINGLE_KEY:
-            for(n = 0; n < cfg->keys[current_mode][key].key_count; n++) {
-                enqueue_modifiers(id, cfg->keys[current_mode][key].data[n].state, 1, cfg->keys[current_mode][key].data[n].delay, cfg->keys[current_mode][key].remote);
-                if(cfg->keys[current_mode][key].data[n].type == STROKE_KEY) {
-                    enqueue_key(id, cfg->keys[current_mode][key].data[n].code, !release, cfg->keys[current_mode][key].data[n].delay, cfg->keys[current_mode][key].remote);
-                } else if(cfg->keys[current_mode][key].data[n].type == STROKE_MOUSE) {
-                    enqueue_mouse_click(id, cfg->keys[current_mode][key].data[n].code, !release, cfg->keys[current_mode][key].data[n].delay, cfg->keys[current_mode][key].remote);
-                }
-                enqueue_modifiers(id, cfg->keys[current_mode][key].data[n].state, 0, cfg->keys[current_mode][key].data[n].delay, cfg->keys[current_mode][key].remote);
-            }
-            break;
-        case MULTI_KEY:
-            /* Nostromo key was pressed, send all the corresponding mapped keys */
-            if(!release) {
-                int delay = 0;
-                for(n = 0; n < cfg->keys[current_mode][key].key_count; n++) {
-                    /* Note: The small 'fudge' on each delay forces them into the right order in the timing queue. */
-                    enqueue_modifiers(id, cfg->keys[current_mode][key].data[n].state, 1, delay + cfg->keys[current_mode][key].data[n].delay, cfg->keys[current_mode][key].remote);
-                    if(cfg->keys[current_mode][key].data[n].type == STROKE_KEY) {
-                        enqueue_key(id, cfg->keys[current_mode][key].data[n].code, 1, delay + cfg->keys[current_mode][key].data[n].delay + 1, cfg->keys[current_mode][key].remote);
-                        enqueue_key(id, cfg->keys[current_mode][key].data[n].code, 0, delay + cfg->keys[current_mode][key].data[n].delay + 2, cfg->keys[current_mode][key].remote);
-                    } else if(cfg->keys[current_mode][key].data[n].type == STROKE_MOUSE) {
-                        enqueue_mouse_click(id, cfg->keys[current_mode][key].data[n].code, 1, cfg->keys[current_mode][key].data[n].delay + 3, cfg->keys[current_mode][key].remote);
-                        enqueue_mouse_click(id, cfg->keys[current_mode][key].data[n].code, 0, cfg->keys[current_mode][key].data[n].delay + 4, cfg->keys[current_mode][key].remote);
+/**
+ * Queue everything in the devices' configs each remote gets all of and
+ * can run itself, so the first press doesn't wait on it.  Anything else
+ * goes the first time it's used.  It's sent as flush_remote() gets to
+ * it, keys are played here until then.
+ **/
+static void push_macros()
+{
+    const nost_program* prog;
+    const nost_key_program* p;
+    device_state* dev;
+    unsigned route;
+    int m, k, n;
+
+    for(n = 0; n < MAX_REMOTES; n++) {
+        if(!remote_runs_macros(&remotes[n])) {
+            continue;
+        }
+        for(dev = devices; dev && remote_runs_macros(&remotes[n]); dev = dev->next) {
+            prog = image_program(cfg_image, dev->config);
+            for(m = 0; m < prog->num_modes; m++) {
+                for(k = 0; k < MAX_KEYS; k++) {
+                    p = &prog->modes[m].keys[k];
+                    route = resolve_route(program_route(prog, p));
+                    if(p->press_count && (batch_route(press_actions(prog, p), p->press_count, route) & (1u << n))) {
+                        ship_macro(&remotes[n], press_actions(prog, p), p->press_count);
+                    }
+                    if(p->release_count && (batch_route(release_actions(prog, p), p->release_count, route) & (1u << n))) {
+                        ship_macro(&remotes[n], release_actions(prog, p), p->release_count);
                     }
-                    enqueue_modifiers(id, cfg->keys[current_mode][key].data[n].state, 0, delay + cfg->keys[current_mode][key].data[n].delay + 5, cfg->keys[current_mode][key].remote);
-                    delay += cfg->keys[current_mode][key].data[n].delay + 10;
-                }
-
-                if(cfg->keys[current_mode][key].repeat) {
-                    add_timer(TIMER_REPEAT_KEY, key, key, (int)(long long)nost, cfg->keys[current_mode][key].repeat_delay + delay, cfg->keys[current_mode][key].remote);
-                }
-            } else {
-                if(cfg->keys[current_mode][key].repeat) {
-                    remove_timer(key);
                 }
             }
-        break;
+        }
+    }
+}
 
-        case NORMAL_SHIFT:
-        case BLUE_SHIFT:
-        case GREEN_SHIFT:
-        case RED_SHIFT:
-            if(!release) {
-                last_mode = current_mode;
-                switch(cfg->keys[current_mode][key].type) {
-                    case NORMAL_SHIFT:
-                        change_mode(nost, NORMAL_MODE);
-                        break;
-                    case BLUE_SHIFT:
-                        change_mode(nost, BLUE_MODE);
-                        break;
-                    case GREEN_SHIFT:
-                        change_mode(nost, GREEN_MODE);
-                        break;
-                    case RED_SHIFT:
-                        change_mode(nost, RED_MODE);
-                        break;
-                }
-            }
-            break;
+/**
+ * Send a fake key hit to wherever its route says: the local server,
+ * remotes, or both.  Events are only queued, flush_output() sends
+ * them.  A remote key whose remotes have all gone since goes local.
+ * @param route Route bits.
+ **/
+void send_key(int key, int flags, unsigned route)
+{
+    int n;
 
-        case NORMAL_LOCK:
-            if(!release) {
-                change_mode(nost, NORMAL_MODE);
-            }
-            break;
-        case BLUE_LOCK:
-            if(!release) {
-                change_mode(nost, BLUE_MODE);
-            }
-            break;
-        case GREEN_LOCK:
-            if(!release) {
-                change_mode(nost, GREEN_MODE);
-            }
-            break;
-        case RED_LOCK:
-            if(!release) {
-                change_mode(nost, RED_MODE);
-            }
-            break;
-        case SHIFT_KEY:
-            printf("shift_key: %d\n", (!release ? 1 : 0));
-            enqueue_key(shift_keycode, shift_keycode, !release, 0, cfg->keys[current_mode][key].remote);
-            break;
-        case CONTROL_KEY:
-            printf("control_key: %d\n", (!release ? 1 : 0));
-            enqueue_key(control_keycode, control_keycode, !release, 0, cfg->keys[current_mode][key].remote);
-            break;
-        case ALT_KEY:
-            enqueue_key(meta_keycode, meta_keycode, !release, 0, cfg->keys[current_mode][key].remote);
-            break;
+    if(route && !(route & (remotes_ready | ROUTE_LOCAL))) {
+        route = ROUTE_LOCAL;
+    }
+    if(route & ROUTE_LOCAL) {
+        printf("%s(%d, %08x)\n", __FUNCTION__, key, flags);
+        output_key(output, key, flags);
+    }
+    for(route &= remotes_ready, n = 0; route; n++) {
+        if(route & (1u << n)) {
+            queue_remote(&remotes[n], 0, key, flags);
+            route &= ~(1u << n);
+        }
+    }
+}
+
+/**
+ * Send a mouse button hit, at whatever the current mouse pos is.
+ * Routed and queued like send_key().
+ **/
+void send_mouse_click(int button, int press, unsigned route) {
+    int n;
+
+    if(route && !(route & (remotes_ready | ROUTE_LOCAL))) {
+        route = ROUTE_LOCAL;
+    }
+    if(route & ROUTE_LOCAL) {
+        output_button(output, button, press);
+    }
+    for(route &= remotes_ready, n = 0; route; n++) {
+        if(route & (1u << n)) {
+            queue_remote(&remotes[n], 1, button, press);
+            route &= ~(1u << n);
+        }
+    }
+}
+
+/**
+ * Push out whatever send_key() and send_mouse_click() have queued.
+ **/
+void flush_output()
+{
+    output_flush(output);
+    flush_remotes();
+}
+
+/**
+ * Queue one compiled action, for the next flush_output().
+ * @param route Route bits for it, action_route().
+ **/
+void send_action(const nost_action* a, unsigned route)
+{
+    if(a->sink & ACTION_MOUSE) {
+        send_mouse_click(a->code, a->value, route);
+    } else {
+        send_key(a->code, a->value, route);
+    }
+}
+
+/** Most epoll events taken per wakeup */
+#define MAX_EVENTS 32
+
+/** Most input events taken from a device per read() */
+#define READ_BATCH 64
+
+/**
+ * Everything the daemon does is driven from one epoll set, on one
+ * thread: device input, timers, signals, the network and requests
+ * from the docklet.  No locks, nothing else touches daemon state.
+ **/
+static int epoll_fd = -1;
+
+static event_source timer_src;      /**< Scheduler timerfd */
+static event_source signal_src;     /**< signalfd for everything we handle */
+static event_source listen_src;     /**< Listening socket for remotes */
+static event_source docklet_src;    /**< Read end of docklet_pipe */
+
+/**
+ * Config selections from the docklet's menu, which runs on the GTK
+ * thread, are passed over this to the event loop.
+ **/
+static int docklet_pipe[2] = { -1, -1 };
+
+/**
+ * Start watching an fd.
+ **/
+static void watch(event_source* src, int fd, void (*ready)(event_source*, uint32_t), uint32_t events)
+{
+    struct epoll_event ev;
+
+    src->fd = fd;
+    src->ready = ready;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.ptr = src;
+    if(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        syslog(LOG_ERR, "epoll_ctl(%d): %m", fd);
+    }
+}
+
+/**
+ * Change what's watched for on an fd.
+ **/
+static void rewatch(event_source* src, uint32_t events)
+{
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.ptr = src;
+    if(epoll_ctl(epoll_fd, EPOLL_CTL_MOD, src->fd, &ev) < 0) {
+        syslog(LOG_ERR, "epoll_ctl(%d): %m", src->fd);
+    }
+}
+
+/**
+ * Timers that the event loop is waiting for.
+ **/
+static timer_queue timers;
+
+/**
+ * Timers queued per nostromo key and not yet fired or cancelled.  A key
+ * with nothing in flight can have its zero-delay strokes injected on
+ * the spot without jumping ahead of itself.  Indexed by key_slot().
+ **/
+static int inflight[MAX_DEVICES * MAX_KEYS];
+
+/**
+ * A key on a particular device, used as the timer key and repeat id so
+ * that devices don't cancel or hold up each other's keys.
+ **/
+static int key_slot(const device_state* dev, int key)
+{
+    return dev->index * MAX_KEYS + key;
+}
+
+/**
+ * Latency from one stage of the input-to-injection pipeline to the next.
+ * All in CLOCK_MONOTONIC; the evdev timestamps are switched over to it
+ * when the device is opened.
+ **/
+static histogram input_latency = { "evdev->read" };          /**< Kernel timestamp to read() returning */
+static histogram dispatch_latency = { "read->dispatch" };     /**< read() to the strokes being handed off */
+static histogram fire_lateness = { "deadline->fire" };       /**< How late timers fire against their deadline */
+static histogram inject_latency = { "fire->flush" };         /**< Firing to the flush of its batch */
+static histogram fast_path_latency = { "evdev->flush (fast path)" }; /**< Zero-delay strokes done on the spot */
+static histogram timer_path_latency = { "evdev->flush (timer)" };    /**< Strokes done from the timer queue, less their delay */
+static histogram wakeup_cpu = { "cpu per wakeup" };          /**< CPU time spent on one pass of the event loop */
+
+/**
+ * Event loop counters.
+ **/
+static struct {
+    unsigned long wakeups;      /**< Times epoll_wait() returned */
+    unsigned long events;       /**< fds found ready */
+    unsigned long input_events; /**< input_events read from devices */
+} loop_stats;
+
+/**
+ * CLOCK_MONOTONIC timerfd, always armed for the head of the timer queue
+ * (or disarmed when the queue is empty, so an idle daemon never wakes).
+ **/
+static int timer_fd = -1;
+
+/** What timer_fd is currently armed for, zero when disarmed */
+static struct timespec timer_armed;
+
+/** Most due timers fired before a flush is forced */
+#define FIRE_BATCH 64
+
+/**
+ * Point the timerfd at the earliest timer, if it isn't already.
+ **/
+static void arm_timer_fd()
+{
+    struct itimerspec its;
+    timer_entry* head = timer_queue_peek(&timers);
+
+    memset(&its, 0, sizeof(its));
+    if(head) {
+        its.it_value = head->expires;
+    }
+    if(its.it_value.tv_sec == timer_armed.tv_sec && its.it_value.tv_nsec == timer_armed.tv_nsec) {
+        return;
+    }
+    if(timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &its, NULL) < 0) {
+        syslog(LOG_ERR, "timerfd_settime: %m");
+    }
+    timer_armed = its.it_value;
+}
+
+/**
+ * Done with a timer, fired or cancelled.
+ **/
+static void release_timer(timer_entry* e)
+{
+    if(e->key >= 0) {
+        inflight[e->key]--;
+    }
+    timer_entry_free(e);
+}
+
+/**
+ * Queue one timer on the heap.
+ **/
+static void schedule(timer_entry* e)
+{
+    if(e->key >= 0) {
+        inflight[e->key]++;
+    }
+    if(timer_queue_push(&timers, e) < 0) {
+        release_timer(e);
+        timer_stats.drops++;
+    }
+}
+
+/**
+ * Make something happen sometime in the future.
+ **/
+void add_timer(timer_type type, int id, int key, int arg, int delay, void* data)
+{
+    timer_entry* e;
+
+    if((e = timer_entry_alloc()) == NULL) {
+        return;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &e->origin);
+    e->expires = e->origin;
+    timespec_add_ms(&e->expires, delay);
+    e->type = type;
+    e->arg = arg;
+    e->delay = delay;
+    e->id = id;
+    e->key = key;
+    e->data = data;
+    schedule(e);
+}
+
+/**
+ * Run a batch of compiled actions for a key slot, timed from now.  Remotes
+ * that get all of it and can run it themselves are left to.  When the
+ * key has nothing in flight its leading zero-delay actions are injected
+ * on the spot; the rest are queued as timers.
+ * @param from Device whose input event this is, NULL for repeats.
+ * @param route resolve_route() for the key.
+ **/
+void add_timer_batch(int id, int key, const nost_action* actions, int count, const nostromo_state* from,
+                     unsigned route)
+{
+    struct timespec base;
+    struct timespec origin;
+    struct timespec done;
+    timer_entry* e;
+    unsigned started;
+    unsigned to;
+    int sent = 0;
+    int n = 0;
+
+    if(count <= 0) {
+        return;
+    }
+    started = start_remote_macros(id, actions, count, route);
+
+    clock_gettime(CLOCK_MONOTONIC, &base);
+    if(from) {
+        hist_record_span(&dispatch_latency, &from->read_time, &base);
+        origin = from->event_time;
+    } else {
+        origin = base;
+    }
+
+    if(inflight[key] == 0) {
+        for(; n < count && actions[n].offset == 0; n++) {
+            if((to = action_route(&actions[n], route) & ~started) != 0) {
+                send_action(&actions[n], to);
+                sent++;
+            }
+        }
+        if(sent) {
+            flush_output();
+            clock_gettime(CLOCK_MONOTONIC, &done);
+            hist_record_span(&fast_path_latency, &origin, &done);
+        }
+    }
+
+    for(; n < count; n++) {
+        if((to = action_route(&actions[n], route) & ~started) == 0) {
+            continue;
+        }
+        if((e = timer_entry_alloc()) == NULL) {
+            break;
+        }
+        e->expires = base;
+        timespec_add_ms(&e->expires, actions[n].offset);
+        e->type = (actions[n].sink & ACTION_MOUSE) ? TIMER_MOUSE_CLICK : TIMER_PRESS_KEY;
+        e->arg = actions[n].code;
+        e->flag = actions[n].value;
+        e->delay = actions[n].offset;
+        e->id = id;
+        e->key = key;
+        e->origin = origin;
+        e->remote = to;
+        schedule(e);
+    }
+}
+
+/**
+ * Clear a set of timers with matching ids out of the queue we 
+ * are monitoring.
+ **/
+void remove_timer(int id)
+{
+    timer_queue_cancel(&timers, id, release_timer);
+}
+
+/**
+ * LED patterns for the startup light show, one every LED_SHOW_STEP ms.
+ **/
+static const int led_show[][3] = {
+    { 0, 0, 0 },
+    { 1, 0, 0 },
+    { 0, 1, 0 },
+    { 0, 0, 1 },
+    { 0, 1, 0 },
+    { 1, 0, 0 },
+    { 0, 0, 0 },
+};
+#define LED_SHOW_STEP 200
+
+/**
+ * Queue up whatever a due timer asks for.
+ **/
+static void fire_timer(timer_entry* t)
+{
+    device_state* dev;
+
+    switch(t->type) {
+        case TIMER_REPEAT_KEY:
+            printf("TIMER_REPEAT_KEY: repeating %d\n", t->arg);
+            send_key_sequence((nostromo_state*)t->data, t->arg, 0, 1);
+            break;
+
+        case TIMER_PRESS_KEY:
+            send_key(t->arg, t->flag, t->remote);
+            break;
+
+        case TIMER_MOUSE_CLICK:
+            send_mouse_click(t->arg, t->flag, t->remote);
+            break;
+
+        case TIMER_LED_SHOW:
+            dev = (device_state*)t->data;
+            dev->leds[0] = led_show[t->arg][0];
+            dev->leds[1] = led_show[t->arg][1];
+            dev->leds[2] = led_show[t->arg][2];
+            set_nostromo_leds(dev);
+            if(t->arg + 1 < (int)(sizeof(led_show) / sizeof(led_show[0]))) {
+                add_timer(TIMER_LED_SHOW, -1, -1, t->arg + 1, LED_SHOW_STEP, dev);
+            } else {
+                change_mode(dev, dev->mode);
+            }
+            break;
+
+        case TIMER_RELOAD:
+            reload();
+            break;
+
+        case TIMER_RESEND:
+            resend_datagram(&remotes[t->id - RESEND_TIMER_ID], (resend_slot*)t->data, (uint32_t)t->arg);
+            break;
+
+        case TIMER_EXPIRE_REMOTE:
+            drop_remote(&remotes[t->arg], "remote went quiet,");
+            break;
+    }
+}
+
+/**
+ * Fire every timer that's due, with one flush for everything sharing
+ * a deadline.
+ **/
+static void run_timers()
+{
+    struct timespec now;
+    struct timespec done;
+    struct timespec deadline;
+    timer_entry* t;
+    timer_entry* batch[FIRE_BATCH];
+    int fired, n;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    while((t = timer_queue_peek(&timers)) != NULL && !timespec_before(&now, &t->expires)) {
+        deadline = t->expires;
+        fired = 0;
+        do {
+            timer_queue_pop(&timers);
+            fire_timer(t);
+            batch[fired++] = t;
+        } while(fired < FIRE_BATCH && (t = timer_queue_peek(&timers)) != NULL &&
+                t->expires.tv_sec == deadline.tv_sec && t->expires.tv_nsec == deadline.tv_nsec);
+
+        flush_output();
+        clock_gettime(CLOCK_MONOTONIC, &done);
+
+        for(n = 0; n < fired; n++) {
+            t = batch[n];
+            if(t->type == TIMER_PRESS_KEY || t->type == TIMER_MOUSE_CLICK) {
+                hist_record_span(&fire_lateness, &t->expires, &now);
+                hist_record_span(&inject_latency, &now, &done);
+                /* End to end, less the delay the stroke asked for */
+                hist_record(&timer_path_latency, timespec_diff_us(&done, &t->origin) * 1000L - t->delay * 1000000L);
+            }
+            release_timer(t);
+        }
+        now = done;
+    }
+}
+
+/**
+ * The timerfd went off, run_timers() after the dispatch does the work.
+ **/
+static void timer_ready(event_source* src, uint32_t events)
+{
+    uint64_t expirations;
+
+    if(read(src->fd, &expirations, sizeof(expirations)) < 0) {
+        /* Re-armed since it fired, nothing to read */
+    }
+    timer_armed.tv_sec = timer_armed.tv_nsec = 0;
+}
+
+/**
+ * Run the daemon.  Waits in epoll_wait() for input, timers, signals
+ * and the network, handles whatever is ready, then fires due timers.
+ **/
+void event_loop()
+{
+    struct epoll_event events[MAX_EVENTS];
+    struct timespec cpu_start;
+    struct timespec cpu_end;
+    event_source* src;
+    int count, n;
+
+    while(1) {
+        arm_timer_fd();
+
+        count = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+        if(count < 0) {
+            if(errno != EINTR) {
+                syslog(LOG_ERR, "epoll_wait: %m");
+            }
+            continue;
+        }
+
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu_start);
+        loop_stats.wakeups++;
+        loop_stats.events += count;
+
+        for(n = 0; n < count; n++) {
+            src = (event_source*)events[n].data.ptr;
+            src->ready(src, events[n].events);
+        }
+        run_timers();
+        rcu_reclaim();
+
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu_end);
+        hist_record_span(&wakeup_cpu, &cpu_start, &cpu_end);
+    }
+}
+
+/**
+ * Log scheduler counters.
+ **/
+void dump_stats()
+{
+    syslog(LOG_INFO, "timer pool: size=%d allocs=%lu heap_allocs=%lu drops=%lu in_use=%d high_water=%d",
+        TIMER_POOL_SIZE, timer_stats.allocs, timer_stats.heap_allocs, timer_stats.drops,
+        timer_stats.in_use, timer_stats.high_water);
+    syslog(LOG_INFO, "event loop: wakeups=%lu ready=%lu input_events=%lu",
+        loop_stats.wakeups, loop_stats.events, loop_stats.input_events);
+    hist_log(&input_latency);
+    hist_log(&dispatch_latency);
+    hist_log(&fire_lateness);
+    hist_log(&inject_latency);
+    hist_log(&fast_path_latency);
+    hist_log(&timer_path_latency);
+    hist_log(&wakeup_cpu);
+    syslog(LOG_INFO, "output %s: flushes=%lu requests=%lu per_flush=%.2f max_per_flush=%lu",
+        output->name, output->stats.flushes, output->stats.requests,
+        output->stats.flushes ? (double)output->stats.requests / output->stats.flushes : 0.0,
+        output->stats.max_batch);
+}
+
+/**
+ * Go to a mode and light its LEDs, as its config has them.
+ **/
+void change_mode(device_state* dev, int mode)
+{
+    int leds = program_leds(image_program(cfg_image, dev->config), mode);
+
+    dev->mode = mode;
+
+    dev->leds[0] = (leds & LED_RED) != 0;
+    dev->leds[1] = (leds & LED_GREEN) != 0;
+    dev->leds[2] = (leds & LED_BLUE) != 0;
+
+    set_nostromo_leds(dev);
+}
+
+/**
+ * A mode shift key went down, go to its mode until it comes back up.
+ **/
+static void push_layer(device_state* dev, int key, int mode)
+{
+    if(dev->num_layers == MAX_SHIFT_LAYERS) {
+        syslog(LOG_INFO, "Too many mode shift keys held, ignoring key %d", key);
+        return;
+    }
+    dev->layers[dev->num_layers].key = key;
+    dev->layers[dev->num_layers].restore = dev->mode;
+    dev->num_layers++;
+    change_mode(dev, mode);
+}
+
+/**
+ * A mode shift key came up.  If it's the innermost one go back to the
+ * mode it was pressed in, otherwise just drop it out of the stack so
+ * the one above it goes back to where this one would have.
+ **/
+static void pop_layer(device_state* dev, int key)
+{
+    int n;
+
+    for(n = dev->num_layers - 1; n >= 0; n--) {
+        if(dev->layers[n].key == key) {
+            break;
+        }
+    }
+    if(n < 0) {
+        return;
+    }
+
+    if(n == dev->num_layers - 1) {
+        change_mode(dev, dev->layers[n].restore);
+    } else {
+        dev->layers[n + 1].restore = dev->layers[n].restore;
+        memmove(&dev->layers[n], &dev->layers[n + 1], (dev->num_layers - n - 1) * sizeof(shift_layer));
+    }
+    dev->num_layers--;
+}
+
+/**
+ * User hit one of the keys on the Nostromo, we need to pump
+ * all of the inputs that correspond to whatever the chosen
+ * key was.  Releases and repeats run what the key was mapped
+ * to in the mode it went down in.
+ **/
+void send_key_sequence(nostromo_state* nost, int key, int release, int from_timer /* = 0 */)
+{
+    device_state* dev = nost->dev;
+    const nost_program* program = image_program(cfg_image, dev->config);
+    int slot = key_slot(dev, key);
+    int id = slot;
+    const nost_key_program* p;
+    unsigned route;
+
+    /* Only timer-created keystrokes have IDs that match the parent */
+    if(!from_timer) {
+        id = -1;
+    }
+
+    printf("%ld: %s(%p, %d, %d)\n", time(NULL), __FUNCTION__, nost, key, release);
+
+    if(!release && !from_timer) {
+        dev->key_mode[key] = dev->mode;
+    }
+    /* Nothing's mapped in modes the config doesn't have */
+    if((p = program_key(program, dev->key_mode[key], key)) == NULL) {
+        if(release) {
+            pop_layer(dev, key);
+        }
+        return;
+    }
+
+    route = resolve_route(program_route(program, p));
+    switch(p->type) {
+        case SINGLE_KEY:
+        case SHIFT_KEY:
+        case CONTROL_KEY:
+        case ALT_KEY:
+            /* Keys follow the nostromo key up and down */
+            if(release) {
+                add_timer_batch(id, slot, release_actions(program, p), p->release_count, from_timer ? NULL : nost, route);
+            } else {
+                add_timer_batch(id, slot, press_actions(program, p), p->press_count, from_timer ? NULL : nost, route);
+            }
+            break;
+        case MULTI_KEY:
+            /* Nostromo key was pressed, send all the corresponding mapped keys */
+            if(!release) {
+                add_timer_batch(id, slot, press_actions(program, p), p->press_count, from_timer ? NULL : nost, route);
+                if(p->repeat) {
+                    add_timer(TIMER_REPEAT_KEY, slot, slot, key, p->repeat_delay, nost);
+                }
+            } else {
+                if(p->repeat) {
+                    remove_timer(slot);
+                    stop_remote_macros(slot);
+                }
+            }
+        break;
+
+        case LAYER_SHIFT:
+            if(release) {
+                pop_layer(dev, key);
+            } else {
+                push_layer(dev, key, p->layer);
+            }
+            break;
+
+        case LAYER_LOCK:
+            if(!release) {
+                change_mode(dev, p->layer);
+            }
+            break;
+    }
+
+}
+
+/* reset the state struct */
+void reset_nostromo_state(nostromo_state * nost)
+{
+    nost->dpad[0] = 128;
+    nost->dpad[1] = 128;
+    nost->wheel = 0;
+}
+
+/* set the leds to reflect given state */
+void set_nostromo_leds(device_state* dev)
+{
+    struct input_event ev;
+    int j;
+
+    if(dev->led_fd < 0) {
+        return;
+    }
+
+    memset(&ev, 0, sizeof(ev));
+    for(j = 0; j < 3; j++) {
+        ev.type = EV_LED;
+        ev.code = j;
+        ev.value = dev->leds[j];
+        if(write(dev->led_fd, &ev, sizeof(struct input_event)) < 0) {
+            perror(__FUNCTION__);
+        }
+    }
+}
+
+/**
+ * cut out from the main loop of usb2key.c by Matan Ziv-Av
+ *
+ *  - reads event from usb bus
+ *  - sets state in nostromo_state struct
+ *  - calls appropriate handler function
+ * jimbo
+ **/
+void handle_nostromo_block(nostromo_state * nost, input_event* ev)
+{
+    int brk = 0;
+
+    switch (ev->type) {
+        case EV_ABS:           /* absolute event (dpad/wheel) */
+        {
+            switch (ev->code) {
+                case 6:
+                       /*** wheel event ***/
+                    nost->wheel = ev->value;
+                    break;
+                case 0:
+                case 1:
+                { 
+                    int key = 0;
+                    brk = (ev->value == 128) ? 1 : 0;
+
+                    /**
+                     * DPAD input events
+                     * code   value  meaning
+                     * ------------------------------------
+                     * 0      0      top of dpad pressed
+                     * 0      255    bottom of dpad pressed
+                     * 0      128    top/bottom released
+                     * 1      0      front of dpad pressed
+                     * 1      255    rear of dpad pressed
+                     * 1      128    front/rear released
+                     **/
+                    if(ev->code == NOSTROMO_Y_AXIS) {
+                        if(ev->value == 0 || nost->dpad[ev->code] == 0) {
+                            key = 10;
+                        } else if(ev->value == 255 || nost->dpad[ev->code] == 255) {
+                            key = 11;
+                        }
+                    } else if(ev->code == NOSTROMO_X_AXIS) {
+                        if(ev->value == 0 || nost->dpad[ev->code] == 0) {
+                            key = 12;
+                        } else if(ev->value == 255 || nost->dpad[ev->code] == 255) {
+                            key = 13;
+                        }
+                    }
+
+                    send_key_sequence(nost, key, brk);
+
+                    nost->dpad[ev->code] = ev->value;
+                    break;
+                }
+            }
+            break;
+        }
+        case EV_KEY:
+        {
+            /* key event(10 finger keys) */
+            int key = 0;
+
+            if(ev->code > NOSTROMO_KEY_OFFSET) {
+                key = ev->code - NOSTROMO_KEY_OFFSET;
+            } else {
+                /* n52 runs all buttons/keys through here */
+                switch(ev->code) {
+                    default: break;
+                    case 15: key = 0; break; /* First row */
+                    case 16: key = 1; break;
+                    case 17: key = 2; break;
+                    case 18: key = 3; break;
+                    case 19: key = 4; break;
+
+                    case 58: key = 5; break; /* Second row */
+                    case 30: key = 6; break;
+                    case 31: key = 7; break;
+                    case 32: key = 8; break;
+                    case 33: key = 9; break;
+
+                    case 105: key = 10; break; /* Dpad top */
+                    case 106: key = 11; break; /* Dpad bottom */
+                    case 103: key = 12; break; /* Dpad rear/right */
+                    case 108: key = 13; break; /* Dpad front/left */
+
+                    case 42: key = 14; break; /* Third row */
+                    case 44: key = 15; break;
+                    case 45: key = 16; break;
+                    case 46: key = 17; break;
+                    case 57: key = 18; break; /* Black thumb button */
+
+                    case 56: key = 19; break; /* Orange thumb button */
+                    
+                    case 274: key = 21; break; /* Push mouse wheel in */
+
+                }
+            }
+            brk = (ev->value == 0) ? 1 : 0;
+
+            /* Held keys autorepeat (value 2), only pass on changes */
+            if(((nost->dev->pressed >> key) & 1) == brk) {
+                printf("Sending key sequence for %d brk:%d\n", key, brk);
+                send_key_sequence(nost, key, brk);
+            }
+            if(brk) {
+                nost->dev->pressed &= ~(1UL << key);
+            } else {
+                nost->dev->pressed |= 1UL << key;
+            }
+            break;
+        }
+        /* Weirdness note: When the mouse wheel moves, we get an event
+         * telling us it moved, which is immediately followed by a EV_SYN
+         * event with all 0's for data - not terribly informative.. */
+        case EV_REL: /* Mouse wheel movement */
+        {
+            int key = 0;
+
+            switch(ev->value) {
+                case 1: /* Mouse wheel up (forward) */
+                    send_key_sequence(nost, 20, 0);
+                    send_key_sequence(nost, 20, 1);
+                    break;
+                case -1: /* Mouse wheel down (back) */
+                    send_key_sequence(nost, 22, 0);
+                    send_key_sequence(nost, 22, 1);
+                    break;
+                default:
+                    break;
+            }
+            break;
+        }
+    }
+}
+
+/**
+ * Forget a remote, its slot is free and its keys go elsewhere.
+ **/
+static void reset_remote(remote_client* c)
+{
+    int n;
+
+    remotes_ready &= ~remote_bit(c);
+    c->active = 0;
+    c->ready = 0;
+    c->name[0] = 0;
+    c->caps = 0;
+    c->count = 0;
+    c->releases = 0;
+    c->out_len = 0;
+    c->waiting = 0;
+    wire_reader_init(&c->in);
+    for(n = 0; n < RESEND_SLOTS; n++) {
+        c->resend[n].left = 0;
+    }
+    if(c->macros) {
+        memset(c->macros, 0, c->macros_size * sizeof(macro_slot));
+    }
+    c->num_macros = 0;
+    c->num_defs = 0;
+    c->next_def = 0;
+    c->def_sent = 0;
+}
+
+/**
+ * Hang up on a remote.
+ **/
+static void drop_remote(remote_client* c, const char* why)
+{
+    if(!c->active) {
+        return;
+    }
+    syslog(LOG_INFO, "%s %s", why, c->name);
+    if(remote_udp) {
+        remove_timer(EXPIRE_TIMER_ID + (c - remotes));
+    } else {
+        close(c->src.fd);
+        c->src.fd = -1;
+    }
+    reset_remote(c);
+}
+
+/**
+ * Close up open sockets.
+ **/
+void close_sockets()
+{
+    int n;
+
+    for(n = 0; n < MAX_REMOTES; n++) {
+        drop_remote(&remotes[n], "closing connection to");
+    }
+    close(srvfd);
+    srvfd = 0;
+}
+
+/**
+ * A free slot for a remote.
+ * @return NULL if there are MAX_REMOTES already.
+ **/
+static remote_client* new_remote(const struct sockaddr_in* sin)
+{
+    remote_client* c;
+
+    for(c = remotes; c < remotes + MAX_REMOTES; c++) {
+        if(!c->active) {
+            reset_remote(c);
+            c->active = 1;
+            c->addr = *sin;
+            /* No reverse DNS, it can block for seconds */
+            if(!inet_ntop(AF_INET, &sin->sin_addr, c->name, sizeof(c->name))) {
+                strcpy(c->name, "?");
+            }
+            return c;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * A remote's hello checked out: it goes by the name in it, if it gave
+ * one, and keys routed to it go to it from here on.  Another one by
+ * that name is taken to be it before a restart, and replaced.
+ **/
+static void greet_remote(remote_client* c, const wire_frame* frame, uint32_t caps)
+{
+    char name[WIRE_MAX_NAME + 1];
+    remote_client* other;
+
+    if(wire_get_hello_name(frame, name, sizeof(name)) > 0) {
+        strcpy(c->name, name);
+    }
+    for(other = remotes; other < remotes + MAX_REMOTES; other++) {
+        if(other != c && other->ready && !strcmp(other->name, c->name)) {
+            drop_remote(other, "replacing remote");
+        }
+    }
+    c->caps = caps & WIRE_CAPS;
+    c->ready = 1;
+    remotes_ready |= remote_bit(c);
+    syslog(LOG_INFO, "remote %s ready over %s, capabilities %08x", c->name,
+        remote_udp ? TRANSPORT_UDP : TRANSPORT_TCP, c->caps);
+}
+
+/**
+ * Handle one frame from a remote.  Its hello has to come first;
+ * nothing after that means anything to this version.
+ * @return 0 if it's no good and has to go.
+ **/
+static int remote_frame(remote_client* c, const wire_frame* frame)
+{
+    unsigned version;
+    uint32_t caps;
+
+    if(c->ready) {
+        return 1;
+    }
+    if(wire_get_hello(frame, &version, &caps) < 0) {
+        syslog(LOG_NOTICE, "remote sent unexpected frame %d", frame->type);
+        return 0;
+    }
+    if(version != WIRE_VERSION) {
+        syslog(LOG_NOTICE, "remote speaks protocol %u, we speak %d", version, WIRE_VERSION);
+        return 0;
+    }
+    greet_remote(c, frame, caps);
+    push_macros();
+    flush_remote(c);
+    return 1;
+}
+
+/**
+ * A remote hung up, has something to say, or can take more of what's
+ * queued for it.
+ **/
+static void client_ready(event_source* src, uint32_t events)
+{
+    remote_client* c = (remote_client*)src;
+    wire_frame frame;
+    unsigned char* p;
+    size_t room;
+    ssize_t len;
+    int ret;
+
+    if(!c->active) {
+        return;
+    }
+    if(events & EPOLLOUT) {
+        send_out(c);
+        if(c->ready && c->num_defs) {
+            send_macros(c);
+        }
+        if(!c->active || !(events & ~EPOLLOUT)) {
+            return;
+        }
+    }
+    p = wire_reader_space(&c->in, &room);
+    len = recv(c->src.fd, p, room, MSG_DONTWAIT);
+    if(len < 0 && (errno == EAGAIN || errno == EINTR)) {
+        return;
+    }
+    if(len <= 0 || (events & EPOLLERR)) {
+        /* they're gone, clean up so their keys go elsewhere */
+        drop_remote(c, "lost connection to");
+        return;
+    }
+    wire_reader_fill(&c->in, len);
+    while((ret = wire_next_frame(&c->in, &frame)) > 0) {
+        if(!remote_frame(c, &frame)) {
+            drop_remote(c, "dropped remote");
+            return;
+        }
+    }
+    if(ret < 0) {
+        drop_remote(c, "bad frame from remote");
+    }
+}
+
+/**
+ * Set a TCP remote's stream up for latency: no Nagle, and a send
+ * buffer small enough that a stalled remote fills it, and its queue
+ * here, and is dropped before what's queued for it goes stale.  It
+ * never blocks, one slow remote doesn't hold up the rest.
+ **/
+static void tune_stream(int fd)
+{
+    int size = REMOTE_SNDBUF;
+
+    wire_tune_stream(fd);
+    setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+}
+
+/**
+ * A remote is connecting.  It gets a slot of its own, as many as
+ * MAX_REMOTES at once.  Nothing goes to it until its hello is in.
+ **/
+static void listen_ready(event_source* src, uint32_t events)
+{
+    struct sockaddr_in sin;
+    socklen_t len = sizeof(sin);
+    unsigned char hello[WIRE_HEADER_SIZE + WIRE_HELLO_SIZE + WIRE_MAX_NAME];
+    remote_client* c;
+    size_t size;
+    int fd;
+
+    fd = accept4(srvfd, (struct sockaddr*)&sin, &len, SOCK_CLOEXEC | SOCK_NONBLOCK);
+    if(fd < 0) {
+        return;
+    }
+    if((c = new_remote(&sin)) == NULL) {
+        syslog(LOG_NOTICE, "already have %d remotes, turning another away", MAX_REMOTES);
+        close(fd);
+        return;
+    }
+    c->src.fd = fd;
+    syslog(LOG_INFO, "accepted connection from %s", c->name);
+
+    tune_stream(fd);
+    size = wire_put_hello(hello, WIRE_CAPS, 0);
+    if(send(fd, hello, size, 0) != (ssize_t)size) {
+        drop_remote(c, "couldn't greet remote");
+        return;
+    }
+    watch(&c->src, fd, client_ready, EPOLLIN | EPOLLRDHUP);
+}
+
+/**
+ * A datagram for the UDP socket.  All a remote sends is its hello,
+ * until it's answered and every WIRE_KEEPALIVE after.  Each is
+ * answered, flagged if the remote's new to us; one that misses
+ * REMOTE_MISSED_KEEPALIVES of them is dropped.
+ **/
+static void datagram_ready(event_source* src, uint32_t events)
+{
+    unsigned char buf[WIRE_MAX_DATAGRAM];
+    unsigned char hello[WIRE_HEADER_SIZE + WIRE_HELLO_SIZE];
+    struct sockaddr_in sin;
+    socklen_t len = sizeof(sin);
+    remote_client* c;
+    wire_frame frame;
+    unsigned version;
+    uint32_t caps;
+    int flags = 0;
+    ssize_t n;
+
+    n = recvfrom(srvfd, buf, sizeof(buf), MSG_DONTWAIT, (struct sockaddr*)&sin, &len);
+    if(n < 0 || wire_get_datagram(buf, n, &frame) < 0 || wire_get_hello(&frame, &version, &caps) < 0) {
+        return;
+    }
+    if(version != WIRE_VERSION) {
+        syslog(LOG_NOTICE, "remote speaks protocol %u, we speak %d", version, WIRE_VERSION);
+        return;
+    }
+    for(c = remotes; c < remotes + MAX_REMOTES; c++) {
+        if(c->ready && sin.sin_addr.s_addr == c->addr.sin_addr.s_addr && sin.sin_port == c->addr.sin_port) {
+            break;
+        }
+    }
+    if(c == remotes + MAX_REMOTES) {
+        if((c = new_remote(&sin)) == NULL) {
+            syslog(LOG_NOTICE, "already have %d remotes, ignoring another", MAX_REMOTES);
+            return;
+        }
+        greet_remote(c, &frame, caps);
+        flags = WIRE_HELLO_NEW;
+    }
+
+    remove_timer(EXPIRE_TIMER_ID + (c - remotes));
+    add_timer(TIMER_EXPIRE_REMOTE, EXPIRE_TIMER_ID + (c - remotes), -1, c - remotes,
+              REMOTE_MISSED_KEEPALIVES * WIRE_KEEPALIVE, NULL);
+    sendto(srvfd, hello, wire_put_hello(hello, WIRE_CAPS, flags), MSG_DONTWAIT,
+           (struct sockaddr*)&c->addr, sizeof(c->addr));
+}
+
+/**
+ * Set up sockets, etc.  Over TCP that's a listening socket, over UDP
+ * the one socket remotes say hello to and events go out on.
+ **/
+void open_sockets()
+{
+    struct sockaddr_in sin;
+    const char* transport;
+
+    if(!srvfd && cfg_image->network_enabled) {
+        sin.sin_family = AF_INET;
+        sin.sin_addr.s_addr = INADDR_ANY;
+        sin.sin_port = htons(cfg_image->port);
+
+        transport = image_string(cfg_image, cfg_image->transport);
+        if(strcmp(transport, TRANSPORT_TCP) && strcmp(transport, TRANSPORT_UDP)) {
+            syslog(LOG_NOTICE, "Unknown transport %s, using " TRANSPORT_TCP, transport);
+        }
+        remote_udp = !strcmp(transport, TRANSPORT_UDP);
+        srvfd = socket(AF_INET, (remote_udp ? SOCK_DGRAM : SOCK_STREAM) | SOCK_CLOEXEC, 0);
+        if(srvfd < 0 
+         || bind(srvfd, (struct sockaddr*)&sin, sizeof(sin)) < 0
+         || (!remote_udp && listen(srvfd, 3) < 0)) {
+           syslog(LOG_NOTICE, "Failed to open socket: %m");
+           if(srvfd >= 0) {
+               close(srvfd);
+           }
+           srvfd = 0;
+        } else if(remote_udp) {
+           watch(&listen_src, srvfd, datagram_ready, EPOLLIN);
+        } else {
+           watch(&listen_src, srvfd, listen_ready, EPOLLIN);
+        }
+    }
+}
+
+/**
+ * What compile_config_set() had to do.
+ **/
+typedef struct {
+    int unread;         /**< Profiles taken from the previous image without reading them */
+    int reused;         /**< Configs read but copied whole from the previous image */
+    int compiled;       /**< Configs that were new or had keys change */
+    int keys;           /**< Keys compiled */
+} compile_stats;
+
+/**
+ * Compile one config against the previous image: copied as it was if
+ * nothing about it changed, otherwise only its changed keys compiled.
+ * Whatever is taken from the image is checked first.
+ **/
+static nost_program* compile_changes(const nost_config_data* cfg, const uint64_t* hashes, const nost_modifiers* mods,
+                                     const config_image* prev, int hint, compile_stats* stats)
+{
+    const config_ref* ref;
+    const uint64_t* old_hashes;
+    nost_program* prog;
+    char* unchanged;
+    int n, k;
+
+    n = prev ? image_find_config(prev, cfg->name ? cfg->name : "", hint) : -1;
+    if(n < 0 || !verify_config(prev, n)) {
+        stats->compiled++;
+        stats->keys += config_keys(cfg);
+        return compile_config(cfg, mods);
+    }
+
+    ref = image_config(prev, n);
+    if(ref->hash == hash_config(cfg, hashes)) {
+        if((prog = (nost_program*)malloc(ref->program_size)) != NULL) {
+            memcpy(prog, image_program(prev, n), ref->program_size);
+        }
+        stats->reused++;
+        return prog;
+    }
+
+    /* Keys in modes the old one didn't have are new */
+    old_hashes = image_key_hashes(prev, n);
+    stats->compiled++;
+    if((unchanged = (char*)malloc(config_keys(cfg) + 1)) == NULL) {
+        return NULL;
+    }
+    for(k = 0; k < config_keys(cfg); k++) {
+        unchanged[k] = k < (int)ref->num_keys && old_hashes[k] == hashes[k];
+        stats->keys += !unchanged[k];
+    }
+    prog = compile_config(cfg, mods, image_program(prev, n), unchanged);
+    free(unchanged);
+    return prog;
+}
+
+/**
+ * Keycodes the output wants for modifiers.
+ **/
+static void output_modifiers(nost_modifiers* mods)
+{
+    mods->shift = output->shift_keycode;
+    mods->control = output->control_keycode;
+    mods->alt = output->alt_keycode;
+}
+
+/**
+ * Where the config file and its compiled image are.
+ **/
+static void config_paths(char* fname, char* cache)
+{
+    struct passwd* pw = getpwuid(getuid());
+
+    snprintf(fname, PATH_MAX+1, "%s/" CFG_FILE_NAME, (pw ? pw->pw_dir : "."));
+    snprintf(cache, PATH_MAX+1, "%s/" CACHE_FILE_NAME, (pw ? pw->pw_dir : "."));
+}
+
+/**
+ * Load the config file and the library index.  What the file looked
+ * like beforehand is noted for the image: if it changes while being
+ * read, the image won't match it next time and gets rebuilt.
+ **/
+static nost_data* parse_configs(const char* fname, struct stat* src, uint64_t* hash)
+{
+    nost_data* data;
+    int n;
+
+    if(stat(fname, src) < 0) {
+        memset(src, 0, sizeof(*src));
+    }
+    *hash = hash_file(fname);
+    printf("Loading configs from %s\n", fname);
+    if((data = load_configs(fname)) == NULL) {
+        return NULL;
+    }
+
+    syslog(LOG_INFO, "%d configs take %zu KB", data->num_configs,
+        (data->num_configs * sizeof(nost_config_data) + data->mem.reserved) / 1024);
+    for(n = 0; n < data->num_configs; n++) {
+        if(data->configs[n].loaded) {
+            syslog(LOG_DEBUG, "config %s: %zu bytes", data->configs[n].name, config_memory(&data->configs[n]));
+        }
+    }
+    return data;
+}
+
+/**
+ * A set for an image, with none of its configs checked yet.
+ **/
+static config_set* new_config_set(const config_image* image, int mapped)
+{
+    config_set* set = (config_set*)calloc(1, sizeof(config_set));
+
+    if(set && (set->checked = (signed char*)calloc(image->num_configs, 1)) == NULL) {
+        free(set);
+        set = NULL;
+    }
+    if(set) {
+        set->image = image;
+        set->mapped = mapped;
+    }
+    return set;
+}
+
+/**
+ * The config an image starts out with.
+ **/
+static int current_config(const config_image* image)
+{
+    if(image->current_config < 0 || image->current_config >= image->num_configs) {
+        return 0;
+    }
+    return image->current_config;
+}
+
+/**
+ * Which library profiles can be taken from an image as they are:
+ * their files haven't changed since it was built, and their part of
+ * it checks out.  Both are in file order, so the one after the last
+ * match is the place to look first.
+ * @param from Set to each config's index in prev, or -1 if it has to be read.
+ **/
+static void find_unchanged(const nost_data* data, const config_image* prev, int* from)
+{
+    const nost_config_data* cfg;
+    int n, hint = 0;
+
+    for(n = 0; n < data->num_configs; n++) {
+        cfg = &data->configs[n];
+        from[n] = -1;
+        if(prev && !cfg->loaded && cfg->file && (from[n] = image_find_file(prev, cfg->file, hint)) >= 0) {
+            hint = from[n] + 1;
+            if(!same_file(prev, from[n], cfg) || !verify_config(prev, from[n])) {
+                from[n] = -1;
+            }
+        }
+    }
+}
+
+/**
+ * Fill in what goes into the image for each config: taken from prev
+ * if find_unchanged() said so, otherwise hashed and compiled.
+ * @param key_hashes Room for the keys of every config that's compiled.
+ * @param progs Set to the programs compiled, to free.
+ * @return 0, or -1 if out of memory.
+ **/
+static int compile_entries(const nost_data* data, const int* from, const config_image* prev, const nost_modifiers* mods,
+                           image_entry* entries, nost_program** progs, uint64_t* key_hashes, compile_stats* stats)
+{
+    const nost_config_data* cfg;
+    int n;
+
+    for(n = 0; n < data->num_configs; n++) {
+        cfg = &data->configs[n];
+        entries[n].cfg = cfg;
+        if(from[n] >= 0) {
+            entries[n].program = image_program(prev, from[n]);
+            entries[n].key_hashes = image_key_hashes(prev, from[n]);
+            entries[n].num_keys = image_config(prev, from[n])->num_keys;
+            entries[n].hash = image_config(prev, from[n])->hash;
+            stats->unread++;
+            continue;
+        }
+        hash_keys(cfg, key_hashes);
+        entries[n].key_hashes = key_hashes;
+        entries[n].num_keys = config_keys(cfg);
+        entries[n].hash = hash_config(cfg, key_hashes);
+        if((progs[n] = compile_changes(cfg, key_hashes, mods, prev, n, stats)) == NULL) {
+            return -1;
+        }
+        entries[n].program = progs[n];
+        key_hashes += config_keys(cfg);
+    }
+    return 0;
+}
+
+/**
+ * Compile loaded configs into an image and save it for next time.
+ * Library profiles whose files haven't changed since the previous
+ * image are taken from it as they are, without being read; only the
+ * rest are read, all at once over several threads, and compiled.  The
+ * new image is run from its file once it's saved, so that profiles
+ * that are never used never take any memory.  Takes ownership of data.
+ * @param prev The image to reuse what it can from, or NULL.
+ * @return The set, or NULL if out of memory.
+ **/
+static config_set* compile_config_set(nost_data* data, const char* cache,
+                                      const struct stat* src, uint64_t hash, const config_image* prev)
+{
+    config_set* set = NULL;
+    const config_image* image = NULL;
+    config_image* built = NULL;
+    image_entry* entries;
+    nost_program** progs;
+    uint64_t* key_hashes = NULL;
+    compile_stats stats = { 0, 0, 0, 0 };
+    nost_modifiers mods;
+    char* wanted;
+    int* from;
+    size_t keys = 0;
+    int failed;
+    int n;
+
+    output_modifiers(&mods);
+    entries = (image_entry*)calloc(data->num_configs, sizeof(image_entry));
+    progs = (nost_program**)calloc(data->num_configs, sizeof(nost_program*));
+    from = (int*)malloc(data->num_configs * sizeof(int));
+    wanted = (char*)malloc(data->num_configs);
+
+    if(entries && progs && from && wanted) {
+        find_unchanged(data, prev, from);
+        for(n = 0; n < data->num_configs; n++) {
+            wanted[n] = from[n] < 0;
+        }
+        if((failed = load_profiles(data, wanted)) > 0) {
+            syslog(LOG_NOTICE, "%d profiles couldn't be read, they do nothing.", failed);
+        }
+
+        for(n = 0; n < data->num_configs; n++) {
+            keys += from[n] < 0 ? config_keys(&data->configs[n]) : 0;
+        }
+        key_hashes = (uint64_t*)malloc((keys + 1) * sizeof(uint64_t));
+        if(key_hashes && compile_entries(data, from, prev, &mods, entries, progs, key_hashes, &stats) == 0) {
+            built = build_image(data, entries, &mods, src, hash);
+        }
+        syslog(LOG_INFO, "%d configs: %d unread, %d unchanged, %d compiled (%d keys)",
+            data->num_configs, stats.unread, stats.reused, stats.compiled, stats.keys);
+    }
+
+    for(n = 0; progs && n < data->num_configs; n++) {
+        free_program(progs[n]);
+    }
+    free(progs);
+    free(entries);
+    free(from);
+    free(wanted);
+    free(key_hashes);
+    free_configs(data);
+
+    if(built == NULL) {
+        return NULL;
+    }
+    if(write_image(cache, built) < 0) {
+        syslog(LOG_NOTICE, "Couldn't save %s: %m", cache);
+    } else if((image = open_image(cache, &mods)) != NULL && !verify_config(image, current_config(image))) {
+        unmap_image(image);
+        image = NULL;
+    }
+
+    if(image) {
+        free(built);
+        if((set = new_config_set(image, 1)) == NULL) {
+            unmap_image(image);
+            return NULL;
+        }
+        set->checked[current_config(image)] = 1;
+    } else {
+        /* Only this one, just made, can run without being checked */
+        if((set = new_config_set(built, 0)) == NULL) {
+            free(built);
+            return NULL;
+        }
+        memset(set->checked, 1, built->num_configs);
+    }
+    return set;
+}
+
+/**
+ * Get the configs ready to run: mapped from the image if it's up to
+ * date, otherwise loaded and compiled, and the image rebuilt.  Of a
+ * mapped image only the config it starts on is checked now.
+ * @param prev The image being replaced, or NULL.
+ * @return The set, or NULL if there are no configs to use.
+ **/
+static config_set* read_config_set(const config_image* prev)
+{
+    char fname[PATH_MAX+1];
+    char cache[PATH_MAX+1];
+    const config_image* image;
+    const config_image* stale;
+    nost_modifiers mods;
+    config_set* set;
+    nost_data* data;
+    struct stat src;
+    uint64_t hash;
+
+    config_paths(fname, cache);
+    output_modifiers(&mods);
+    if((image = map_image(cache, fname, &mods)) != NULL) {
+        if(verify_config(image, current_config(image))) {
+            if((set = new_config_set(image, 1)) == NULL) {
+                unmap_image(image);
+                return NULL;
+            }
+            set->checked[current_config(image)] = 1;
+            return set;
+        }
+        syslog(LOG_NOTICE, "%s is damaged, rebuilding it.", cache);
+        unmap_image(image);
+    }
+
+    data = parse_configs(fname, &src, &hash);
+    if(data == NULL || data->num_configs <= 0) {
+        syslog(LOG_INFO, "No configs in %s.", fname);
+        if(data) {
+            free_configs(data);
+        }
+        return NULL;
+    }
+
+    /* An image that's out of date still has every profile that isn't */
+    stale = open_image(cache, &mods);
+    if((set = compile_config_set(data, cache, &src, hash, stale ? stale : prev)) == NULL) {
+        syslog(LOG_ERR, "Out of memory compiling configs.");
+    }
+    if(stale) {
+        unmap_image(stale);
+    }
+    return set;
+}
+
+/**
+ * Free a config set that nothing uses any more.  A mapped image
+ * stays good even if the file is replaced meanwhile, the cache is
+ * only ever renamed over.
+ **/
+static void release_config_set(void* p)
+{
+    config_set* set = (config_set*)p;
+
+    if(set->mapped) {
+        unmap_image(set->image);
+    } else {
+        free((void*)set->image);
+    }
+    free(set->checked);
+    free(set);
+}
+
+/**
+ * Whether config n of a set can be run.  The part of a mapped image
+ * it's in is checked the first time it's wanted; if it's damaged, it
+ * isn't run and the image is rebuilt.  Only the loop looks at checked.
+ **/
+static int config_ready(config_set* set, int n)
+{
+    char fname[PATH_MAX+1];
+    char cache[PATH_MAX+1];
+
+    if(set->checked[n] == 0) {
+        set->checked[n] = verify_config(set->image, n) ? 1 : -1;
+        if(set->checked[n] < 0) {
+            config_paths(fname, cache);
+            syslog(LOG_NOTICE, "Config %s in %s is damaged, rebuilding it.",
+                image_string(set->image, image_config(set->image, n)->name), cache);
+            unlink(cache);
+            reload();
+        }
+    }
+    return set->checked[n] > 0;
+}
+
+/**
+ * Make config n of a set the one in use.  Runs between two events on
+ * the loop, so a keystroke never sees half of one config and half of
+ * another.  Queued timers carry their own copy of what to inject, so
+ * they're unaffected by the old programs going away.  What the old
+ * snapshot held is freed once the docklet is done looking at it.
+ **/
+static void publish_snapshot(config_set* set, int n)
+{
+    config_snapshot* old = active_snapshot;
+    config_snapshot* snap = (config_snapshot*)malloc(sizeof(config_snapshot));
+
+    if(snap == NULL) {
+        syslog(LOG_ERR, "Out of memory switching configs");
+        return;
+    }
+    snap->set = set;
+    snap->selected = n;
+    rcu_publish((void**)&active_snapshot, snap);
+
+    cfg_image = set->image;
+
+    if(old) {
+        if(old->set != set) {
+            rcu_retire(old->set, release_config_set);
+        }
+        rcu_retire(old, free);
+    }
+}
+
+/**
+ * The model a device is.
+ **/
+static model_type device_model(const device_state* dev)
+{
+    return dev->id == NOSTROMO_N52_ID ? N52 : N50;
+}
+
+/**
+ * Pick the config a device runs: the preferred one if it's for the
+ * device's model, otherwise the first one that is and can be run,
+ * otherwise the preferred one anyway.  The preferred one has to be
+ * one that config_ready() has passed.
+ **/
+static int config_for(const device_state* dev, int preferred)
+{
+    int n;
+
+    if(image_config(cfg_image, preferred)->model == device_model(dev)) {
+        return preferred;
+    }
+    for(n = 0; n < cfg_image->num_configs; n++) {
+        if(image_config(cfg_image, n)->model == device_model(dev) && config_ready(active_snapshot->set, n)) {
+            return n;
+        }
+    }
+    return preferred;
+}
+
+/**
+ * Switch to another of the loaded configs.  Only devices of the
+ * config's model switch, so an n50 and an n52 can each keep their
+ * own.  If there's no such device they all switch.
+ **/
+void select_config(int n)
+{
+    device_state* dev;
+    int matched = 0;
+
+    if(n < 0 || n >= cfg_image->num_configs || !config_ready(active_snapshot->set, n)) {
+        return;
+    }
+
+    for(dev = devices; dev; dev = dev->next) {
+        if(device_model(dev) == image_config(cfg_image, n)->model) {
+            dev->config = n;
+            change_mode(dev, dev->mode);
+            matched++;
+        }
+    }
+    for(dev = devices; dev && !matched; dev = dev->next) {
+        dev->config = n;
+        change_mode(dev, dev->mode);
+    }
+
+    publish_snapshot(active_snapshot->set, n);
+    push_macros();
+    flush_remotes();
+}
+
+/**
+ * Where config n of one image is in another.
+ * @return Its index, or -1 if it's gone.
+ **/
+static int carry_over(const config_image* from, int n, const config_image* to)
+{
+    return image_find_config(to, image_string(from, image_config(from, n)->name), n);
+}
+
+/**
+ * Make a loaded config set the one in use.  Unless the file now says
+ * to start on a different config, every device stays on the one it
+ * was running, wherever that's moved to.
+ **/
+void install_configs(config_set* set)
+{
+    const config_image* old = cfg_image;
+    const config_image* image = set->image;
+    const char* sink = image_string(image, image->output);
+    device_state* dev;
+    int current = current_config(image);
+    int selected = current;
+    int keep = 0;
+    int n;
+
+    if(old && carry_over(old, current_config(old), image) == current) {
+        keep = 1;
+        if((n = carry_over(old, active_snapshot->selected, image)) >= 0 && config_ready(set, n)) {
+            selected = n;
+        }
+    }
+
+    if(output && strcmp(output->name, sink)) {
+        syslog(LOG_NOTICE, "Output change to %s takes effect on restart.", sink);
+    }
+
+    /* Handle any changes in networking */
+    if(old) {
+        if((old->network_enabled && !image->network_enabled) 
+        ||(old->port != image->port)
+        ||(strcmp(image_string(old, old->transport), image_string(image, image->transport)))
+        ||(strcmp(image_string(old, old->server), image_string(image, image->server)))) {
+            close_sockets();
+        }
+    }
+
+    forget_macros();
+    publish_snapshot(set, selected);
+
+    /* The old image is only retired, it's still there until the loop comes round */
+    for(dev = devices; dev; dev = dev->next) {
+        n = keep ? carry_over(old, dev->config, image) : -1;
+        dev->config = n >= 0 && config_ready(set, n) ? n : config_for(dev, current);
+        /* Modes can light differently in the new config */
+        change_mode(dev, dev->mode);
+    }
+    push_macros();
+    flush_remotes();
+
+    if(old && cfg_image->network_enabled && !srvfd) {
+        open_sockets();
+    }
+}
+
+/**
+ * Ask the event loop to switch configs.  Called from the docklet,
+ * which runs on the GTK thread.
+ **/
+void post_select_config(int n)
+{
+    if(write(docklet_pipe[1], &n, sizeof(n)) != sizeof(n)) {
+        syslog(LOG_WARNING, "Couldn't pass config change on: %m");
+    }
+}
+
+/**
+ * Config selections from the docklet.
+ **/
+static void docklet_ready(event_source* src, uint32_t events)
+{
+    int n;
+
+    while(read(src->fd, &n, sizeof(n)) == sizeof(n)) {
+        select_config(n);
+    }
+}
+
+/**
+ * Reloads are parsed and compiled on their own thread, and the result
+ * handed back over this, so that keystrokes don't wait on libxml.
+ **/
+static int reload_pipe[2] = { -1, -1 };
+static event_source reload_src;
+static int reloading = 0;       /**< A loader thread is running */
+static int reload_again = 0;    /**< Another reload was asked for meanwhile */
+
+/**
+ * Parse and compile the config file, off the event loop.  The set
+ * being replaced is read to reuse what didn't change; it can't be
+ * retired meanwhile, only a finished reload replaces it.
+ **/
+static void* loader_thread(void* arg)
+{
+    const config_set* prev = (const config_set*)arg;
+    struct timespec start, done;
+    config_set* set;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    set = read_config_set(prev ? prev->image : NULL);
+    clock_gettime(CLOCK_MONOTONIC, &done);
+
+    if(set == NULL) {
+        syslog(LOG_INFO, "Keeping the old configs.");
+    } else {
+        syslog(LOG_INFO, "Reloaded in %ldus", timespec_diff_us(&done, &start));
     }
 
+    if(write(reload_pipe[1], &set, sizeof(set)) != sizeof(set)) {
+        syslog(LOG_ERR, "Couldn't hand reloaded configs back: %m");
+    }
+    return NULL;
 }
 
-/* reset the state struct */
-void reset_nostromo_state(nostromo_state * nost)
+/**
+ * Start a reload, unless one is already under way.
+ **/
+void reload()
 {
-    nost->dpad[0] = 128;
-    nost->dpad[1] = 128;
-    nost->wheel = 0;
-    nost->leds[0] = 0;
-    nost->leds[1] = 0;
-    nost->leds[2] = 0;
-    nost->shift_state = 0;
+    pthread_t loader;
+
+    if(reloading) {
+        reload_again = 1;
+        return;
+    }
+    if(pthread_create(&loader, NULL, loader_thread, active_snapshot ? active_snapshot->set : NULL) != 0) {
+        syslog(LOG_ERR, "Couldn't start reload: %m");
+        return;
+    }
+    pthread_detach(loader);
+    reloading = 1;
 }
 
-/* set the leds to reflect given state */
-void set_nostromo_leds(nostromo_state* nost)
+static void watch_library();
+
+/**
+ * A reload is done, put it in place.
+ **/
+static void reload_ready(event_source* src, uint32_t events)
 {
-    struct input_event ev;
-    int i, j;
-    int dev = nost->indev;
+    config_set* set;
 
-    /* n52's have 2 devices, one of them has the LEDs.. */
-    if(nost->id == NOSTROMO_N52_ID && n52_LEDs) {
-        dev = n52_LEDs->indev;
+    while(read(src->fd, &set, sizeof(set)) == sizeof(set)) {
+        reloading = 0;
+        if(set) {
+            install_configs(set);
+        }
     }
+    /* The first save from the GUI makes the library */
+    watch_library();
 
-    for(j = 0; j < 3; j++) {
-        ev.type = EV_LED;
-        ev.code = j;
-        ev.value = nost->leds[j];
-        if(write(dev, &ev, sizeof(struct input_event)) < 0) {
-            perror(__FUNCTION__);
-        }
+    if(reload_again && !reloading) {
+        reload_again = 0;
+        reload();
     }
 }
 
+/** How long the config file has to sit still before it's reloaded */
+#define RELOAD_DEBOUNCE 200
+
+/** Timer id of the pending reload, clear of every key slot */
+#define RELOAD_TIMER_ID (MAX_DEVICES * MAX_KEYS)
+
 /**
- * cut out from the main loop of usb2key.c by Matan Ziv-Av
- *
- *  - reads event from usb bus
- *  - sets state in nostromo_state struct
- *  - calls appropriate handler function
- * jimbo
+ * A file whose changes trigger a reload.  Directories are watched
+ * rather than the files, which get replaced by rename.
  **/
-void handle_nostromo_block(nostromo_state * nost, input_event* ev)
-{
-    int brk = 0;
+typedef struct {
+    int wd;
+    char name[NAME_MAX+1];
+    int suffix;         /**< Any file whose name ends in name */
+    uint32_t mask;      /**< Events on it that matter */
+} watched_file;
 
-    switch (ev->type) {
-        case EV_ABS:           /* absolute event (dpad/wheel) */
-        {
-            switch (ev->code) {
-                case 6:
-                       /*** wheel event ***/
-                    nost->wheel = ev->value;
-                    break;
-                case 0:
-                case 1:
-                { 
-                    int key = 0;
-                    brk = (ev->value == 128) ? 1 : 0;
+static event_source config_watch_src;
+static watched_file watched[3];
+static int num_watched = 0;
+static int library_watched = 0;
 
-                    /**
-                     * DPAD input events
-                     * code   value  meaning
-                     * ------------------------------------
-                     * 0      0      top of dpad pressed
-                     * 0      255    bottom of dpad pressed
-                     * 0      128    top/bottom released
-                     * 1      0      front of dpad pressed
-                     * 1      255    rear of dpad pressed
-                     * 1      128    front/rear released
-                     **/
-                    if(ev->code == NOSTROMO_Y_AXIS) {
-                        if(ev->value == 0 || nost->dpad[ev->code] == 0) {
-                            key = 10;
-                        } else if(ev->value == 255 || nost->dpad[ev->code] == 255) {
-                            key = 11;
-                        }
-                    } else if(ev->code == NOSTROMO_X_AXIS) {
-                        if(ev->value == 0 || nost->dpad[ev->code] == 0) {
-                            key = 12;
-                        } else if(ev->value == 255 || nost->dpad[ev->code] == 255) {
-                            key = 13;
-                        }
-                    }
+/**
+ * Watch a directory for events on a file in it, or on any file with
+ * a suffix.
+ * @return 0, or -1 if it can't be watched.
+ **/
+static int watch_dir(const char* dir, const char* name, int suffix, uint32_t mask)
+{
+    watched_file* w = &watched[num_watched];
 
-                    send_key_sequence(nost, key, brk);
+    snprintf(w->name, sizeof(w->name), "%s", name);
+    w->suffix = suffix;
+    w->mask = mask;
 
-                    nost->dpad[ev->code] = ev->value;
-                    break;
-                }
-            }
-            break;
-        }
-        case EV_KEY:
-        {
-            /* key event(10 finger keys) */
-            int key = 0;
+    w->wd = inotify_add_watch(config_watch_src.fd, dir[0] ? dir : "/", IN_CLOSE_WRITE | IN_MOVED_TO | mask);
+    if(w->wd < 0) {
+        return -1;
+    }
+    num_watched++;
+    return 0;
+}
 
-            if(ev->code > NOSTROMO_KEY_OFFSET) {
-                key = ev->code - NOSTROMO_KEY_OFFSET;
-            } else {
-                /* n52 runs all buttons/keys through here */
-                switch(ev->code) {
-                    default: break;
-                    case 15: key = 0; break; /* First row */
-                    case 16: key = 1; break;
-                    case 17: key = 2; break;
-                    case 18: key = 3; break;
-                    case 19: key = 4; break;
+/**
+ * Watch a file's directory for events on it.
+ **/
+static void watch_file(const char* path, uint32_t mask)
+{
+    char dir[PATH_MAX+1];
+    char* slash;
 
-                    case 58: key = 5; break; /* Second row */
-                    case 30: key = 6; break;
-                    case 31: key = 7; break;
-                    case 32: key = 8; break;
-                    case 33: key = 9; break;
+    snprintf(dir, sizeof(dir), "%s", path);
+    if((slash = strrchr(dir, '/')) == NULL) {
+        return;
+    }
+    *slash = 0;
+    if(watch_dir(dir, slash + 1, 0, mask) < 0) {
+        syslog(LOG_NOTICE, "Can't watch %s for changes: %m", dir);
+    }
+}
 
-                    case 105: key = 10; break; /* Dpad top */
-                    case 106: key = 11; break; /* Dpad bottom */
-                    case 103: key = 12; break; /* Dpad rear/right */
-                    case 108: key = 13; break; /* Dpad front/left */
+/**
+ * Whether a watched file is the one an event is on.
+ **/
+static int watched_name(const watched_file* w, const char* name)
+{
+    size_t len = strlen(name);
+    size_t want = strlen(w->name);
 
-                    case 42: key = 14; break; /* Third row */
-                    case 44: key = 15; break;
-                    case 45: key = 16; break;
-                    case 46: key = 17; break;
-                    case 57: key = 18; break; /* Black thumb button */
+    if(w->suffix) {
+        return name[0] != '.' && len > want && !strcmp(name + len - want, w->name);
+    }
+    return !strcmp(name, w->name);
+}
 
-                    case 56: key = 19; break; /* Orange thumb button */
-                    
-                    case 274: key = 21; break; /* Push mouse wheel in */
+/**
+ * Something changed in a watched directory.  If it's one of ours, the
+ * reload is put off until writes stop coming, an editor or the config
+ * GUI can take several goes at saving.
+ **/
+static void config_watch_ready(event_source* src, uint32_t events)
+{
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    const struct inotify_event* ev;
+    ssize_t len;
+    char* p;
+    int changed = 0;
+    int n;
 
-                }
+    while((len = read(src->fd, buf, sizeof(buf))) > 0) {
+        for(p = buf; p < buf + len; p += sizeof(struct inotify_event) + ev->len) {
+            ev = (const struct inotify_event*)p;
+            if(ev->mask & IN_Q_OVERFLOW) {
+                changed = 1;
             }
-            brk = (ev->value == 0) ? 1 : 0;
-
-            if((cfg->keys[current_mode][key].pressed == 0) != (ev->value == 0)) {
-                printf("Sending key sequence for %d brk:%d\n", key, brk);
-                send_key_sequence(nost, key, brk);
+            for(n = 0; n < num_watched; n++) {
+                if(ev->wd == watched[n].wd && (ev->mask & watched[n].mask)
+                && ev->len && watched_name(&watched[n], ev->name)) {
+                    changed = 1;
+                }
             }
-            cfg->keys[current_mode][key].pressed = ev->value;
-            break;
         }
-        /* Weirdness note: When the mouse wheel moves, we get an event
-         * telling us it moved, which is immediately followed by a EV_SYN
-         * event with all 0's for data - not terribly informative.. */
-        case EV_REL: /* Mouse wheel movement */
-        {
-            int key = 0;
+    }
 
-            switch(ev->value) {
-                case 1: /* Mouse wheel up (forward) */
-                    send_key_sequence(nost, 20, 0);
-                    send_key_sequence(nost, 20, 1);
-                    break;
-                case -1: /* Mouse wheel down (back) */
-                    send_key_sequence(nost, 22, 0);
-                    send_key_sequence(nost, 22, 1);
-                    break;
-                default:
-                    break;
-            }
-            break;
-        }
+    if(changed) {
+        remove_timer(RELOAD_TIMER_ID);
+        add_timer(TIMER_RELOAD, RELOAD_TIMER_ID, -1, 0, RELOAD_DEBOUNCE, NULL);
     }
 }
 
 /**
- * Close up open sockets.
+ * Reload whenever the config file is saved, by the GUI or anything
+ * else.  The image is only of interest if something other than us
+ * writes over it in place; ours are renamed in.
  **/
-void close_sockets()
+static void watch_configs()
 {
-    close(sockfd);
-    close(srvfd);
-    sockfd = srvfd = 0;
+    char fname[PATH_MAX+1];
+    char cache[PATH_MAX+1];
+    char target[PATH_MAX+1];
+    int fd;
+
+    if((fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0) {
+        syslog(LOG_NOTICE, "No inotify, reload with SIGHUP: %m");
+        return;
+    }
+    watch(&config_watch_src, fd, config_watch_ready, EPOLLIN);
+
+    config_paths(fname, cache);
+    /* Saves replace what a symlinked config points at */
+    watch_file(realpath(fname, target) ? target : fname, IN_CLOSE_WRITE | IN_MOVED_TO);
+    watch_file(cache, IN_CLOSE_WRITE);
+    watch_library();
 }
 
 /**
- * Set up sockets, etc.
+ * Reload when a profile in the library is saved, added or removed.
+ * The index is left out, it's only ever written to match the
+ * profiles.  Until there is a library this is tried again after
+ * every reload.
  **/
-void open_sockets()
+static void watch_library()
 {
-    int pid = getpid();
-    struct sockaddr_in sin;
-
-    if(!sockfd && all_cfg->network_enabled) {
-        sin.sin_family = AF_INET;
-        sin.sin_addr.s_addr = INADDR_ANY;
-        sin.sin_port = htons(all_cfg->port);
+    char fname[PATH_MAX+1];
+    char cache[PATH_MAX+1];
+    char library[PATH_MAX+1];
 
-        srvfd = socket(AF_INET, SOCK_STREAM, 0);
-        if(srvfd < 0 
-         || bind(srvfd, (struct sockaddr*)&sin, sizeof(sin)) < 0
-         || listen(srvfd, 3) < 0
-         || fcntl(srvfd, F_SETOWN, pid) < 0
-         || fcntl(srvfd, F_SETFL, FASYNC) < 0) {
-           syslog(LOG_NOTICE, "Failed to open socket: %m");
-           srvfd = 0;
-        }
+    if(library_watched || config_watch_src.fd <= 0) {
+        return;
+    }
+    config_paths(fname, cache);
+    library_path(fname, library, sizeof(library));
+    if(watch_dir(library, PROFILE_SUFFIX, 1, IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE) == 0) {
+        library_watched = 1;
     }
 }
 
 /**
- * Load our configuration information.
+ * Load our configuration information at startup.
  **/
 void load()
 {
-    /* Load our keymap settings */
     char fname[PATH_MAX+1];
-    struct passwd* pw = getpwuid(getuid());
-    nost_data* oldcfg = all_cfg;
-
-    sprintf(fname, "%s/" CFG_FILE_NAME, (pw ? pw->pw_dir : "."));
-    printf("Loading configs from %s\n", fname);
-    all_cfg = load_configs(fname);
-
-    if(all_cfg->num_configs <= 0) {
-        syslog(LOG_INFO, "No configs to use, exiting.\n");
-        exit(0);
+    char cache[PATH_MAX+1];
+    const config_image* peek;
+    nost_data* data = NULL;
+    config_set* set;
+    struct stat src;
+    uint64_t hash;
+    const char* sink;
+
+    /*
+     * The output backend is picked once, at startup.  A good image
+     * says which without parsing anything; whether its programs suit
+     * that output is checked once it's open.
+     */
+    config_paths(fname, cache);
+    if((peek = map_image(cache, fname, NULL)) != NULL) {
+        sink = image_string(peek, peek->output);
+    } else {
+        data = parse_configs(fname, &src, &hash);
+        if(data == NULL || data->num_configs <= 0) {
+            syslog(LOG_INFO, "No configs to use, exiting.\n");
+            exit(0);
+        }
+        sink = data->output;
     }
 
-    /* Set our global config to the selected one */
-    cfg = &all_cfg->configs[all_cfg->current_config];
+    if((output = open_output_sink(sink)) == NULL) {
+        syslog(LOG_NOTICE, "Couldn't open %s output, exiting.", sink);
+        exit(-1);
+    }
 
-    /* Handle any changes in networking */
-    if(oldcfg) {
-        if((oldcfg->network_enabled && !all_cfg->network_enabled) 
-        ||(oldcfg->port != all_cfg->port)
-        ||(strcmp(oldcfg->server, all_cfg->server))) {
-            close_sockets();
-        }
-        if(all_cfg->network_enabled && !sockfd) {
-            open_sockets();
-        }
+    /* Compile every config, so switching between them is just a pointer swap */
+    if(peek) {
+        unmap_image(peek);
+        set = read_config_set(NULL);
+    } else {
+        set = compile_config_set(data, cache, &src, hash, NULL);
+    }
+    if(set == NULL) {
+        syslog(LOG_ERR, "No configs to use, exiting.");
+        exit(-1);
     }
+
+    install_configs(set);
 }
 
 char* const* my_argv; 
 char* const*my_envp;
 
 /**
- * signal handler - turn off all nostromo leds at exit
+ * signal handler - turn off all nostromo leds at exit.  Signals
+ * arrive through the signalfd, so this runs from the event loop.
  **/
 void signal_handler(int signo)
 {
@@ -772,48 +2800,32 @@ void signal_handler(int signo)
             exit(0);
             break;
         case SIGHUP:
-            load();
+            reload();
+            break;
+        case SIGUSR1:
+            dump_stats();
             break;
         case SIGUSR2:
             open_readers();
             break;
-        case SIGIO: {
-            struct sockaddr_in sin;
-            socklen_t len;
-            /* Rest of system will skip the socket if it's < 0 */
-            sockfd = accept(srvfd, (struct sockaddr*)&sin, &len);
-            if(sockfd) {
-                int addr;
-                socklen_t size;
-                size = sizeof(sin);
-                struct hostent* from;
-
-                if(getpeername(sockfd, (struct sockaddr*)&sin, &size) == 0 &&
-                   (from = gethostbyaddr((char*)&sin.sin_addr, sizeof(sin.sin_addr), AF_INET)) != NULL) {
-                    syslog(LOG_INFO, "accepted connection from %s", from->h_name);
-                } else {
-                    addr = ntohl(sin.sin_addr.s_addr);
-                    syslog(LOG_INFO, "accepted connection from %d.%d.%d.%d",
-                        (addr >> 24) & 0xFF, (addr >> 16) & 0xFF,
-                        (addr >>  8) & 0xFF, (addr      ) & 0xFF);
-
-                }
-                   
-            }
-            break;
-        }
-        case SIGPIPE:
-            /* they're gone, clean up so we go local again */
-            syslog(LOG_INFO, "lost connection to fd:%d", sockfd);
-            close(sockfd);
-            sockfd = 0;
-            break;
         default:
             syslog(LOG_INFO, "nostromo_daemon received signal %d\n", signo);
             break;
     }
 }
 
+/**
+ * Signals we handle, all of them taken through signal_src.
+ **/
+static void signal_ready(event_source* src, uint32_t events)
+{
+    struct signalfd_siginfo info;
+
+    while(read(src->fd, &info, sizeof(info)) == sizeof(info)) {
+        signal_handler(info.ssi_signo);
+    }
+}
+
 /* Isn't in a header somewhere? */
 struct input_devinfo {
         uint16_t bustype;
@@ -822,75 +2834,145 @@ struct input_devinfo {
         uint16_t version;
 };
 
-void* reader_thread(void* n)
+/**
+ * Input from one of the devices.  Takes everything the kernel has
+ * queued in one read().
+ **/
+static void device_ready(event_source* src, uint32_t events)
 {
-    struct input_event ev;
-    int k;
-    nostromo_state* nost = (nostromo_state*)n;
-    int led_states[][3] = {
-        { 0, 0, 0 },
-        { 1, 0, 0 },
-        { 0, 1, 0 },
-        { 0, 0, 1 },
-        { 0, 1, 0 },
-        { 1, 0, 0 },
-        { 0, 0, 0 },
-        { -1, -1, -1 },
-    };
-    int l;
-
-    syslog(LOG_NOTICE, "Starting reader_thread with fd=%d\n", nost->indev);
+    struct input_event ev[READ_BATCH];
+    nostromo_state* nost = (nostromo_state*)src;
+    ssize_t len;
+    int n, count;
+
+    while((len = read(nost->indev, ev, sizeof(ev))) > 0) {
+        clock_gettime(CLOCK_MONOTONIC, &nost->read_time);
+        count = len / sizeof(struct input_event);
+        loop_stats.input_events += count;
+
+        for(n = 0; n < count; n++) {
+            if(nost->mono_clock) {
+                nost->event_time.tv_sec = ev[n].time.tv_sec;
+                nost->event_time.tv_nsec = ev[n].time.tv_usec * 1000L;
+                hist_record_span(&input_latency, &nost->event_time, &nost->read_time);
+            } else {
+                nost->event_time = nost->read_time;
+            }
+            handle_nostromo_block(nost, &ev[n]);
+        }
+    }
 
-    reset_nostromo_state(nost);
+    if(len == 0 || errno != EAGAIN) {
+        /* Unplugged.  The state stays around, repeats may still point at it */
+        syslog(LOG_WARNING, "lost device fd=%d %s(%d)\n", nost->indev, strerror(errno), errno);
+        if(nost->dev->led_fd == nost->indev) {
+            nost->dev->led_fd = -1;
+        }
+        close(nost->indev);
+        nost->indev = -1;
 
-    /* Do the startup light show */
-    for(l = 0; led_states[l][0] != -1; l++) {
-        nost->leds[0] = led_states[l][0];
-        nost->leds[1] = led_states[l][1];
-        nost->leds[2] = led_states[l][2];
-        set_nostromo_leds(nost);
-        usleep(200000);
+        /* Let go of whatever was held so nothing stays stuck down */
+        for(n = 0; n < MAX_KEYS; n++) {
+            if((nost->dev->pressed >> n) & 1) {
+                send_key_sequence(nost, n, 1);
+            }
+        }
+        nost->dev->pressed = 0;
+        flush_output();
     }
+}
 
-    while(1) {
-        if(read(nost->indev, &ev, sizeof(struct input_event)) == sizeof(struct input_event)) {
-            handle_nostromo_block(nost, &ev);
-        } else {
-            perror(__FUNCTION__);
-            syslog(LOG_WARNING, "reader_thread failed fd=%d %s(%d)\n", nost->indev, strerror(errno), errno);
-            break;
+/**
+ * Find the runtime state for a physical device, making it if it's new.
+ * @return The device, or NULL if there are too many.
+ **/
+static device_state* find_device(const char* phys, int id, int* created)
+{
+    device_state* dev;
+    device_state** tail = &devices;
+    int count = 0;
+
+    *created = 0;
+    for(dev = devices; dev; dev = dev->next) {
+        if(phys[0] && dev->id == id && !strcmp(dev->phys, phys)) {
+            return dev;
         }
+        tail = &dev->next;
+        count++;
     }
 
-    return NULL;
+    if(count == MAX_DEVICES || (dev = (device_state*)calloc(1, sizeof(device_state))) == NULL) {
+        return NULL;
+    }
+    strncpy(dev->phys, phys, sizeof(dev->phys) - 1);
+    dev->index = count;
+    dev->id = id;
+    dev->mode = NORMAL_MODE;
+    dev->led_fd = -1;
+    dev->config = config_for(dev, active_snapshot->selected);
+    *tail = dev;
+    *created = 1;
+    return dev;
 }
 
 /**
- * Kick a reader thread to life.
+ * Start handling a device node.
  **/
-pthread_t spawn_reader(int dev, int id)
+nostromo_state* add_device(int fd, int id)
 {
-    pthread_t reader;
-    nostromo_state* nost = new nostromo_state;
+    nostromo_state* nost;
+    device_state* dev;
+    uint8_t led_bitmask[LED_MAX/8 + 1] = { 0 };
+    char phys[64] = "";
+    char* input;
+    int created;
+
+    /* Nodes of one device share a physical path up to the /inputN */
+    if(ioctl(fd, EVIOCGPHYS(sizeof(phys) - 1), phys) >= 0 && (input = strrchr(phys, '/')) != NULL &&
+       !strncmp(input, "/input", 6)) {
+        *input = '\0';
+    }
+
+    if((dev = find_device(phys, id, &created)) == NULL) {
+        syslog(LOG_NOTICE, "Too many devices, ignoring fd=%d", fd);
+        close(fd);
+        return NULL;
+    }
 
+    nost = new nostromo_state;
     memset(nost, 0, sizeof(nostromo_state));
 
-    nost->indev = dev;
+    nost->dev = dev;
+    nost->indev = fd;
     nost->id = id;
 
-    /* Look for a device to control LEDs on */
-    if(id == NOSTROMO_N52_ID) {
-        uint8_t led_bitmask[LED_MAX/8 + 1] = { 0 };
-        if(ioctl(dev, EVIOCGBIT(EV_LED, sizeof(led_bitmask)), led_bitmask) >= 0) {
-            if(led_bitmask[0]) {
-                n52_LEDs = nost;
-            } 
-        }
+#if defined(EVIOCSCLOCKID)
+    /* Have the kernel stamp events on the same clock we schedule with */
+    int clock = CLOCK_MONOTONIC;
+    nost->mono_clock = (ioctl(fd, EVIOCSCLOCKID, &clock) == 0);
+#endif
+
+    /* n52's have 2 nodes, and only one of them accepts commands for the LEDs */
+    if(ioctl(fd, EVIOCGBIT(EV_LED, sizeof(led_bitmask)), led_bitmask) >= 0 && led_bitmask[0]) {
+        dev->led_fd = fd;
+    } else if(dev->led_fd < 0) {
+        dev->led_fd = fd;
+    }
+
+    syslog(LOG_NOTICE, "Handling device fd=%d (%s) as device %d\n", nost->indev, phys, dev->index);
+
+    reset_nostromo_state(nost);
+
+    /* Do the startup light show, or put back the mode's if it was replugged */
+    if(created) {
+        add_timer(TIMER_LED_SHOW, -1, -1, 0, 0, dev);
+    } else {
+        set_nostromo_leds(dev);
     }
 
-    pthread_create(&reader, NULL, reader_thread, nost);
+    watch(&nost->src, fd, device_ready, EPOLLIN);
 
-    return reader;
+    return nost;
 }
 
 /**
@@ -906,7 +2988,7 @@ int open_readers()
 
     for(i = 0; i < 16; i++) {
         snprintf(s, sizeof(s), "/dev/input/event%d", i);
-        fd = open(s, O_RDWR);
+        fd = open(s, O_RDWR | O_NONBLOCK | O_CLOEXEC);
         if(fd >= 0) {
             if(ioctl(fd, EVIOCGID, &info) == 0) {
                 if(info.vendor == BELKIN_VENDOR_ID &&
@@ -925,7 +3007,8 @@ int open_readers()
 #warning USB keyboard/mouse driver modules - which will of course prevent
 #warning the use of USB keyboard/mouse and an n52 at the same time.
 #endif
-                    found = spawn_reader(fd, info.product);
+                    add_device(fd, info.product);
+                    found = 1;
                 } 
             } else {
                 perror(s);
@@ -996,8 +3079,7 @@ void* docklet_thread(void*)
 int main(int argc, char *argv[], char* envp[])
 {
     pthread_t docklet;
-    pthread_t reader;
-    pthread_t timer;
+    sigset_t signals;
 
     my_argv = argv;
     my_envp = envp;
@@ -1008,34 +3090,53 @@ int main(int argc, char *argv[], char* envp[])
 
     ensure_singleton();
 
-    gtk_init (&argc, &argv);
-    pthread_create(&docklet, NULL, docklet_thread, NULL);
-
-    /* handle forceful exits */
-    signal(SIGHUP, signal_handler);
-    signal(SIGUSR2, signal_handler);
-
-    /* For network IO handling */
-    signal(SIGIO, signal_handler);
-    signal(SIGPIPE, signal_handler);
+    /* Signals are read from a signalfd by the event loop.  Blocked
+     * before the docklet thread starts so that it inherits the mask. */
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGHUP);
+    sigaddset(&signals, SIGUSR1);
+    sigaddset(&signals, SIGUSR2);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    /* A remote that went away shows up as a failed send() */
+    signal(SIGPIPE, SIG_IGN);
+
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+    if(epoll_fd < 0 || timer_fd < 0) {
+       syslog(LOG_NOTICE, "Couldn't create event loop: %m");
+       exit(-1);
+    }
+    watch(&timer_src, timer_fd, timer_ready, EPOLLIN);
+    watch(&signal_src, signalfd(-1, &signals, SFD_CLOEXEC | SFD_NONBLOCK), signal_ready, EPOLLIN);
 
-    /* Set up X necessaries */
-    display = XOpenDisplay(NULL);
+    if(pipe2(docklet_pipe, O_CLOEXEC | O_NONBLOCK) < 0) {
+       syslog(LOG_NOTICE, "Couldn't create docklet pipe: %m");
+       exit(-1);
+    }
+    watch(&docklet_src, docklet_pipe[0], docklet_ready, EPOLLIN);
 
-    if(!display) {
-       syslog(LOG_NOTICE, "Couldn't connect to X");
+    if(pipe2(reload_pipe, O_CLOEXEC | O_NONBLOCK) < 0) {
+       syslog(LOG_NOTICE, "Couldn't create reload pipe: %m");
        exit(-1);
     }
+    watch(&reload_src, reload_pipe[0], reload_ready, EPOLLIN);
 
-    shift_keycode = XKeysymToKeycode(display, XK_Shift_L);
-    control_keycode = XKeysymToKeycode(display, XK_Control_L);
-    meta_keycode = XKeysymToKeycode(display, XK_Meta_L);
+    if(timer_pool_init(&timers, TIMER_POOL_SIZE, TIMER_POOL_OVERFLOW) < 0) {
+       syslog(LOG_NOTICE, "Couldn't allocate timer pool");
+       exit(-1);
+    }
 
     load();
+    watch_configs();
+
+    gtk_init (&argc, &argv);
+    pthread_create(&docklet, NULL, docklet_thread, NULL);
 
     open_readers();
     open_sockets();
 
-    timer_thread(NULL);
+    event_loop();
 }
-
@@ -28,11 +28,16 @@
 #include <signal.h>
 #include <unistd.h>
 #include "nost_data.h"
+#include "cache.h"
+#include "rcu.h"
 #include "eggtrayicon.h"
 
 static EggTrayIcon *docklet = NULL;
 static GtkWidget *image = NULL;
 
+/** The GTK thread reads the daemon's configs through this */
+static rcu_reader reader;
+
 /**
  * Callback hit from the menu to reload configs.
  **/
@@ -52,8 +57,8 @@ exit_app(GtkWidget *widget, gpointer data)
     exit(0);
 }
 
-extern nost_config_data* cfg;
-extern nost_data* all_cfg;
+extern config_snapshot* active_snapshot;
+extern void post_select_config(int n);
 
 /**
  * Callback to set the current configuration from the menu.
@@ -61,7 +66,7 @@ extern nost_data* all_cfg;
 static void 
 set_cfg(void*, void* n)
 {
-    cfg = &all_cfg->configs[(int)(long long)n];
+    post_select_config((int)(long long)n);
 }
 
 /**
@@ -73,6 +78,8 @@ docklet_menu()
     static GtkWidget* menu = NULL;
     static GtkWidget* sub_menu = NULL;
     GtkWidget* entry;
+    config_snapshot* snap;
+    const config_image* cfg;
     int n;
 
     if(menu) {
@@ -82,14 +89,20 @@ docklet_menu()
     menu = gtk_menu_new();
     sub_menu = gtk_menu_new();
 
-    for(n = 0; n < all_cfg->num_configs; n++) {
-        entry = gtk_menu_item_new_with_label(all_cfg->configs[n].name);
+    /* Labels are copied, the snapshot is only needed while building */
+    rcu_read_lock(&reader);
+    snap = (config_snapshot*)rcu_dereference((void**)&active_snapshot);
+    cfg = snap->set->image;
+
+    for(n = 0; n < cfg->num_configs; n++) {
+        entry = gtk_menu_item_new_with_label(image_string(cfg, image_config(cfg, n)->name));
         g_signal_connect(G_OBJECT(entry), "activate", G_CALLBACK(set_cfg), (void*)n);
         gtk_menu_shell_append(GTK_MENU_SHELL(sub_menu), entry);
     }
 
 
-    entry = gtk_menu_item_new_with_label(cfg->name);
+    entry = gtk_menu_item_new_with_label(image_string(cfg, image_config(cfg, snap->selected)->name));
+    rcu_read_unlock(&reader);
 
     gtk_menu_item_set_submenu(GTK_MENU_ITEM(entry), sub_menu);
     gtk_menu_shell_append(GTK_MENU_SHELL(menu), entry);
@@ -131,6 +144,8 @@ daemon_create()
 {
 	GtkWidget *box;
 
+	rcu_register(&reader);
+
 	docklet = egg_tray_icon_new("Nostromo n5x");
 
 	box = gtk_event_box_new();
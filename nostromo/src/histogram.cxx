@@ -0,0 +1,117 @@
+/*
+    Nostromo_n50 configuration tools to support Belkin's Nostromo n50
+    Copyright (C) 2003 Paul Bohme and others
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+/**
+ * @file histogram.cxx
+ **/
+
+#include <syslog.h>
+
+#include "histogram.h"
+
+/**
+ * Bucket a value falls in.  Values below HIST_SUB_COUNT get a bucket
+ * each, above that the top HIST_SUB_BITS bits below the leading one
+ * pick the sub-bucket within its power of two.
+ **/
+static int bucket_of(unsigned long v)
+{
+    int msb;
+
+    if(v < HIST_SUB_COUNT) {
+        return (int)v;
+    }
+    msb = 63 - __builtin_clzl(v);
+    return (msb - HIST_SUB_BITS + 1) * HIST_SUB_COUNT + (int)((v >> (msb - HIST_SUB_BITS)) & (HIST_SUB_COUNT - 1));
+}
+
+/**
+ * Largest value that lands in a bucket.
+ **/
+static unsigned long bucket_top(int b)
+{
+    int shift;
+
+    if(b < HIST_SUB_COUNT) {
+        return b;
+    }
+    shift = b / HIST_SUB_COUNT - 1;
+    return ((unsigned long)(HIST_SUB_COUNT + b % HIST_SUB_COUNT + 1) << shift) - 1;
+}
+
+/**
+ * Count one value.  Negative values (clock skew between stages) count as 0.
+ **/
+void hist_record(histogram* h, long ns)
+{
+    unsigned long v = ns > 0 ? ns : 0;
+    unsigned long max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+
+    __atomic_fetch_add(&h->buckets[bucket_of(v)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->total, v, __ATOMIC_RELAXED);
+    while(v > max && !__atomic_compare_exchange_n(&h->max, &max, v, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+/**
+ * Count the time between two CLOCK_MONOTONIC readings.
+ **/
+void hist_record_span(histogram* h, const struct timespec* from, const struct timespec* to)
+{
+    hist_record(h, (to->tv_sec - from->tv_sec) * 1000000000L + (to->tv_nsec - from->tv_nsec));
+}
+
+/**
+ * Value at or below which pct percent of the recorded values fall.
+ **/
+unsigned long hist_percentile(const histogram* h, double pct)
+{
+    unsigned long count = __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+    unsigned long want = (unsigned long)(count * pct / 100.0 + 0.5);
+    unsigned long seen = 0;
+    int b;
+
+    if(want == 0) {
+        want = 1;
+    }
+    for(b = 0; b < HIST_BUCKETS; b++) {
+        seen += __atomic_load_n(&h->buckets[b], __ATOMIC_RELAXED);
+        if(seen >= want) {
+            unsigned long top = bucket_top(b);
+            return top < h->max ? top : h->max;
+        }
+    }
+    return h->max;
+}
+
+/**
+ * Write a one line summary to syslog, in microseconds.
+ **/
+void hist_log(const histogram* h)
+{
+    if(h->count == 0) {
+        syslog(LOG_INFO, "%s: no samples", h->name);
+        return;
+    }
+    syslog(LOG_INFO, "%s: count=%lu avg=%.1fus p50=%.1fus p99=%.1fus p99.9=%.1fus max=%.1fus",
+        h->name, h->count, h->total / (double)h->count / 1000.0,
+        hist_percentile(h, 50.0) / 1000.0, hist_percentile(h, 99.0) / 1000.0,
+        hist_percentile(h, 99.9) / 1000.0, h->max / 1000.0);
+}
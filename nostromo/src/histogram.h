@@ -0,0 +1,56 @@
+/*
+    Nostromo_n50 configuration tools to support Belkin's Nostromo n50
+    Copyright (C) 2003 Paul Bohme and others
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <time.h>
+
+/**
+ * @file histogram.h
+ * Latency histograms.  Log-linear buckets in the style of HdrHistogram:
+ * each power of two is split into 2^HIST_SUB_BITS linear buckets, so
+ * every recorded value is kept to within about 6% from nanoseconds up
+ * to minutes in a fixed 8KB table.  Recording is a couple of atomic
+ * adds, safe from any thread, no locks.
+ **/
+
+/** Linear sub-buckets per power of two, as a bit count */
+#define HIST_SUB_BITS 4
+#define HIST_SUB_COUNT (1 << HIST_SUB_BITS)
+
+/** Enough buckets to cover every 64 bit value */
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB_COUNT)
+
+/**
+ * One histogram of nanosecond values.
+ **/
+typedef struct {
+    const char* name;
+    unsigned long count;
+    unsigned long total;
+    unsigned long max;
+    unsigned long buckets[HIST_BUCKETS];
+} histogram;
+
+void hist_record(histogram* h, long ns);
+void hist_record_span(histogram* h, const struct timespec* from, const struct timespec* to);
+unsigned long hist_percentile(const histogram* h, double pct);
+void hist_log(const histogram* h);
+
+#endif // HISTOGRAM_H
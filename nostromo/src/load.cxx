@@ -21,161 +21,1141 @@
 
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
 
-#include <libxml/parser.h>
-#include <libxml/tree.h>
+#include <libxml/xmlreader.h>
+#include <libxml/xmlwriter.h>
+
+/** Configs to allocate room for up front, grows by doubling */
+#define INITIAL_CONFIGS 8
+
+/** Most threads load_profiles() parses with */
+#define MAX_LOAD_THREADS 8
 
 /**
- * Find a node by name, sucks that I can't find this in libxml2?
+ * Names keys get in new configs, and when the config file leaves
+ * them out.
  **/
-xmlNode* find_node(xmlNode* parent, const char* name) {
-    xmlNode* found = NULL;
-    for(found = parent->children; found; found = found->next) {
-        if(!strcmp(name, (char*)found->name)) {
-            break;
+const char* const default_key_names[MAX_KEYS] = {
+    "Button 01",
+    "Button 02",
+    "Button 03",
+    "Button 04",
+    "Button 05",
+    "Button 06",
+    "Button 07",
+    "Button 08",
+    "Button 09",
+    "Button 10",
+    "DPad up (top)",
+    "DPad down (bottom)",
+    "DPad right (front)",
+    "DPad left (rear)",
+    "Button 11",
+    "Button 12",
+    "Button 13",
+    "Button 14",
+    "Button 15",
+    "Orange button",
+    "Mouse wheel up (forward)",
+    "Press mouse wheel",
+    "Mouse wheel down (back)"
+};
+
+/**
+ * Where the reader is in the document.  Indexes rather than pointers,
+ * the configs array moves as it grows.  A config's modes and a key's
+ * strokes are gathered in scratch space and only go into the arena
+ * once it's known how many there are.
+ **/
+typedef struct {
+    nost_data* data;
+    int allocated;      /**< Configs there's room for */
+    int config;         /**< Config being read, -1 outside of one */
+    int mode;           /**< Mode being read, -1 if out of range */
+    int next_mode;      /**< Mode number a <mode> without num gets */
+    int key;            /**< Key being read, -1 if out of range */
+    int next_key;       /**< Key number a <key> without num gets */
+    size_t config_mem;  /**< Arena use when the config started */
+    nost_mode_data* modes;  /**< The config's modes so far */
+    int num_modes;
+    int modes_allocated;
+    nost_key_stroke_data* strokes;  /**< The key's strokes so far */
+    int num_strokes;
+    int strokes_allocated;
+    const char* current;    /**< Name of the current config, if the file gives it */
+} load_state;
+
+/**
+ * Step to an element's next attribute.  The strings stay good until
+ * the next xmlTextReaderRead(), so there's no need to copy them.
+ * @return 0 once there are no more, and the reader is back on the element.
+ **/
+static int next_attr(xmlTextReaderPtr reader, const char** name, const char** value)
+{
+    while(xmlTextReaderMoveToNextAttribute(reader) == 1) {
+        *name = (const char*)xmlTextReaderConstLocalName(reader);
+        *value = (const char*)xmlTextReaderConstValue(reader);
+        if(*name && *value) {
+            return 1;
         }
     }
+    xmlTextReaderMoveToElement(reader);
+    return 0;
+}
 
-    return found;
+/**
+ * Point a string at the interned copy of an attribute value.
+ **/
+static void set_str(nost_data* data, const char** str, const char* value)
+{
+    *str = arena_intern(&data->mem, value);
 }
 
 /**
- * Pull an int value from an attribute, if it's there.
- * If not, don't touch the value.
+ * The key being read is done: give it its strokes, in one piece.
  **/
-void get_int_attr(xmlNode* node, const char* name, int* val) {
-    xmlChar* attr = xmlGetProp(node, BAD_CAST name);
-    if(attr) {
-        *val = atoi((char*)attr);
-        xmlFree(attr);
+static void finish_key(load_state* st)
+{
+    nost_key_config_data* key;
+    nost_key_stroke_data* strokes;
+    int count;
+
+    if(st->num_strokes == 0) {
+        return;
     }
+    key = &st->modes[st->mode].keys[st->key];
+    count = key->key_count + st->num_strokes;
+
+    strokes = (nost_key_stroke_data*)arena_alloc(&st->data->mem, count * sizeof(nost_key_stroke_data));
+    if(strokes) {
+        /* A key can be in the file twice, the strokes add up */
+        if(key->key_count) {
+            memcpy(strokes, key->data, key->key_count * sizeof(nost_key_stroke_data));
+        }
+        memcpy(&strokes[key->key_count], st->strokes, st->num_strokes * sizeof(nost_key_stroke_data));
+        key->data = strokes;
+        key->key_count = count;
+        key->strokes_allocated = count;
+    }
+    st->num_strokes = 0;
 }
 
 /**
- * Pull a string value from an attribute, if it's there.
- * If not, don't touch the value.
- * Caller is responsible for freeing memory.
+ * The config being read is done: move its modes to the arena, with
+ * defaults for whatever the file left out, and note what it cost.
+ * Modes only switched to get keys too, they just do nothing.
  **/
-void get_str_attr(xmlNode* node, const char* name, char** val) {
-    xmlChar* attr = xmlGetProp(node, BAD_CAST name);
-    if(attr) {
-        *val = strdup((char*)attr);
-        xmlFree(attr);
+static void finish_config(load_state* st)
+{
+    nost_config_data* config;
+    nost_mode_data* modes;
+    int num, m, k;
+
+    if(st->config < 0) {
+        return;
     }
+    finish_key(st);
+    config = &st->data->configs[st->config];
+
+    num = st->num_modes;
+    for(m = 0; m < st->num_modes; m++) {
+        for(k = 0; k < MAX_KEYS; k++) {
+            if(key_layer(&st->modes[m].keys[k]) >= num) {
+                num = key_layer(&st->modes[m].keys[k]) + 1;
+            }
+        }
+    }
+
+    if(num && (modes = (nost_mode_data*)arena_alloc(&st->data->mem, num * sizeof(nost_mode_data)))) {
+        for(m = 0; m < num; m++) {
+            if(m >= st->num_modes) {
+                init_mode(st->data, &modes[m], m);
+                continue;
+            }
+            modes[m] = st->modes[m];
+            for(k = 0; k < MAX_KEYS; k++) {
+                /* Sparse files leave out keys that are all defaults */
+                if(modes[m].keys[k].name == NULL) {
+                    modes[m].keys[k].name = arena_intern(&st->data->mem, default_key_names[k]);
+                }
+            }
+            if(modes[m].leds < 0) {
+                modes[m].leds = default_mode_leds(m);
+            }
+        }
+        config->modes = modes;
+        config->num_modes = num;
+    }
+
+    config->mem = st->data->mem.used - st->config_mem;
+    st->config = -1;
 }
 
 /**
- *
+ * <current_config>, <networking> and <output>.
  **/
-nost_data* load_configs(const char* fname)
+static void load_setting(xmlTextReaderPtr reader, const char* element, load_state* st)
 {
-    nost_data* data;
-    xmlDoc* tree = NULL;
-    xmlNode* e_root = NULL;
-    xmlNode* e_tmp = NULL;
-    xmlNode** e_config_list = NULL;
-    xmlNode* e_config = NULL;
-    xmlNode* e_mode = NULL;
-    xmlNode* e_key = NULL;
-    xmlNode* e_stroke = NULL;
-    int c, m, k, s;
-
-    data = (nost_data*)calloc(1, sizeof(nost_data));
-    if(data == NULL) {
-        return NULL;
+    nost_data* data = st->data;
+    const char* name;
+    const char* value;
+
+    while(next_attr(reader, &name, &value)) {
+        if(!strcmp(element, "current_config")) {
+            /* The name wins, library profiles can come and go around it */
+            if(!strcmp(name, "value")) data->current_config = atoi(value);
+            else if(!strcmp(name, "name")) set_str(data, &st->current, value);
+        } else if(!strcmp(element, "networking")) {
+            if(!strcmp(name, "enabled")) data->network_enabled = atoi(value);
+            else if(!strcmp(name, "port")) data->port = atoi(value);
+            else if(!strcmp(name, "server")) set_str(data, &data->server, value);
+            else if(!strcmp(name, "transport")) set_str(data, &data->transport, value);
+            else if(!strcmp(name, "playout_delay")) data->playout_delay = atoi(value);
+            else if(!strcmp(name, "name")) set_str(data, &data->remote_name, value);
+        } else if(!strcmp(element, "output")) {
+            /* Which backend to inject events through */
+            if(!strcmp(name, "sink")) set_str(data, &data->output, value);
+        }
     }
-    data->current_config = -1;
-    data->server = strdup("");
+}
 
-    if((tree = xmlParseFile(fname)) == NULL) {
-        fprintf(stderr, "Failed to load [%s]\n", fname);
-        return data;
+/**
+ * <config>: make room for it and start filling it in.
+ **/
+static void load_config(xmlTextReaderPtr reader, load_state* st)
+{
+    nost_data* data = st->data;
+    nost_config_data* configs;
+    nost_config_data* config;
+    const char* name;
+    const char* value;
+    int allocated;
+
+    if(data->num_configs == st->allocated) {
+        allocated = st->allocated ? st->allocated * 2 : INITIAL_CONFIGS;
+        configs = (nost_config_data*)realloc(data->configs, allocated * sizeof(nost_config_data));
+        if(configs == NULL) {
+            st->config = -1;
+            return;
+        }
+        data->configs = configs;
+        st->allocated = allocated;
     }
 
-    if((e_root = xmlDocGetRootElement(tree)) == NULL) {
-        return data;
+    st->config = data->num_configs++;
+    st->config_mem = data->mem.used;
+    st->mode = -1;
+    st->key = -1;
+    st->next_mode = 0;
+    st->num_modes = 0;
+
+    config = &data->configs[st->config];
+    memset(config, 0, sizeof(nost_config_data));
+    /* Default to n50 */
+    config->model = N50;
+    config->loaded = 1;
+
+    while(next_attr(reader, &name, &value)) {
+        if(!strcmp(name, "name")) set_str(data, &config->name, value);
+        else if(!strcmp(name, "model")) config->model = (model_type)atoi(value);
     }
+}
 
-    /* Pull a current config value from the file */
-    if((e_tmp = find_node(e_root, "current_config")) != NULL) {
-        get_int_attr(e_tmp, "value", &data->current_config);
-    } else {
-        printf("Current config not found?\n");
+/**
+ * <mode>: they count up from 0 unless they say which they are.  The
+ * modes up to it are cleared out, in case it's the only one there.
+ **/
+static void load_mode(xmlTextReaderPtr reader, load_state* st)
+{
+    nost_mode_data* modes;
+    const char* name;
+    const char* value;
+    int num = st->next_mode;
+    int leds = -1;
+    int allocated;
+
+    finish_key(st);
+    while(next_attr(reader, &name, &value)) {
+        if(!strcmp(name, "num")) num = atoi(value);
+        else if(!strcmp(name, "leds")) leds = atoi(value) & (LED_RED | LED_GREEN | LED_BLUE);
     }
 
-    /* Pull a network config values from the file */
-    if((e_tmp = find_node(e_root, "networking")) != NULL) {
-        get_int_attr(e_tmp, "enabled", &data->network_enabled);
-        get_int_attr(e_tmp, "port", &data->port);
-        get_str_attr(e_tmp, "server", &data->server);
+    st->mode = -1;
+    st->next_mode = num + 1;
+    st->key = -1;
+    st->next_key = 0;
+    if(num < 0 || num >= MAX_LAYERS) {
+        return;
     }
 
-    for(data->num_configs = 0, e_tmp = e_root->children; e_tmp = e_tmp->next; e_tmp) {
-        if(!strcmp((char*)e_tmp->name, "config")) {
-            data->num_configs++;
+    if(num >= st->modes_allocated) {
+        allocated = st->modes_allocated ? st->modes_allocated * 2 : COLOR_MODES;
+        if(allocated <= num) {
+            allocated = num + 1;
+        }
+        modes = (nost_mode_data*)realloc(st->modes, allocated * sizeof(nost_mode_data));
+        if(modes == NULL) {
+            return;
         }
+        st->modes = modes;
+        st->modes_allocated = allocated;
+    }
+    while(st->num_modes <= num) {
+        memset(&st->modes[st->num_modes], 0, sizeof(nost_mode_data));
+        st->modes[st->num_modes++].leds = -1;
     }
 
-    if(data->num_configs <= 0) {
-        return data;
+    st->mode = num;
+    if(leds >= 0) {
+        st->modes[num].leds = leds;
     }
+}
 
-    data->configs = (nost_config_data*)calloc(sizeof(nost_config_data), data->num_configs);
+/**
+ * <key>: numbered like modes.  The number can come after the other
+ * attributes, so they're held on to until it's known.
+ **/
+static void load_key(xmlTextReaderPtr reader, load_state* st)
+{
+    nost_key_config_data* key;
+    const char* name;
+    const char* value;
+    const char* key_name = NULL;
+    const char* targets = NULL;
+    int num = st->next_key;
+    int type = SINGLE_KEY;
+    int repeat = 0;
+    int delay = 0;
+    int remote = 0;
+    int layer = 0;
 
-    if(data->configs == NULL) {
-        return data;
+    finish_key(st);
+    while(next_attr(reader, &name, &value)) {
+        if(!strcmp(name, "num")) num = atoi(value);
+        else if(!strcmp(name, "name")) key_name = value;
+        else if(!strcmp(name, "type")) type = atoi(value);
+        else if(!strcmp(name, "repeat")) repeat = atoi(value);
+        else if(!strcmp(name, "delay")) delay = atoi(value);
+        else if(!strcmp(name, "remote")) remote = atoi(value);
+        else if(!strcmp(name, "targets")) targets = value;
+        else if(!strcmp(name, "layer")) layer = atoi(value);
     }
 
-    for(c = 0, e_config = e_root->children; e_config; e_config = e_config->next) {
-        if(strcmp((char*)e_config->name, "config")) {
+    st->key = (num >= 0 && num < MAX_KEYS) ? num : -1;
+    st->next_key = num + 1;
+    if(st->key < 0) {
+        return;
+    }
+
+    key = &st->modes[st->mode].keys[st->key];
+    if(key_name) {
+        set_str(st->data, &key->name, key_name);
+    }
+    key->type = (key_map_type)type;
+    key->repeat = repeat;
+    key->repeat_delay = delay;
+    key->remote = remote;
+    if(targets && *targets) {
+        set_str(st->data, &key->targets, targets);
+    }
+    key->layer = (layer >= 0 && layer < MAX_LAYERS) ? layer : 0;
+}
+
+/**
+ * <stroke>: the next keystroke of the current key.
+ **/
+static void load_stroke(xmlTextReaderPtr reader, load_state* st)
+{
+    nost_key_stroke_data* stroke;
+    nost_key_stroke_data* strokes;
+    const char* name;
+    const char* value;
+    int allocated;
+
+    if(st->modes[st->mode].keys[st->key].key_count + st->num_strokes >= MAX_KEYSTROKES) {
+        return;
+    }
+    if(st->num_strokes == st->strokes_allocated) {
+        allocated = st->strokes_allocated ? st->strokes_allocated * 2 : 8;
+        strokes = (nost_key_stroke_data*)realloc(st->strokes, allocated * sizeof(nost_key_stroke_data));
+        if(strokes == NULL) {
+            return;
+        }
+        st->strokes = strokes;
+        st->strokes_allocated = allocated;
+    }
+    stroke = &st->strokes[st->num_strokes++];
+    memset(stroke, 0, sizeof(nost_key_stroke_data));
+
+    while(next_attr(reader, &name, &value)) {
+        if(!strcmp(name, "type")) stroke->type = (key_stroke_type)atoi(value);
+        else if(!strcmp(name, "code")) stroke->code = atoi(value);
+        else if(!strcmp(name, "state")) stroke->state = atoi(value);
+        else if(!strcmp(name, "display")) set_str(st->data, &stroke->display, value);
+        else if(!strcmp(name, "delay")) stroke->delay = atoi(value);
+    }
+}
+
+/**
+ * An empty set of configs, with the defaults filled in.
+ **/
+nost_data* new_configs()
+{
+    nost_data* data = (nost_data*)calloc(1, sizeof(nost_data));
+
+    if(data) {
+        arena_init(&data->mem);
+        data->current_config = -1;
+        data->server = arena_intern(&data->mem, "");
+        data->transport = arena_intern(&data->mem, DEFAULT_TRANSPORT);
+        data->output = arena_intern(&data->mem, DEFAULT_OUTPUT);
+    }
+    return data;
+}
+
+/**
+ * Read a file into data in one pass with libxml2's streaming reader,
+ * filling in the structures as elements go by.  No document tree is
+ * built.  Configs in it go after any data already has.
+ * @param current Set to the name <current_config> gives, or NULL.
+ * @return 0, or -1 if the file couldn't be read or parsed.
+ **/
+static int read_file(nost_data* data, const char* fname, const char** current)
+{
+    xmlTextReaderPtr reader;
+    load_state st;
+    const char* element;
+    int depth;
+    int ret;
+
+    if((reader = xmlReaderForFile(fname, NULL, XML_PARSE_NONET | XML_PARSE_NOBLANKS)) == NULL) {
+        fprintf(stderr, "Failed to load [%s]\n", fname);
+        return -1;
+    }
+
+    memset(&st, 0, sizeof(st));
+    st.data = data;
+    st.allocated = data->num_configs;
+    st.config = -1;
+
+    while((ret = xmlTextReaderRead(reader)) == 1) {
+        if(xmlTextReaderNodeType(reader) != XML_READER_TYPE_ELEMENT) {
             continue;
         }
+        element = (const char*)xmlTextReaderConstLocalName(reader);
+        depth = xmlTextReaderDepth(reader);
+
+        if(depth == 1) {
+            finish_config(&st);
+            if(!strcmp(element, "config")) {
+                load_config(reader, &st);
+            } else {
+                load_setting(reader, element, &st);
+            }
+        } else if(depth == 2 && st.config >= 0 && !strcmp(element, "mode")) {
+            load_mode(reader, &st);
+        } else if(depth == 3 && st.config >= 0 && st.mode >= 0 && !strcmp(element, "key")) {
+            load_key(reader, &st);
+        } else if(depth == 4 && st.config >= 0 && st.mode >= 0 && st.key >= 0 && !strcmp(element, "stroke")) {
+            load_stroke(reader, &st);
+        }
+    }
+    xmlFreeTextReader(reader);
+    finish_config(&st);
+    free(st.modes);
+    free(st.strokes);
 
-        get_str_attr(e_config, "name", &data->configs[c].name);
+    if(ret < 0) {
+        fprintf(stderr, "Failed to parse [%s]\n", fname);
+        return -1;
+    }
+    if(current) {
+        *current = st.current;
+    }
+    return 0;
+}
 
-        /* Default to n50 */
-        data->configs[c].model = N50;
-        get_int_attr(e_config, "model", (int*)&data->configs[c].model);
+/**
+ * Note what a file looks like now.
+ **/
+void stamp_file(const struct stat* st, file_stamp* stamp)
+{
+    stamp->mtime_sec = st->st_mtim.tv_sec;
+    stamp->mtime_nsec = st->st_mtim.tv_nsec;
+    stamp->size = st->st_size;
+    stamp->ino = st->st_ino;
+}
 
-        for(m = 0, e_mode = e_config->children; e_mode; e_mode = e_mode->next) {
-            if(strcmp((char*)e_mode->name, "mode")) {
+/**
+ * Whether two stamps are of the same file, unchanged.
+ **/
+int same_stamp(const file_stamp* a, const file_stamp* b)
+{
+    return a->mtime_sec == b->mtime_sec && a->mtime_nsec == b->mtime_nsec
+        && a->size == b->size && a->ino == b->ino;
+}
+
+/**
+ * Where the profile library for a config file is: beside it.
+ **/
+void library_path(const char* fname, char* path, size_t len)
+{
+    const char* slash = strrchr(fname, '/');
+
+    if(slash) {
+        snprintf(path, len, "%.*s/" LIBRARY_DIR_NAME, (int)(slash - fname), fname);
+    } else {
+        snprintf(path, len, LIBRARY_DIR_NAME);
+    }
+}
+
+/**
+ * Make room for count more configs at the end.
+ * @return 0, or -1 if out of memory.
+ **/
+static int grow_configs(nost_data* data, int count)
+{
+    nost_config_data* configs;
+
+    configs = (nost_config_data*)realloc(data->configs, (data->num_configs + count) * sizeof(nost_config_data));
+    if(configs == NULL) {
+        return -1;
+    }
+    data->configs = configs;
+    return 0;
+}
+
+/**
+ * Order library profiles by file.
+ **/
+static int compare_files(const void* a, const void* b)
+{
+    return strcmp(((const nost_config_data*)a)->file, ((const nost_config_data*)b)->file);
+}
+
+/**
+ * Read the library's index: a <profile> for each file, with its stamp,
+ * name and model.
+ * @param index Set to the entries, sorted by file, to free().
+ * @return How many there are.
+ **/
+static int read_index(nost_data* data, nost_config_data** index)
+{
+    char path[PATH_MAX+1];
+    xmlTextReaderPtr reader;
+    nost_config_data* entries = NULL;
+    nost_config_data* e;
+    const char* name;
+    const char* value;
+    int count = 0;
+    int allocated = 0;
+
+    *index = NULL;
+    snprintf(path, sizeof(path), "%s/" LIBRARY_INDEX_NAME, data->library);
+    if((reader = xmlReaderForFile(path, NULL, XML_PARSE_NONET | XML_PARSE_NOBLANKS)) == NULL) {
+        return 0;
+    }
+
+    while(xmlTextReaderRead(reader) == 1) {
+        if(xmlTextReaderNodeType(reader) != XML_READER_TYPE_ELEMENT || xmlTextReaderDepth(reader) != 1
+        || strcmp((const char*)xmlTextReaderConstLocalName(reader), "profile")) {
+            continue;
+        }
+        if(count == allocated) {
+            allocated = allocated ? allocated * 2 : INITIAL_CONFIGS;
+            if((e = (nost_config_data*)realloc(entries, allocated * sizeof(nost_config_data))) == NULL) {
+                break;
+            }
+            entries = e;
+        }
+        e = &entries[count];
+        memset(e, 0, sizeof(nost_config_data));
+        while(next_attr(reader, &name, &value)) {
+            if(!strcmp(name, "file")) set_str(data, &e->file, value);
+            else if(!strcmp(name, "name")) set_str(data, &e->name, value);
+            else if(!strcmp(name, "model")) e->model = (model_type)atoi(value);
+            else if(!strcmp(name, "mtime")) e->stamp.mtime_sec = strtoll(value, NULL, 10);
+            else if(!strcmp(name, "mtime_ns")) e->stamp.mtime_nsec = strtoll(value, NULL, 10);
+            else if(!strcmp(name, "size")) e->stamp.size = strtoull(value, NULL, 10);
+            else if(!strcmp(name, "ino")) e->stamp.ino = strtoull(value, NULL, 10);
+        }
+        if(e->file) {
+            count++;
+        }
+    }
+    xmlFreeTextReader(reader);
+
+    qsort(entries, count, sizeof(nost_config_data), compare_files);
+    *index = entries;
+    return count;
+}
+
+/**
+ * Read just the name and model of a profile file, which is as far as
+ * its <config> element.
+ * @return 0, or -1 if there's no config in it.
+ **/
+static int read_header(nost_data* data, const char* fname, nost_config_data* cfg)
+{
+    xmlTextReaderPtr reader;
+    const char* name;
+    const char* value;
+    int ret = -1;
+
+    if((reader = xmlReaderForFile(fname, NULL, XML_PARSE_NONET | XML_PARSE_NOBLANKS)) == NULL) {
+        return -1;
+    }
+    while(xmlTextReaderRead(reader) == 1) {
+        if(xmlTextReaderNodeType(reader) == XML_READER_TYPE_ELEMENT && xmlTextReaderDepth(reader) == 1
+        && !strcmp((const char*)xmlTextReaderConstLocalName(reader), "config")) {
+            while(next_attr(reader, &name, &value)) {
+                if(!strcmp(name, "name")) set_str(data, &cfg->name, value);
+                else if(!strcmp(name, "model")) cfg->model = (model_type)atoi(value);
+            }
+            ret = 0;
+            break;
+        }
+    }
+    xmlFreeTextReader(reader);
+    return ret;
+}
+
+/**
+ * Add the library's profiles to the configs, in file order, without
+ * reading them: the index has the name and model of each file that
+ * hasn't changed since it was written, only the rest are looked in.
+ * The index is brought up to date if it wasn't.
+ **/
+static void scan_library(nost_data* data, const char* fname)
+{
+    char path[PATH_MAX+1];
+    nost_config_data* index;
+    nost_config_data* found;
+    nost_config_data profile;
+    struct dirent* ent;
+    struct stat st;
+    size_t len;
+    DIR* dir;
+    int num_index;
+    int first = data->num_configs;
+    int allocated = data->num_configs;
+    int indexed = 0;
+    int changed = 0;
+
+    library_path(fname, path, sizeof(path));
+    data->library = arena_intern(&data->mem, path);
+
+    if(stat(data->library, &st) < 0 || !S_ISDIR(st.st_mode) || (dir = opendir(data->library)) == NULL) {
+        return;
+    }
+    num_index = read_index(data, &index);
+
+    while((ent = readdir(dir)) != NULL) {
+        len = strlen(ent->d_name);
+        if(ent->d_name[0] == '.' || len <= strlen(PROFILE_SUFFIX)
+        || strcmp(ent->d_name + len - strlen(PROFILE_SUFFIX), PROFILE_SUFFIX)
+        || fstatat(dirfd(dir), ent->d_name, &st, 0) < 0 || !S_ISREG(st.st_mode)) {
+            continue;
+        }
+
+        memset(&profile, 0, sizeof(profile));
+        profile.file = ent->d_name;
+        stamp_file(&st, &profile.stamp);
+        found = (nost_config_data*)bsearch(&profile, index, num_index, sizeof(nost_config_data), compare_files);
+        if(found && same_stamp(&found->stamp, &profile.stamp)) {
+            profile.name = found->name;
+            profile.model = found->model;
+            indexed++;
+        } else {
+            snprintf(path, sizeof(path), "%s/%s", data->library, ent->d_name);
+            if(read_header(data, path, &profile) < 0) {
+                fprintf(stderr, "Failed to parse [%s]\n", path);
                 continue;
             }
-            get_int_attr(e_mode, "num", &m);
-                
-            for(k = 0, e_key = e_mode->children; e_key; e_key = e_key->next) {
-                if(strcmp((char*)e_key->name, "key")) {
-                    continue;
-                }
-                get_int_attr(e_key, "num", &k);
-                get_str_attr(e_key, "name", &data->configs[c].keys[m][k].name);
-                get_int_attr(e_key, "type", (int*)&data->configs[c].keys[m][k].type);
-                get_int_attr(e_key, "repeat", (int*)&data->configs[c].keys[m][k].repeat);
-                get_int_attr(e_key, "delay", (int*)&data->configs[c].keys[m][k].repeat_delay);
-                get_int_attr(e_key, "remote", (int*)&data->configs[c].keys[m][k].remote);
-
-                for(s = 0, e_stroke = e_key->children; e_stroke; e_stroke = e_stroke->next) {
-                    if(strcmp((char*)e_stroke->name, "stroke")) {
-                        continue;
-                    }
-                    get_int_attr(e_stroke, "type", (int*)&data->configs[c].keys[m][k].data[s].type);
-                    get_int_attr(e_stroke, "code", &data->configs[c].keys[m][k].data[s].code);
-                    get_int_attr(e_stroke, "state", &data->configs[c].keys[m][k].data[s].state);
-                    get_str_attr(e_stroke, "display", &data->configs[c].keys[m][k].data[s].display);
-                    get_int_attr(e_stroke, "delay", &data->configs[c].keys[m][k].data[s].delay);
-                    s++;
-                }
-                data->configs[c].keys[m][k].key_count = s;
-                k++;
+            changed++;
+        }
+        profile.file = arena_intern(&data->mem, ent->d_name);
+
+        if(data->num_configs == allocated) {
+            allocated = allocated ? allocated * 2 : INITIAL_CONFIGS;
+            if(grow_configs(data, allocated - data->num_configs) < 0) {
+                break;
             }
-            m++;
         }
-        c++;
+        data->configs[data->num_configs++] = profile;
+    }
+    closedir(dir);
+    free(index);
+
+    qsort(&data->configs[first], data->num_configs - first, sizeof(nost_config_data), compare_files);
+
+    if(changed || indexed != num_index) {
+        write_index(data);
+    }
+
+    /* Adding or removing a profile changes this.  Taken last, writing the index does too */
+    if(stat(data->library, &st) == 0) {
+        stamp_file(&st, &data->library_stamp);
+    }
+}
+
+/**
+ * Write the library's index out for next time.  It's only a cache of
+ * what's in the profile files, anything that doesn't match it is read.
+ * @return 0, or -1 if it couldn't be saved.
+ **/
+int write_index(const nost_data* data)
+{
+    char path[PATH_MAX+1];
+    char tmp[PATH_MAX+1];
+    const nost_config_data* cfg;
+    xmlTextWriterPtr w;
+    int fd, n, ret;
+
+    snprintf(path, sizeof(path), "%s/" LIBRARY_INDEX_NAME, data->library);
+    snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path);
+    if((fd = mkstemp(tmp)) < 0) {
+        return -1;
+    }
+    close(fd);
+    if((w = xmlNewTextWriterFilename(tmp, 0)) == NULL) {
+        unlink(tmp);
+        return -1;
+    }
+
+    ret = xmlTextWriterStartDocument(w, "1.0", NULL, NULL) < 0
+       || xmlTextWriterStartElement(w, BAD_CAST "library") < 0 ? -1 : 0;
+    for(n = 0; n < data->num_configs && ret == 0; n++) {
+        cfg = &data->configs[n];
+        if(cfg->file == NULL) {
+            continue;
+        }
+        ret = xmlTextWriterStartElement(w, BAD_CAST "profile") < 0
+           || xmlTextWriterWriteAttribute(w, BAD_CAST "file", BAD_CAST cfg->file) < 0
+           || xmlTextWriterWriteAttribute(w, BAD_CAST "name", BAD_CAST (cfg->name ? cfg->name : "")) < 0
+           || xmlTextWriterWriteFormatAttribute(w, BAD_CAST "model", "%d", cfg->model) < 0
+           || xmlTextWriterWriteFormatAttribute(w, BAD_CAST "mtime", "%lld", cfg->stamp.mtime_sec) < 0
+           || xmlTextWriterWriteFormatAttribute(w, BAD_CAST "mtime_ns", "%lld", cfg->stamp.mtime_nsec) < 0
+           || xmlTextWriterWriteFormatAttribute(w, BAD_CAST "size", "%llu", cfg->stamp.size) < 0
+           || xmlTextWriterWriteFormatAttribute(w, BAD_CAST "ino", "%llu", cfg->stamp.ino) < 0
+           || xmlTextWriterEndElement(w) < 0 ? -1 : 0;
+    }
+    if(ret == 0 && xmlTextWriterEndDocument(w) < 0) {
+        ret = -1;
+    }
+    xmlFreeTextWriter(w);
+
+    if(ret < 0 || rename(tmp, path) < 0) {
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Read a profile file into configs of its own, so that it can be done
+ * on any thread.  Its stamp is taken first: if it changes while it's
+ * read, it won't match next time and gets read again.
+ * @return The configs, or NULL if there's no config to be had from it.
+ **/
+static nost_data* read_profile(const char* library, const char* file, file_stamp* stamp)
+{
+    char path[PATH_MAX+1];
+    struct stat st;
+    nost_data* part;
+
+    snprintf(path, sizeof(path), "%s/%s", library, file);
+    if(stat(path, &st) < 0 || (part = new_configs()) == NULL) {
+        fprintf(stderr, "Failed to load [%s]\n", path);
+        return NULL;
+    }
+    stamp_file(&st, stamp);
+    if(read_file(part, path, NULL) < 0 || part->num_configs < 1) {
+        free_configs(part);
+        return NULL;
+    }
+    return part;
+}
+
+/**
+ * Put what read_profile() got in place of the index entry for it.
+ * Its arena joins data's, part is freed either way.
+ * @return 0, or -1 if out of memory.
+ **/
+static int take_profile(nost_data* data, nost_config_data* cfg, nost_data* part, const file_stamp* stamp)
+{
+    const char* file = cfg->file;
+    int ret = -1;
+
+    if(arena_merge(&data->mem, &part->mem) == 0) {
+        *cfg = part->configs[0];
+        cfg->file = file;
+        cfg->stamp = *stamp;
+        ret = 0;
+    }
+    free_configs(part);
+    return ret;
+}
+
+/**
+ * Read the rest of a library profile in, if it isn't yet.
+ * @return The config, or NULL if it couldn't be read.
+ **/
+nost_config_data* load_profile(nost_data* data, int n)
+{
+    nost_config_data* cfg;
+    nost_data* part;
+    file_stamp stamp;
+
+    if(n < 0 || n >= data->num_configs) {
+        return NULL;
+    }
+    cfg = &data->configs[n];
+    if(!cfg->loaded) {
+        if(cfg->file == NULL || (part = read_profile(data->library, cfg->file, &stamp)) == NULL
+        || take_profile(data, cfg, part, &stamp) < 0) {
+            return NULL;
+        }
+    }
+    return cfg;
+}
+
+/**
+ * One load_profiles() thread's share: every step'th of the profiles
+ * wanted, so big and small ones get spread about.
+ **/
+typedef struct {
+    const nost_data* data;
+    const int* wanted;      /**< Configs to read */
+    int num_wanted;
+    int first;
+    int step;
+    nost_data** parts;      /**< What each one read as, NULL if it couldn't be */
+    file_stamp* stamps;
+} profile_loader;
+
+static void* profile_loader_thread(void* arg)
+{
+    profile_loader* l = (profile_loader*)arg;
+    int n;
+
+    for(n = l->first; n < l->num_wanted; n += l->step) {
+        l->parts[n] = read_profile(l->data->library, l->data->configs[l->wanted[n]].file, &l->stamps[n]);
+    }
+    return NULL;
+}
+
+/**
+ * Read in many library profiles at once, spread over a thread per
+ * CPU.  Each thread reads into arenas of its own; they're handed to
+ * data once all are done, so nothing is shared while they run.
+ * @param which Nonzero for each config wanted, or NULL for all of them.
+ * @return How many couldn't be read.
+ **/
+int load_profiles(nost_data* data, const char* which)
+{
+    profile_loader loaders[MAX_LOAD_THREADS];
+    pthread_t threads[MAX_LOAD_THREADS];
+    int started[MAX_LOAD_THREADS];
+    nost_data** parts;
+    file_stamp* stamps;
+    int* wanted;
+    int num_wanted = 0;
+    int num_threads;
+    int failed = 0;
+    int n;
+
+    if((wanted = (int*)malloc((data->num_configs + 1) * sizeof(int))) == NULL) {
+        return data->num_configs;
+    }
+    for(n = 0; n < data->num_configs; n++) {
+        if(!data->configs[n].loaded && data->configs[n].file && (which == NULL || which[n])) {
+            wanted[num_wanted++] = n;
+        }
+    }
+    parts = (nost_data**)calloc(num_wanted + 1, sizeof(nost_data*));
+    stamps = (file_stamp*)calloc(num_wanted + 1, sizeof(file_stamp));
+    if(parts == NULL || stamps == NULL) {
+        free(parts);
+        free(stamps);
+        free(wanted);
+        return num_wanted;
+    }
+
+    num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if(num_threads > MAX_LOAD_THREADS) {
+        num_threads = MAX_LOAD_THREADS;
+    }
+    if(num_threads > num_wanted) {
+        num_threads = num_wanted;
+    }
+    if(num_threads < 1) {
+        num_threads = 1;
+    }
+
+    /* libxml2 sets up its globals on first use, that can't race */
+    xmlInitParser();
+    for(n = 0; n < num_threads; n++) {
+        loaders[n].data = data;
+        loaders[n].wanted = wanted;
+        loaders[n].num_wanted = num_wanted;
+        loaders[n].first = n;
+        loaders[n].step = num_threads;
+        loaders[n].parts = parts;
+        loaders[n].stamps = stamps;
+    }
+    /* This thread takes the first share, and any a thread couldn't be started for */
+    for(n = 1; n < num_threads; n++) {
+        started[n] = pthread_create(&threads[n], NULL, profile_loader_thread, &loaders[n]) == 0;
+    }
+    profile_loader_thread(&loaders[0]);
+    for(n = 1; n < num_threads; n++) {
+        if(started[n]) {
+            pthread_join(threads[n], NULL);
+        } else {
+            profile_loader_thread(&loaders[n]);
+        }
+    }
+
+    for(n = 0; n < num_wanted; n++) {
+        if(parts[n] == NULL || take_profile(data, &data->configs[wanted[n]], parts[n], &stamps[n]) < 0) {
+            failed++;
+        }
+    }
+    free(parts);
+    free(stamps);
+    free(wanted);
+    return failed;
+}
+
+/**
+ * Load the config file and the index of the profile library beside
+ * it.  Of the profiles only the current one is read in, the rest wait
+ * for load_profile() or load_profiles().  Configs in the config file
+ * itself, from before there was a library, come first.
+ **/
+nost_data* load_configs(const char* fname)
+{
+    nost_data* data;
+    nost_config_data* configs;
+    const char* current = NULL;
+    int n;
+
+    if((data = new_configs()) == NULL) {
+        return NULL;
+    }
+    if(read_file(data, fname, &current) < 0) {
+        /* Half a file is no good, leave it with no configs */
+        free_configs(data);
+        if((data = new_configs()) == NULL) {
+            return NULL;
+        }
+        current = NULL;
     }
 
-    xmlFreeDoc(tree);
-    xmlCleanupParser();
+    scan_library(data, fname);
+
+    for(n = 0; current && n < data->num_configs; n++) {
+        if(data->configs[n].name && !strcmp(data->configs[n].name, current)) {
+            data->current_config = n;
+            break;
+        }
+    }
+    load_profile(data, data->current_config);
+
+    /* Give back the slack from doubling */
+    if(data->num_configs) {
+        configs = (nost_config_data*)realloc(data->configs, data->num_configs * sizeof(nost_config_data));
+        if(configs) {
+            data->configs = configs;
+        }
+    }
 
     return data;
 }
 
+/**
+ * Release everything load_configs() allocated, in one go.
+ **/
+void free_configs(nost_data* data)
+{
+    if(data == NULL) {
+        return;
+    }
+    arena_release(&data->mem);
+    free(data->configs);
+    free(data->removed);
+    free(data);
+}
+
+/**
+ * Make room for one more config at the end, cleared.
+ * @return The new config, or NULL if out of memory.
+ **/
+nost_config_data* add_config(nost_data* data)
+{
+    nost_config_data* configs;
+
+    configs = (nost_config_data*)realloc(data->configs, (data->num_configs + 1) * sizeof(nost_config_data));
+    if(configs == NULL) {
+        return NULL;
+    }
+    data->configs = configs;
+    memset(&configs[data->num_configs], 0, sizeof(nost_config_data));
+    configs[data->num_configs].loaded = 1;
+    return &configs[data->num_configs++];
+}
+
+/**
+ * Take a config out.  If it's from the library, its file is noted so
+ * that save_configs() can remove it.
+ **/
+void remove_config(nost_data* data, int n)
+{
+    const char** removed;
+
+    if(n < 0 || n >= data->num_configs) {
+        return;
+    }
+    if(data->configs[n].file) {
+        removed = (const char**)realloc(data->removed, (data->num_removed + 1) * sizeof(const char*));
+        if(removed) {
+            removed[data->num_removed++] = data->configs[n].file;
+            data->removed = removed;
+        }
+    }
+    memmove(&data->configs[n], &data->configs[n + 1], (data->num_configs - n - 1) * sizeof(nost_config_data));
+    data->num_configs--;
+}
+
+/**
+ * Make room for one more stroke at the end of a key, cleared.  The
+ * strokes move to a bigger array in the arena when they run out of
+ * room, the old one is left for free_configs().
+ * @return The new stroke, or NULL if out of memory or the key is full.
+ **/
+nost_key_stroke_data* add_stroke(nost_data* data, nost_key_config_data* key)
+{
+    nost_key_stroke_data* strokes;
+    int allocated;
+
+    if(key->key_count >= MAX_KEYSTROKES) {
+        return NULL;
+    }
+    if(key->key_count == key->strokes_allocated) {
+        allocated = key->strokes_allocated ? key->strokes_allocated * 2 : 4;
+        if(allocated > MAX_KEYSTROKES) {
+            allocated = MAX_KEYSTROKES;
+        }
+        strokes = (nost_key_stroke_data*)arena_alloc(&data->mem, allocated * sizeof(nost_key_stroke_data));
+        if(strokes == NULL) {
+            return NULL;
+        }
+        if(key->key_count) {
+            memcpy(strokes, key->data, key->key_count * sizeof(nost_key_stroke_data));
+        }
+        key->data = strokes;
+        key->strokes_allocated = allocated;
+    }
+    return &key->data[key->key_count++];
+}
+
+/**
+ * LEDs a mode lights unless the config says otherwise: the colors
+ * for the first four, nothing past them.
+ **/
+int default_mode_leds(int mode)
+{
+    static const int leds[COLOR_MODES] = { 0, LED_BLUE, LED_GREEN, LED_RED };
+
+    return (mode >= 0 && mode < COLOR_MODES) ? leds[mode] : 0;
+}
+
+/**
+ * Set up mode number num with nothing mapped.
+ **/
+void init_mode(nost_data* data, nost_mode_data* mode, int num)
+{
+    int k;
+
+    memset(mode, 0, sizeof(nost_mode_data));
+    for(k = 0; k < MAX_KEYS; k++) {
+        mode->keys[k].name = arena_intern(&data->mem, default_key_names[k]);
+    }
+    mode->leds = default_mode_leds(num);
+}
+
+/**
+ * A config's mode, adding it (and any before it) if the config doesn't
+ * go that far yet.  The modes move to a bigger array in the arena, the
+ * old one is left for free_configs().
+ * @return The mode, or NULL if out of memory or past MAX_LAYERS.
+ **/
+nost_mode_data* config_mode(nost_data* data, nost_config_data* cfg, int mode)
+{
+    nost_mode_data* modes;
+    int m;
+
+    if(mode < 0 || mode >= MAX_LAYERS) {
+        return NULL;
+    }
+    if(mode < cfg->num_modes) {
+        return &cfg->modes[mode];
+    }
+
+    modes = (nost_mode_data*)arena_alloc(&data->mem, (mode + 1) * sizeof(nost_mode_data));
+    if(modes == NULL) {
+        return NULL;
+    }
+    if(cfg->num_modes) {
+        memcpy(modes, cfg->modes, cfg->num_modes * sizeof(nost_mode_data));
+    }
+    for(m = cfg->num_modes; m <= mode; m++) {
+        init_mode(data, &modes[m], m);
+    }
+    cfg->modes = modes;
+    cfg->num_modes = mode + 1;
+    return &modes[mode];
+}
+
+/**
+ * The mode a mode shift or lock key goes to.
+ * @return -1 for keys that don't change modes.
+ **/
+int key_layer(const nost_key_config_data* key)
+{
+    switch(key->type) {
+        case NORMAL_SHIFT:
+        case NORMAL_LOCK:
+            return NORMAL_MODE;
+        case BLUE_SHIFT:
+        case BLUE_LOCK:
+            return BLUE_MODE;
+        case GREEN_SHIFT:
+        case GREEN_LOCK:
+            return GREEN_MODE;
+        case RED_SHIFT:
+        case RED_LOCK:
+            return RED_MODE;
+        case LAYER_SHIFT:
+        case LAYER_LOCK:
+            return key->layer;
+        default:
+            return -1;
+    }
+}
+
+/**
+ * Bytes a loaded config takes: its own structure and what it added to
+ * the arena.  Strings it shares with configs loaded earlier are theirs.
+ **/
+size_t config_memory(const nost_config_data* cfg)
+{
+    return sizeof(nost_config_data) + cfg->mem;
+}
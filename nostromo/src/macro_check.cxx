@@ -0,0 +1,245 @@
+/*
+    Nostromo_n50 configuration tools to support Belkin's Nostromo n50
+    Copyright (C) 2003 Paul Bohme and others
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+/**
+ * @file macro_check.cxx
+ * make check: a remote that runs macros says hello over TCP to a
+ * daemon with far more macros than its queue and send buffer hold,
+ * and doesn't read for a while, as one across a slow link wouldn't.
+ * It has to stay connected, keep getting the keys hit meanwhile, and
+ * end up with every macro, whole.  The daemon's own remote handling
+ * is built in, run by hand the way its event loop runs it.
+ **/
+
+#define main daemon_main
+#include "daemon.cxx"
+#undef main
+
+#include <netinet/in.h>
+
+/** Strokes on every key of every mode, each a press and a release */
+#define MACRO_STROKES 150
+
+/** Modes with macros */
+#define MACRO_MODES 4
+
+/** Keys hit while the remote isn't reading */
+#define STALLED_KEYS 200
+
+/** Stands in for the X server, only its modifiers are looked at */
+static output_sink check_output = { "check", NULL, NULL, NULL, NULL, NULL, 50, 37, 64 };
+
+/** Events for the keys the remote has been sent */
+static size_t key_events;
+
+/** Least that has to go to the remote as macro definitions, past its queue and send buffer */
+#define MIN_MACRO_BYTES (4 * (REMOTE_OUT_SIZE + REMOTE_SNDBUF))
+
+/**
+ * Configs with MACRO_MODES modes of MACRO_STROKES long macros on every
+ * key, all to the remotes.
+ **/
+static config_set* macro_configs(const char* cache)
+{
+    nost_data* data = new_configs();
+    nost_config_data* cfg;
+    nost_mode_data* mode;
+    nost_key_config_data* key;
+    nost_key_stroke_data* s;
+    struct stat src;
+    int m, k, n;
+
+    if(data == NULL || (cfg = add_config(data)) == NULL) {
+        return NULL;
+    }
+    cfg->name = "macros";
+    cfg->model = N52;
+    cfg->loaded = 1;
+    for(m = 0; m < MACRO_MODES; m++) {
+        if((mode = config_mode(data, cfg, m)) == NULL) {
+            return NULL;
+        }
+        for(k = 0; k < MAX_KEYS; k++) {
+            key = &mode->keys[k];
+            key->type = MULTI_KEY;
+            key->remote = 1;
+            for(n = 0; n < MACRO_STROKES; n++) {
+                if((s = add_stroke(data, key)) == NULL) {
+                    return NULL;
+                }
+                s->type = STROKE_KEY;
+                s->code = 10 + (m * MAX_KEYS + k + n) % 40;
+                s->delay = 1;
+            }
+        }
+    }
+    memset(&src, 0, sizeof(src));
+    return compile_config_set(data, cache, &src, 0, NULL);
+}
+
+/**
+ * Whether a remote got all of a batch of actions as one macro.
+ * @param got Events of each macro received, by id.
+ **/
+static int got_macro(remote_client* c, const nost_action* actions, int count, const int* got)
+{
+    uint32_t id = (const char*)actions - (const char*)cfg_image;
+    macro_slot* slot = find_macro(c, id);
+
+    return count == 0 || (slot && slot->sent && got[id / sizeof(nost_action)] == count);
+}
+
+/**
+ * Read what the daemon's sent the remote, counting the macro events,
+ * and the key events in key_events.
+ * @return Bytes of definitions read, -1 if the daemon hung up.
+ **/
+static long read_remote(int fd, wire_reader* in, int* got, size_t ids)
+{
+    const unsigned char* events;
+    wire_frame frame;
+    unsigned char* p;
+    uint32_t id;
+    uint64_t stamp;
+    size_t room, total, first, count;
+    long bytes = 0;
+    ssize_t len;
+
+    for(;;) {
+        p = wire_reader_space(in, &room);
+        if((len = recv(fd, p, room, MSG_DONTWAIT)) <= 0) {
+            break;
+        }
+        wire_reader_fill(in, len);
+        while(wire_next_frame(in, &frame) > 0) {
+            if(frame.type == WIRE_MACRO && wire_get_macro(&frame, &id, &total, &first, &count) == 0
+            && id / sizeof(nost_action) < ids && first + count <= total) {
+                got[id / sizeof(nost_action)] += count;
+                bytes += WIRE_HEADER_SIZE + frame.length;
+            } else if(frame.type == WIRE_EVENTS && wire_get_events(&frame, &events, &count, &stamp) >= 0) {
+                key_events += count / WIRE_EVENT_SIZE;
+            }
+        }
+    }
+    return len == 0 ? -1 : bytes;
+}
+
+int main()
+{
+    char cache[] = "/tmp/macro_check.XXXXXX";
+    unsigned char hello[WIRE_HEADER_SIZE + WIRE_HELLO_SIZE + WIRE_MAX_NAME];
+    struct epoll_event ev[MAX_REMOTES];
+    struct sockaddr_in sin;
+    socklen_t sin_len = sizeof(sin);
+    const nost_program* prog;
+    const nost_key_program* p;
+    device_state dev;
+    remote_client* c = &remotes[0];
+    config_set* set;
+    wire_reader in;
+    long bytes = 0, read;
+    size_t ids;
+    int* got;
+    int fd, rcvbuf = 4096, idle, dropped = 0, missing = 0;
+    int n, m, k;
+
+    signal(SIGPIPE, SIG_IGN);
+    output = &check_output;
+    if((fd = mkstemp(cache)) < 0 || (set = macro_configs(cache)) == NULL) {
+        perror("macro_check");
+        return 1;
+    }
+    close(fd);
+    unlink(cache);
+
+    memset(&dev, 0, sizeof(dev));
+    dev.id = N52;
+    dev.led_fd = -1;
+    devices = &dev;
+    install_configs(set);
+
+    /* The daemon's listening, and the remote's reading as little at a time as it can */
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    srvfd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    if(epoll_fd < 0 || srvfd < 0 || fd < 0 || bind(srvfd, (struct sockaddr*)&sin, sizeof(sin)) < 0
+    || getsockname(srvfd, (struct sockaddr*)&sin, &sin_len) < 0 || listen(srvfd, 1) < 0
+    || connect(fd, (struct sockaddr*)&sin, sizeof(sin)) < 0) {
+        perror("macro_check");
+        return 1;
+    }
+    listen_ready(NULL, EPOLLIN);
+
+    if(send(fd, hello, wire_put_hello(hello, WIRE_CAP_MACROS, 0, "check"), 0) < 0) {
+        perror("macro_check");
+        return 1;
+    }
+    client_ready(&c->src, EPOLLIN);
+    if(!c->ready) {
+        printf("FAIL: remote dropped at its hello\n");
+        return 1;
+    }
+
+    /* Keys hit while it's still not reading go out as events, alongside */
+    for(n = 0; n < STALLED_KEYS && c->ready; n++) {
+        send_key(10 + n % 40, 1, remote_bit(c));
+        send_key(10 + n % 40, 0, remote_bit(c));
+        flush_remotes();
+    }
+
+    ids = cfg_image->size / sizeof(nost_action) + 1;
+    got = (int*)calloc(ids, sizeof(int));
+    wire_reader_init(&in);
+    for(idle = 0; c->ready && idle < 100; ) {
+        if((read = read_remote(fd, &in, got, ids)) < 0) {
+            break;
+        }
+        bytes += read;
+        idle = read || c->num_defs || c->out_len ? 0 : idle + 1;
+        for(n = epoll_wait(epoll_fd, ev, MAX_REMOTES, 10) - 1; n >= 0; n--) {
+            ((event_source*)ev[n].data.ptr)->ready((event_source*)ev[n].data.ptr, ev[n].events);
+        }
+    }
+    dropped = !c->ready;
+
+    prog = image_program(cfg_image, dev.config);
+    for(m = 0; m < prog->num_modes; m++) {
+        for(k = 0; k < MAX_KEYS; k++) {
+            p = &prog->modes[m].keys[k];
+            if(!got_macro(c, press_actions(prog, p), p->press_count, got)
+            || !got_macro(c, release_actions(prog, p), p->release_count, got)) {
+                missing++;
+            }
+        }
+    }
+
+    printf("%ld bytes of macros to a remote with %d of queue and %d of send buffer: %s, "
+        "%d of %d keys' macros missing, %zu of %d key events in\n",
+        bytes, REMOTE_OUT_SIZE, REMOTE_SNDBUF, dropped ? "dropped" : "still connected",
+        missing, prog->num_modes * MAX_KEYS, key_events, 2 * STALLED_KEYS);
+    if(dropped || missing || bytes < MIN_MACRO_BYTES || key_events != 2 * STALLED_KEYS) {
+        printf("FAIL\n");
+        return 1;
+    }
+    return 0;
+}
@@ -24,11 +24,34 @@ extern "C" {
 #endif
 
 #include <sys/time.h>
+#include <sys/stat.h>
+#include "arena.h"
 
 #define CFG_FILE_NAME ".nostromorc"
 
-//! The number of available 'modes'
-#define MAX_MODES 4
+//! Directory beside CFG_FILE_NAME with one file per config (profile)
+#define LIBRARY_DIR_NAME ".nostromo.d"
+
+//! What's in the library, kept in LIBRARY_DIR_NAME so it needn't all be read
+#define LIBRARY_INDEX_NAME "index"
+
+//! Profile files in the library end in this, nothing else there is one
+#define PROFILE_SUFFIX ".xml"
+
+//! Output backend used unless the config says otherwise
+#define DEFAULT_OUTPUT "xtest"
+
+//! How the remote link is carried unless the config says otherwise
+#define DEFAULT_TRANSPORT "tcp"
+
+//! In a key's targets, plays it here as well as on the remotes named
+#define TARGET_LOCAL "local"
+
+//! The modes the n52's LEDs have names for, normal/blue/green/red
+#define COLOR_MODES 4
+
+//! Most modes (layers) a config can have, only there to catch garbage
+#define MAX_LAYERS 256
 
 //! The number of keys on the N50 device
 #define MAX_N50_KEYS 14
@@ -36,8 +59,13 @@ extern "C" {
 //! The number of keys on the N52 device [including 3 for the mouse wheel] (and our global max)
 #define MAX_KEYS 23
 
-//! How many keystrokes per key to map (for convenience)
-#define MAX_KEYSTROKES 32
+//! Most keystrokes one key can hold, all that fits in key_count
+#define MAX_KEYSTROKES 32767
+
+//! LED bits for a mode, the n52 has three
+#define LED_RED   0x01
+#define LED_GREEN 0x02
+#define LED_BLUE  0x04
 
 /**
  * Key mapping types, sets the behavior of the key 
@@ -58,6 +86,8 @@ typedef enum
     SHIFT_KEY,      /**< Hold Shift while key is held */
     CONTROL_KEY,    /**< Hold Control while key is held */
     ALT_KEY,        /**< Hold Alt while key is held */
+    LAYER_SHIFT,    /**< Flip to the key's layer while pressed */
+    LAYER_LOCK,     /**< Flip to the key's layer */
 } key_map_type;
 
 /**
@@ -96,48 +126,111 @@ typedef struct
     key_stroke_type type; /**< Keystroke or mouse hit? */
     int code;             /**< Raw scan code of the key */
     int state;            /**< State flags */
-    char* display;        /**< Display string for this keystroke */
+    const char* display;  /**< Display string for this keystroke */
     int delay;            /**< Delay until next keystroke */
 } nost_key_stroke_data;
 
+/**
+ * Enough of a file's stat to tell whether it has changed.
+ **/
+typedef struct
+{
+    long long mtime_sec;
+    long long mtime_nsec;
+    unsigned long long size;
+    unsigned long long ino;
+} file_stamp;
+
 /**
  * Info for a single nostromo key
  **/
 typedef struct 
 {
-    char* name;         /**< Display name */
+    const char* name;   /**< Display name */
     key_map_type type;  /**< What the key does when hit */
     short key_count;    /**< Number of keystrokes mapped */
-    nost_key_stroke_data data[MAX_KEYSTROKES]; /**< Keystrokes mapped */
+    short strokes_allocated;    /**< Room in data */
+    nost_key_stroke_data* data; /**< Keystrokes mapped */
     int repeat;         /**< Whether to repeat when key is held down */
     int repeat_delay;   /**< Amount of time to delay between keystrokes. */
     int remote;         /**< Whether to ship this to the remote node or not */
-
-    int pressed;        /**< Used by daemon to eat extra events when n52 keys held */
+    const char* targets;        /**< Remotes it goes to by name, comma separated, NULL for all of them */
+    int layer;          /**< Mode LAYER_SHIFT/LAYER_LOCK go to */
 } nost_key_config_data;
 
 /**
- * One set of key mappings.
+ * The keys in one mode (layer).
+ **/
+typedef struct
+{
+  nost_key_config_data keys[MAX_KEYS];  /**< keystrokes for each key */
+  int leds;                             /**< LED_* bits lit while it's active */
+} nost_mode_data;
+
+/**
+ * One set of key mappings.  Only as many modes as are configured or
+ * switched to are there, the rest have nothing mapped.  A profile
+ * from the library only has its name and model until load_profile().
  **/
 typedef struct 
 {
-  char* name;                                     /**< Display name */
+  const char* name;                               /**< Display name */
   model_type model;                               /**< Device model */
-  nost_key_config_data keys[MAX_MODES][MAX_KEYS]; /**< keystrokes for each key */
+  int num_modes;                                  /**< Modes in modes */
+  nost_mode_data* modes;                          /**< In the arena */
+  size_t mem;                                     /**< Arena bytes loading it took */
+  const char* file;                               /**< Its file in the library, NULL if it's in the main file */
+  file_stamp stamp;                               /**< What file looked like when it was indexed or read */
+  int loaded;                                     /**< Its modes are read in */
 } nost_config_data;
 
+/**
+ * Everything in the config file and the library beside it.  Strings,
+ * modes and strokes live in mem and are only ever freed all together,
+ * by free_configs(); replacing one just leaves the old one there.
+ **/
 typedef struct
 {
   int network_enabled;
   int port;
-  char* server;
+  const char* server;
+  const char* transport; /**< Remote link, "tcp" or "udp" */
+  int playout_delay;    /**< Remote's jitter buffer target in ms, 0 plays events as they come */
+  const char* remote_name;      /**< What the remote calls itself to the daemon, NULL for its hostname */
+  const char* output;   /**< Output backend for injected events, "xtest" or "uinput" */
   int num_configs;
   int current_config;
   nost_config_data* configs;
+  const char* library;  /**< The profile library's directory */
+  file_stamp library_stamp;     /**< The directory when it was read, all 0 if there isn't one */
+  const char** removed; /**< Library files of configs taken out with remove_config() */
+  int num_removed;
+  arena mem;
 } nost_data;
 
-void save_configs(const char* fname, const nost_data* data);
+/** save_configs() compression that keeps whatever the file already uses */
+#define SAVE_KEEP_COMPRESSION -1
+
+extern const char* const default_key_names[MAX_KEYS];
+
+int save_configs(const char* fname, nost_data* data, int compression);
 nost_data* load_configs(const char* fname);
+nost_config_data* load_profile(nost_data* data, int n);
+int load_profiles(nost_data* data, const char* which);
+int write_index(const nost_data* data);
+void free_configs(nost_data* data);
+nost_data* new_configs();
+nost_config_data* add_config(nost_data* data);
+void remove_config(nost_data* data, int n);
+void library_path(const char* fname, char* path, size_t len);
+void stamp_file(const struct stat* st, file_stamp* stamp);
+int same_stamp(const file_stamp* a, const file_stamp* b);
+nost_key_stroke_data* add_stroke(nost_data* data, nost_key_config_data* key);
+nost_mode_data* config_mode(nost_data* data, nost_config_data* cfg, int mode);
+void init_mode(nost_data* data, nost_mode_data* mode, int num);
+int default_mode_leds(int mode);
+int key_layer(const nost_key_config_data* key);
+size_t config_memory(const nost_config_data* cfg);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,432 @@
+/*
+    Nostromo_n50 configuration tools to support Belkin's Nostromo n50
+    Copyright (C) 2003 Paul Bohme and others
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+/**
+ * @file output.cxx
+ * Output backends:
+ *  - xtest:  XTest fake events on an Xlib connection.
+ *  - xcb:    XTest fake events on an XCB connection.  Requests are
+ *            pipelined and go out in one write per flush, with no
+ *            round trips after startup.
+ *  - uinput: A virtual keyboard/mouse made through /dev/uinput, works
+ *            under X, Wayland or the console alike.  Events are batched
+ *            and written with one write() per flush.
+ **/
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <syslog.h>
+#include <sys/ioctl.h>
+#include <linux/input.h>
+#include <linux/uinput.h>
+
+#define XK_MISCELLANY
+#include <X11/keysymdef.h>
+#include <X11/extensions/XTest.h>
+#include <X11/X.h>
+
+#ifdef HAVE_XCB_XTEST
+#include <xcb/xcb.h>
+#include <xcb/xtest.h>
+#endif
+
+#include "output.h"
+
+/******** XTest ********/
+
+static int xtest_open(output_sink* o)
+{
+    Display* display = XOpenDisplay(NULL);
+
+    if(!display) {
+        syslog(LOG_NOTICE, "Couldn't connect to X");
+        return -1;
+    }
+    o->priv = display;
+    o->shift_keycode = XKeysymToKeycode(display, XK_Shift_L);
+    o->control_keycode = XKeysymToKeycode(display, XK_Control_L);
+    o->alt_keycode = XKeysymToKeycode(display, XK_Meta_L);
+    return 0;
+}
+
+static void xtest_key(output_sink* o, int code, int press)
+{
+    XTestFakeKeyEvent((Display*)o->priv, code, press, 0);
+}
+
+static void xtest_button(output_sink* o, int button, int press)
+{
+    XTestFakeButtonEvent((Display*)o->priv, button, press, CurrentTime);
+}
+
+static void xtest_flush(output_sink* o)
+{
+    XFlush((Display*)o->priv);
+}
+
+static void xtest_close(output_sink* o)
+{
+    XCloseDisplay((Display*)o->priv);
+}
+
+#ifdef HAVE_XCB_XTEST
+/******** XCB XTest ********/
+
+typedef struct {
+    xcb_connection_t* conn;
+    xcb_window_t root;
+} xcb_state;
+
+/**
+ * The first keycode that produces a keysym.  Only done at startup, so
+ * the round trip doesn't matter.
+ **/
+static int xcb_keysym_to_keycode(xcb_connection_t* conn, xcb_keysym_t sym)
+{
+    const xcb_setup_t* setup = xcb_get_setup(conn);
+    xcb_get_keyboard_mapping_reply_t* map;
+    xcb_keysym_t* syms;
+    int count = setup->max_keycode - setup->min_keycode + 1;
+    int code = 0;
+    int n;
+
+    map = xcb_get_keyboard_mapping_reply(conn,
+        xcb_get_keyboard_mapping(conn, setup->min_keycode, count), NULL);
+    if(map == NULL) {
+        return 0;
+    }
+
+    syms = xcb_get_keyboard_mapping_keysyms(map);
+    for(n = 0; n < count * map->keysyms_per_keycode; n++) {
+        if(syms[n] == sym) {
+            code = setup->min_keycode + n / map->keysyms_per_keycode;
+            break;
+        }
+    }
+    free(map);
+    return code;
+}
+
+static int xcb_open(output_sink* o)
+{
+    xcb_state* x;
+    xcb_test_get_version_reply_t* version;
+    xcb_screen_iterator_t it;
+    int screen;
+
+    x = (xcb_state*)calloc(1, sizeof(xcb_state));
+    if(x == NULL) {
+        return -1;
+    }
+
+    x->conn = xcb_connect(NULL, &screen);
+    if(xcb_connection_has_error(x->conn)) {
+        syslog(LOG_NOTICE, "Couldn't connect to X");
+        xcb_disconnect(x->conn);
+        free(x);
+        return -1;
+    }
+
+    version = xcb_test_get_version_reply(x->conn, xcb_test_get_version(x->conn, 2, 2), NULL);
+    if(version == NULL) {
+        syslog(LOG_NOTICE, "X server has no XTEST extension");
+        xcb_disconnect(x->conn);
+        free(x);
+        return -1;
+    }
+    free(version);
+
+    it = xcb_setup_roots_iterator(xcb_get_setup(x->conn));
+    for(; it.rem && screen > 0; screen--) {
+        xcb_screen_next(&it);
+    }
+    x->root = it.data->root;
+
+    o->priv = x;
+    o->shift_keycode = xcb_keysym_to_keycode(x->conn, XK_Shift_L);
+    o->control_keycode = xcb_keysym_to_keycode(x->conn, XK_Control_L);
+    o->alt_keycode = xcb_keysym_to_keycode(x->conn, XK_Meta_L);
+    return 0;
+}
+
+static void xcb_key(output_sink* o, int code, int press)
+{
+    xcb_state* x = (xcb_state*)o->priv;
+
+    xcb_test_fake_input(x->conn, press ? XCB_KEY_PRESS : XCB_KEY_RELEASE,
+        code, XCB_CURRENT_TIME, x->root, 0, 0, 0);
+}
+
+static void xcb_button(output_sink* o, int button, int press)
+{
+    xcb_state* x = (xcb_state*)o->priv;
+
+    xcb_test_fake_input(x->conn, press ? XCB_BUTTON_PRESS : XCB_BUTTON_RELEASE,
+        button, XCB_CURRENT_TIME, x->root, 0, 0, 0);
+}
+
+static void xcb_flush_events(output_sink* o)
+{
+    xcb_state* x = (xcb_state*)o->priv;
+    xcb_generic_event_t* ev;
+
+    xcb_flush(x->conn);
+
+    /* Nobody waits on the replies, so errors land in the event queue */
+    while((ev = xcb_poll_for_event(x->conn)) != NULL) {
+        if(ev->response_type == 0) {
+            syslog(LOG_WARNING, "XTEST request failed, error %d",
+                ((xcb_generic_error_t*)ev)->error_code);
+        }
+        free(ev);
+    }
+}
+
+static void xcb_close(output_sink* o)
+{
+    xcb_state* x = (xcb_state*)o->priv;
+
+    xcb_disconnect(x->conn);
+    free(x);
+}
+#endif
+
+/******** uinput ********/
+
+/** X keycodes are evdev codes shifted up by 8 */
+#define X_KEYCODE_OFFSET 8
+
+/** Events held before a flush is forced */
+#define UINPUT_BATCH 64
+
+typedef struct {
+    int fd;
+    int count;
+    struct input_event events[UINPUT_BATCH];
+} uinput_state;
+
+static void uinput_flush(output_sink* o)
+{
+    uinput_state* u = (uinput_state*)o->priv;
+    ssize_t len = u->count * sizeof(struct input_event);
+
+    if(u->count && write(u->fd, u->events, len) != len) {
+        syslog(LOG_WARNING, "uinput write: %m");
+    }
+    u->count = 0;
+}
+
+/**
+ * Queue an event followed by its own SYN_REPORT, so that a press and
+ * release of the same key in one batch are still two separate frames.
+ **/
+static void uinput_emit(output_sink* o, int type, int code, int value)
+{
+    uinput_state* u = (uinput_state*)o->priv;
+    struct input_event* ev;
+
+    if(u->count + 2 > UINPUT_BATCH) {
+        uinput_flush(o);
+    }
+
+    ev = &u->events[u->count++];
+    memset(ev, 0, sizeof(*ev));
+    ev->type = type;
+    ev->code = code;
+    ev->value = value;
+
+    ev = &u->events[u->count++];
+    memset(ev, 0, sizeof(*ev));
+    ev->type = EV_SYN;
+    ev->code = SYN_REPORT;
+}
+
+static void uinput_key(output_sink* o, int code, int press)
+{
+    if(code > X_KEYCODE_OFFSET) {
+        uinput_emit(o, EV_KEY, code - X_KEYCODE_OFFSET, press ? 1 : 0);
+    }
+}
+
+static void uinput_button(output_sink* o, int button, int press)
+{
+    switch(button) {
+        case 1: uinput_emit(o, EV_KEY, BTN_LEFT, press ? 1 : 0); break;
+        case 2: uinput_emit(o, EV_KEY, BTN_MIDDLE, press ? 1 : 0); break;
+        case 3: uinput_emit(o, EV_KEY, BTN_RIGHT, press ? 1 : 0); break;
+        /* X reports the wheel as buttons, a "press" is one notch */
+        case 4: if(press) uinput_emit(o, EV_REL, REL_WHEEL, 1); break;
+        case 5: if(press) uinput_emit(o, EV_REL, REL_WHEEL, -1); break;
+        case 6: if(press) uinput_emit(o, EV_REL, REL_HWHEEL, -1); break;
+        case 7: if(press) uinput_emit(o, EV_REL, REL_HWHEEL, 1); break;
+        case 8: uinput_emit(o, EV_KEY, BTN_SIDE, press ? 1 : 0); break;
+        case 9: uinput_emit(o, EV_KEY, BTN_EXTRA, press ? 1 : 0); break;
+        default: break;
+    }
+}
+
+static int uinput_open(output_sink* o)
+{
+    uinput_state* u;
+    struct uinput_setup setup;
+    int n;
+
+    u = (uinput_state*)calloc(1, sizeof(uinput_state));
+    if(u == NULL) {
+        return -1;
+    }
+    o->priv = u;
+
+    if((u->fd = open("/dev/uinput", O_WRONLY | O_NONBLOCK | O_CLOEXEC)) < 0) {
+        syslog(LOG_NOTICE, "Couldn't open /dev/uinput: %m");
+        free(u);
+        return -1;
+    }
+
+    ioctl(u->fd, UI_SET_EVBIT, EV_SYN);
+    ioctl(u->fd, UI_SET_EVBIT, EV_KEY);
+    ioctl(u->fd, UI_SET_EVBIT, EV_REL);
+    for(n = KEY_ESC; n < 256; n++) {
+        ioctl(u->fd, UI_SET_KEYBIT, n);
+    }
+    for(n = BTN_LEFT; n <= BTN_TASK; n++) {
+        ioctl(u->fd, UI_SET_KEYBIT, n);
+    }
+    /* Relative axes so it's taken for a mouse as well as a keyboard */
+    ioctl(u->fd, UI_SET_RELBIT, REL_X);
+    ioctl(u->fd, UI_SET_RELBIT, REL_Y);
+    ioctl(u->fd, UI_SET_RELBIT, REL_WHEEL);
+    ioctl(u->fd, UI_SET_RELBIT, REL_HWHEEL);
+
+    memset(&setup, 0, sizeof(setup));
+    setup.id.bustype = BUS_VIRTUAL;
+    setup.id.vendor = 0x050d;
+    setup.id.product = 0x0001;
+    strncpy(setup.name, "Nostromo virtual input", UINPUT_MAX_NAME_SIZE - 1);
+
+    if(ioctl(u->fd, UI_DEV_SETUP, &setup) < 0 || ioctl(u->fd, UI_DEV_CREATE) < 0) {
+        syslog(LOG_NOTICE, "Couldn't create uinput device: %m");
+        close(u->fd);
+        free(u);
+        return -1;
+    }
+
+    o->shift_keycode = KEY_LEFTSHIFT + X_KEYCODE_OFFSET;
+    o->control_keycode = KEY_LEFTCTRL + X_KEYCODE_OFFSET;
+    o->alt_keycode = KEY_LEFTALT + X_KEYCODE_OFFSET;
+    return 0;
+}
+
+static void uinput_close(output_sink* o)
+{
+    uinput_state* u = (uinput_state*)o->priv;
+
+    uinput_flush(o);
+    ioctl(u->fd, UI_DEV_DESTROY);
+    close(u->fd);
+    free(u);
+}
+
+/******** Backend table ********/
+
+static const output_sink sinks[] = {
+    { "xtest", xtest_open, xtest_key, xtest_button, xtest_flush, xtest_close },
+#ifdef HAVE_XCB_XTEST
+    { "xcb", xcb_open, xcb_key, xcb_button, xcb_flush_events, xcb_close },
+#endif
+    { "uinput", uinput_open, uinput_key, uinput_button, uinput_flush, uinput_close },
+};
+
+/**
+ * Find and open an output backend by name.
+ * @return The opened sink, or NULL if unknown or it failed to open.
+ **/
+output_sink* open_output_sink(const char* name)
+{
+    output_sink* o;
+    unsigned int n;
+
+    for(n = 0; n < sizeof(sinks) / sizeof(sinks[0]); n++) {
+        if(!strcmp(name, sinks[n].name)) {
+            o = (output_sink*)malloc(sizeof(output_sink));
+            if(o == NULL) {
+                return NULL;
+            }
+            *o = sinks[n];
+            if(o->open(o) < 0) {
+                free(o);
+                return NULL;
+            }
+            syslog(LOG_INFO, "Using %s output", o->name);
+            return o;
+        }
+    }
+
+    syslog(LOG_NOTICE, "Unknown output type '%s'", name);
+    return NULL;
+}
+
+/**
+ * Flush and shut down an output backend.
+ **/
+void close_output_sink(output_sink* o)
+{
+    output_flush(o);
+    o->close(o);
+    free(o);
+}
+
+/**
+ * Queue a key event, it goes out on the next output_flush().
+ **/
+void output_key(output_sink* o, int code, int press)
+{
+    o->key(o, code, press);
+    o->pending++;
+}
+
+/**
+ * Queue a mouse button event, it goes out on the next output_flush().
+ **/
+void output_button(output_sink* o, int button, int press)
+{
+    o->button(o, button, press);
+    o->pending++;
+}
+
+/**
+ * Send everything queued.  Does nothing if there's nothing to send.
+ **/
+void output_flush(output_sink* o)
+{
+    if(o->pending == 0) {
+        return;
+    }
+
+    o->flush(o);
+    o->stats.flushes++;
+    o->stats.requests += o->pending;
+    if((unsigned long)o->pending > o->stats.max_batch) {
+        o->stats.max_batch = o->pending;
+    }
+    o->pending = 0;
+}
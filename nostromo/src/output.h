@@ -0,0 +1,67 @@
+/*
+    Nostromo_n50 configuration tools to support Belkin's Nostromo n50
+    Copyright (C) 2003 Paul Bohme and others
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+/**
+ * @file output.h
+ * Where injected keystrokes end up.  Each backend fills in an
+ * output_sink; the daemon and nostromo_remote only talk to that.
+ * Key codes are X keycodes and buttons are X button numbers
+ * throughout, as stored in the config; backends translate.
+ * Events are queued by output_key()/output_button() and only go out
+ * on output_flush(), so a burst of them costs one syscall.
+ **/
+
+typedef struct output_sink output_sink;
+
+/**
+ * How well events are being batched up.
+ **/
+typedef struct {
+    unsigned long flushes;      /**< Flushes that had something to send */
+    unsigned long requests;     /**< Events sent */
+    unsigned long max_batch;    /**< Most events sent by one flush */
+} output_stats;
+
+struct output_sink {
+    const char* name;
+    int (*open)(output_sink* o);                        /**< 0 on success */
+    void (*key)(output_sink* o, int code, int press);   /**< Queue a key event */
+    void (*button)(output_sink* o, int button, int press); /**< Queue a mouse button event */
+    void (*flush)(output_sink* o);                      /**< Push queued events out */
+    void (*close)(output_sink* o);
+
+    int shift_keycode;      /**< SHIFT keycode, filled in by open */
+    int control_keycode;    /**< CTRL keycode, filled in by open */
+    int alt_keycode;        /**< ALT keycode, filled in by open */
+
+    int pending;            /**< Events queued since the last flush */
+    output_stats stats;
+
+    void* priv;             /**< Backend state */
+};
+
+output_sink* open_output_sink(const char* name);
+void close_output_sink(output_sink* o);
+void output_key(output_sink* o, int code, int press);
+void output_button(output_sink* o, int button, int press);
+void output_flush(output_sink* o);
+
+#endif // OUTPUT_H
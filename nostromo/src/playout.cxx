@@ -0,0 +1,117 @@
+/*
+    Nostromo_n50 configuration tools to support Belkin's Nostromo n50
+    Copyright (C) 2003 Paul Bohme and others
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include <syslog.h>
+
+#include "playout.h"
+
+void playout_init(playout_buffer* p, int target_ms)
+{
+    p->target = target_ms * 1000LL;
+    p->delay = p->target;
+    p->jitter = 0;
+    p->offset = 0;
+    p->min_now = p->min_last = 0;
+    p->window = 0;
+    p->last_transit = 0;
+    p->last_due = 0;
+    p->started = 0;
+    p->frames = p->late = p->dropped = 0;
+}
+
+/**
+ * Start estimating over, the sender's clock may not be the one it was.
+ * The counts carry on.
+ **/
+void playout_restart(playout_buffer* p)
+{
+    p->delay = p->target;
+    p->jitter = 0;
+    p->started = 0;
+}
+
+/**
+ * Work out when to play a frame.
+ * @param sent Its timestamp, on the sender's clock.
+ * @param now Local CLOCK_MONOTONIC.
+ * @param idle Nothing's waiting to play, the offset and delay can move.
+ * @param due Set to when to play it, never before now or the last one.
+ * @return How late it is, 0 if it's in time.
+ **/
+int64_t playout_frame(playout_buffer* p, uint64_t sent, int64_t now, int idle, int64_t* due)
+{
+    int64_t transit = now - (int64_t)sent;
+    int64_t d;
+    int64_t late = 0;
+
+    if(!p->started) {
+        p->started = 1;
+        p->min_now = p->min_last = transit;
+        p->window = now;
+        p->last_transit = transit;
+        p->offset = transit;
+    }
+
+    /* Fastest trip over the last half to whole window */
+    if(now - p->window > PLAYOUT_OFFSET_WINDOW * 1000LL / 2) {
+        p->min_last = p->min_now;
+        p->min_now = transit;
+        p->window = now;
+    } else if(transit < p->min_now) {
+        p->min_now = transit;
+    }
+
+    d = transit - p->last_transit;
+    p->jitter += (d < 0 ? -d : d) - (p->jitter + 8) / 16;
+    p->last_transit = transit;
+
+    if(idle) {
+        p->offset = p->min_now < p->min_last ? p->min_now : p->min_last;
+        p->delay = PLAYOUT_JITTER_FACTOR * p->jitter / 16;
+        if(p->delay < p->target) {
+            p->delay = p->target;
+        }
+        if(p->delay > PLAYOUT_MAX_DELAY * 1000LL) {
+            p->delay = PLAYOUT_MAX_DELAY * 1000LL;
+        }
+    }
+
+    *due = (int64_t)sent + p->offset + p->delay;
+    if(*due < p->last_due) {
+        *due = p->last_due;
+    }
+    if(*due < now) {
+        late = now - *due;
+        *due = now;
+        p->late++;
+    }
+    p->last_due = *due;
+    p->frames++;
+    return late;
+}
+
+/**
+ * Log how the buffer's doing.
+ **/
+void playout_log(const playout_buffer* p)
+{
+    syslog(LOG_INFO, "playout: frames=%lu late=%lu dropped=%lu target=%lldus delay=%lldus jitter=%lldus",
+        p->frames, p->late, p->dropped, (long long)p->target, (long long)p->delay,
+        (long long)(p->jitter / 16));
+}
@@ -0,0 +1,72 @@
+/*
+    Nostromo_n50 configuration tools to support Belkin's Nostromo n50
+    Copyright (C) 2003 Paul Bohme and others
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+#ifndef PLAYOUT_H
+#define PLAYOUT_H
+
+#include <stdint.h>
+
+/**
+ * @file playout.h
+ * The remote's jitter buffer.  Streamed events carry the daemon's
+ * clock; each frame is played a fixed time after it was sent, so the
+ * spacing the daemon sent them with survives however the network
+ * bunched them up.  That time is the fastest recent trip plus a
+ * playout delay: the configured target, or more if the jitter calls
+ * for it.  Both only move while nothing's waiting to play, so nothing
+ * queued gets squeezed or stretched.
+ **/
+
+/** Most the delay grows to, however bad the jitter (ms) */
+#define PLAYOUT_MAX_DELAY 250
+
+/** The delay is kept at least this many times the jitter estimate */
+#define PLAYOUT_JITTER_FACTOR 3
+
+/** How far back the fastest trip is looked for (ms); clocks drift, routes change */
+#define PLAYOUT_OFFSET_WINDOW 10000
+
+/** Presses this late (ms) are dropped, not played; releases always play */
+#define PLAYOUT_DROP_LATE 500
+
+/**
+ * One stream's playout state, all times in microseconds.
+ **/
+typedef struct {
+    int64_t target;         /**< Configured delay */
+    int64_t delay;          /**< Delay in use */
+    int64_t jitter;         /**< Interarrival jitter estimate, times 16 (RFC 3550) */
+    int64_t offset;         /**< Local clock less the sender's on the fastest trip, in use */
+    int64_t min_now;        /**< Fastest trip this half window */
+    int64_t min_last;       /**< ...and the half before */
+    int64_t window;         /**< When this half window started */
+    int64_t last_transit;   /**< Trip of the last frame, local clock less sender's */
+    int64_t last_due;       /**< When the last frame was played, nothing goes before it */
+    int started;
+
+    unsigned long frames;   /**< Frames scheduled */
+    unsigned long late;     /**< ...that came in after they should have played */
+    unsigned long dropped;  /**< Presses too late to play at all */
+} playout_buffer;
+
+void playout_init(playout_buffer* p, int target_ms);
+void playout_restart(playout_buffer* p);
+int64_t playout_frame(playout_buffer* p, uint64_t sent, int64_t now, int idle, int64_t* due);
+void playout_log(const playout_buffer* p);
+
+#endif // PLAYOUT_H
@@ -0,0 +1,318 @@
+/*
+    Nostromo_n50 configuration tools to support Belkin's Nostromo n50
+    Copyright (C) 2003 Paul Bohme and others
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+/**
+ * @file program.cxx
+ **/
+
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+
+#include <X11/X.h>
+
+#include "program.h"
+
+/** Most actions a single stroke can expand to: 3 modifiers down, press, release, 3 up */
+#define MAX_STROKE_ACTIONS 8
+
+/** Gap between the strokes of a MULTI_KEY sequence */
+#define MULTI_KEY_GAP 10
+
+/**
+ * Compiler state while filling in a program.
+ **/
+typedef struct {
+    nost_program* prog;
+    nost_action* actions;
+    const nost_modifiers* mods;
+    int sink;
+    char* names;            /**< Targets, to go after the actions once they're done */
+    size_t names_len;
+    size_t names_size;
+} builder;
+
+/**
+ * Set where a key goes, keeping one copy of each distinct targets.
+ * Until the actions are done it's 1 past where they are in the names.
+ * @return 0 if out of memory.
+ **/
+static int route_key(builder* b, nost_key_program* p, const char* targets)
+{
+    size_t at;
+    size_t len;
+    char* names;
+
+    p->route = 0;
+    if(targets == NULL) {
+        return 1;
+    }
+    for(at = 0; at < b->names_len; at += strlen(b->names + at) + 1) {
+        if(!strcmp(b->names + at, targets)) {
+            p->route = at + 1;
+            return 1;
+        }
+    }
+    len = strlen(targets) + 1;
+    if(b->names_len + len > b->names_size) {
+        b->names_size = 2 * (b->names_len + len);
+        if((names = (char*)realloc(b->names, b->names_size)) == NULL) {
+            return 0;
+        }
+        b->names = names;
+    }
+    memcpy(b->names + b->names_len, targets, len);
+    p->route = b->names_len + 1;
+    b->names_len += len;
+    return 1;
+}
+
+static void emit(builder* b, int offset, int code, int sink, int value)
+{
+    nost_action* a = &b->actions[b->prog->num_actions++];
+
+    a->offset = offset;
+    a->code = code;
+    a->sink = sink | b->sink;
+    a->value = value;
+}
+
+static void emit_modifiers(builder* b, int offset, int state, int value)
+{
+    if(state & ShiftMask) {
+        emit(b, offset, b->mods->shift, ACTION_KEY, value);
+    }
+    if(state & ControlMask) {
+        emit(b, offset, b->mods->control, ACTION_KEY, value);
+    }
+    if(state & Mod1Mask) {
+        emit(b, offset, b->mods->alt, ACTION_KEY, value);
+    }
+}
+
+static int stroke_sink(const nost_key_stroke_data* stroke)
+{
+    return stroke->type == STROKE_MOUSE ? ACTION_MOUSE : ACTION_KEY;
+}
+
+/**
+ * SINGLE_KEY: each stroke follows the nostromo key up and down,
+ * with its modifiers wrapped around it.
+ **/
+static void compile_single(builder* b, const nost_key_config_data* key, int value)
+{
+    int n;
+
+    for(n = 0; n < key->key_count; n++) {
+        const nost_key_stroke_data* stroke = &key->data[n];
+        emit_modifiers(b, stroke->delay, stroke->state, 1);
+        emit(b, stroke->delay, stroke->code, stroke_sink(stroke), value);
+        emit_modifiers(b, stroke->delay, stroke->state, 0);
+    }
+}
+
+/**
+ * MULTI_KEY: the whole sequence is typed out on press, each stroke
+ * pressed and released in turn.
+ * @return Offset at which the sequence is done.
+ **/
+static int compile_multi(builder* b, const nost_key_config_data* key)
+{
+    int n;
+    int delay = 0;
+
+    for(n = 0; n < key->key_count; n++) {
+        const nost_key_stroke_data* stroke = &key->data[n];
+        int offset = delay + stroke->delay;
+        emit_modifiers(b, offset, stroke->state, 1);
+        emit(b, offset, stroke->code, stroke_sink(stroke), 1);
+        emit(b, offset, stroke->code, stroke_sink(stroke), 0);
+        emit_modifiers(b, offset, stroke->state, 0);
+        delay += stroke->delay + MULTI_KEY_GAP;
+    }
+
+    return delay;
+}
+
+/**
+ * Turn one configuration into a program for the daemon.  Actions for
+ * the same offset keep the order they're emitted in, the scheduler
+ * preserves that, so no ordering fudge is needed on the delays.
+ * @param prev An earlier program for this config, or NULL.
+ * @param unchanged Non-zero for each key (mode by mode) that compiles
+ *        the same as in prev; its actions are copied, not rebuilt.
+ * @return The program, or NULL if out of memory.
+ **/
+nost_program* compile_config(const nost_config_data* cfg, const nost_modifiers* mods,
+                             const nost_program* prev, const char* unchanged)
+{
+    nost_program* prog;
+    nost_program* shrunk;
+    builder b;
+    size_t max_actions = 2;
+    size_t actions;
+    int m, k, start;
+    int failed = 0;
+
+    for(m = 0; m < cfg->num_modes; m++) {
+        for(k = 0; k < MAX_KEYS; k++) {
+            if(prev && unchanged[m * MAX_KEYS + k]) {
+                const nost_key_program* old = &prev->modes[m].keys[k];
+                max_actions += old->press_count + old->release_count;
+                continue;
+            }
+            /* SINGLE_KEY expands twice, once for press and once for release */
+            max_actions += cfg->modes[m].keys[k].key_count * MAX_STROKE_ACTIONS * 2 + 2;
+        }
+    }
+
+    actions = offsetof(nost_program, modes) + cfg->num_modes * sizeof(nost_layer_program);
+    prog = (nost_program*)calloc(1, actions + max_actions * sizeof(nost_action));
+    if(prog == NULL) {
+        return NULL;
+    }
+    prog->model = cfg->model;
+    prog->num_modes = cfg->num_modes;
+    prog->actions = actions;
+
+    b.prog = prog;
+    b.actions = (nost_action*)((char*)prog + actions);
+    b.mods = mods;
+    b.names = NULL;
+    b.names_len = b.names_size = 0;
+
+    for(m = 0; m < cfg->num_modes && !failed; m++) {
+        prog->modes[m].leds = cfg->modes[m].leds;
+
+        for(k = 0; k < MAX_KEYS; k++) {
+            const nost_key_config_data* key = &cfg->modes[m].keys[k];
+            nost_key_program* p = &prog->modes[m].keys[k];
+
+            if(prev && unchanged[m * MAX_KEYS + k]) {
+                const nost_key_program* old = &prev->modes[m].keys[k];
+                *p = *old;
+                p->first = prog->num_actions;
+                memcpy(&b.actions[p->first], press_actions(prev, old),
+                       (old->press_count + old->release_count) * sizeof(nost_action));
+                prog->num_actions += old->press_count + old->release_count;
+                if(!route_key(&b, p, program_route(prev, old))) {
+                    failed = 1;
+                    break;
+                }
+                continue;
+            }
+
+            b.sink = key->remote ? ACTION_REMOTE : 0;
+            if(!route_key(&b, p, key->remote ? key->targets : NULL)) {
+                failed = 1;
+                break;
+            }
+            p->type = key->type;
+            p->first = prog->num_actions;
+
+            start = prog->num_actions;
+            switch(key->type) {
+                case SINGLE_KEY:
+                    compile_single(&b, key, 1);
+                    p->press_count = prog->num_actions - start;
+                    start = prog->num_actions;
+                    compile_single(&b, key, 0);
+                    p->release_count = prog->num_actions - start;
+                    break;
+
+                case MULTI_KEY:
+                    p->repeat_delay = compile_multi(&b, key) + key->repeat_delay;
+                    p->press_count = prog->num_actions - start;
+                    p->repeat = key->repeat ? 1 : 0;
+                    break;
+
+                case SHIFT_KEY:
+                case CONTROL_KEY:
+                case ALT_KEY:
+                {
+                    int code = (key->type == SHIFT_KEY ? mods->shift :
+                                key->type == CONTROL_KEY ? mods->control : mods->alt);
+                    emit(&b, 0, code, ACTION_KEY, 1);
+                    emit(&b, 0, code, ACTION_KEY, 0);
+                    p->press_count = p->release_count = 1;
+                    break;
+                }
+
+                case NORMAL_SHIFT:
+                case BLUE_SHIFT:
+                case GREEN_SHIFT:
+                case RED_SHIFT:
+                case LAYER_SHIFT:
+                    /* Mode changes are done by the daemon, nothing to inject */
+                    p->type = LAYER_SHIFT;
+                    p->layer = key_layer(key);
+                    break;
+
+                case NORMAL_LOCK:
+                case BLUE_LOCK:
+                case GREEN_LOCK:
+                case RED_LOCK:
+                case LAYER_LOCK:
+                    p->type = LAYER_LOCK;
+                    p->layer = key_layer(key);
+                    break;
+
+                default:
+                    break;
+            }
+        }
+    }
+
+    if(failed) {
+        free(b.names);
+        free(prog);
+        return NULL;
+    }
+
+    /* Give back what the worst-case estimate didn't use, the names go after what's left */
+    prog->names = actions + prog->num_actions * sizeof(nost_action);
+    prog->names_size = b.names_len;
+    if((shrunk = (nost_program*)realloc(prog, program_size(prog))) == NULL) {
+        free(b.names);
+        free(prog);
+        return NULL;
+    }
+    prog = shrunk;
+    if(b.names_len) {
+        memcpy((char*)prog + prog->names, b.names, b.names_len);
+    }
+    free(b.names);
+
+    for(m = 0; m < prog->num_modes; m++) {
+        for(k = 0; k < MAX_KEYS; k++) {
+            if(prog->modes[m].keys[k].route) {
+                prog->modes[m].keys[k].route += prog->names - 1;
+            }
+        }
+    }
+    return prog;
+}
+
+/**
+ * Release a compiled program.
+ **/
+void free_program(nost_program* prog)
+{
+    free(prog);
+}
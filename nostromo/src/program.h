@@ -0,0 +1,163 @@
+/*
+    Nostromo_n50 configuration tools to support Belkin's Nostromo n50
+    Copyright (C) 2003 Paul Bohme and others
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+#ifndef PROGRAM_H
+#define PROGRAM_H
+
+#include "nost_data.h"
+
+/**
+ * @file program.h
+ * Keymaps compiled down to what the daemon actually does when a key
+ * is hit: a flat list of timed press/release events with modifiers
+ * already expanded.  Built once at load time so that a keypress is a
+ * table lookup plus one batch handed to the scheduler.  Which remotes
+ * a key goes to stays by name, the daemon matches them against
+ * whoever's connected.
+ **/
+
+/** Action flags, where the event goes. */
+#define ACTION_KEY     0x00     /**< Keyboard key */
+#define ACTION_MOUSE   0x01     /**< Mouse button */
+#define ACTION_REMOTE  0x02     /**< Ship to the remote node if connected */
+
+/**
+ * One event to inject.
+ **/
+typedef struct {
+    int offset;             /**< Milliseconds after the nostromo key event */
+    unsigned short code;    /**< X keycode or mouse button */
+    unsigned char sink;     /**< ACTION_* flags */
+    unsigned char value;    /**< 1 for press, 0 for release */
+} nost_action;
+
+/**
+ * What one nostromo key does in one mode.  Mode changes are all
+ * compiled to LAYER_SHIFT or LAYER_LOCK with the layer filled in.
+ **/
+typedef struct {
+    unsigned char type;             /**< key_map_type */
+    unsigned char repeat;           /**< Re-run the press actions while held */
+    unsigned short layer;           /**< Where LAYER_SHIFT/LAYER_LOCK go */
+    unsigned int press_count;       /**< Actions to run on press */
+    unsigned int release_count;     /**< Actions to run on release */
+    unsigned int first;             /**< Index of first press action, release actions follow */
+    int repeat_delay;               /**< Offset of the repeat from the press */
+    unsigned int route;             /**< Byte offset of its targets in the names, 0 for every remote */
+} nost_key_program;
+
+/**
+ * One mode, compiled.
+ **/
+typedef struct {
+    nost_key_program keys[MAX_KEYS];
+    int leds;                       /**< LED_* bits lit while in it */
+} nost_layer_program;
+
+/**
+ * A whole configuration, compiled.  One allocation, no pointers inside:
+ * num_modes layers, then the actions they index into, then the names
+ * of the remotes keys go to.
+ **/
+typedef struct {
+    model_type model;
+    int num_modes;
+    int num_actions;
+    unsigned int actions;           /**< Byte offset of the actions */
+    unsigned int names;             /**< Byte offset of the targets, right after the actions */
+    unsigned int names_size;        /**< Bytes of them, each one terminated */
+    nost_layer_program modes[1];
+} nost_program;
+
+/**
+ * Keycodes that stroke state flags get expanded into.
+ **/
+typedef struct {
+    int shift;
+    int control;
+    int alt;
+} nost_modifiers;
+
+nost_program* compile_config(const nost_config_data* cfg, const nost_modifiers* mods,
+                             const nost_program* prev = NULL, const char* unchanged = NULL);
+void free_program(nost_program* prog);
+
+/**
+ * All of a program's actions.
+ **/
+inline const nost_action* program_actions(const nost_program* prog)
+{
+    return (const nost_action*)((const char*)prog + prog->actions);
+}
+
+/**
+ * Bytes in a program.
+ **/
+inline size_t program_size(const nost_program* prog)
+{
+    return (size_t)prog->names + prog->names_size;
+}
+
+/**
+ * What a key does in a mode.  Modes past the last configured one
+ * have nothing mapped.
+ * @return NULL if the mode isn't in the program.
+ **/
+inline const nost_key_program* program_key(const nost_program* prog, int mode, int key)
+{
+    if(mode < 0 || mode >= prog->num_modes) {
+        return NULL;
+    }
+    return &prog->modes[mode].keys[key];
+}
+
+/**
+ * The LED_* bits for a mode, all off for ones not in the program.
+ **/
+inline int program_leds(const nost_program* prog, int mode)
+{
+    return (mode >= 0 && mode < prog->num_modes) ? prog->modes[mode].leds : 0;
+}
+
+/**
+ * The remotes a key's ACTION_REMOTE actions go to: their names, comma
+ * separated, with TARGET_LOCAL for here as well.
+ * @return NULL for every remote.
+ **/
+inline const char* program_route(const nost_program* prog, const nost_key_program* key)
+{
+    return key->route ? (const char*)prog + key->route : NULL;
+}
+
+/**
+ * The press actions for a key.
+ **/
+inline const nost_action* press_actions(const nost_program* prog, const nost_key_program* key)
+{
+    return &program_actions(prog)[key->first];
+}
+
+/**
+ * The release actions for a key.
+ **/
+inline const nost_action* release_actions(const nost_program* prog, const nost_key_program* key)
+{
+    return &program_actions(prog)[key->first + key->press_count];
+}
+
+#endif // PROGRAM_H
@@ -0,0 +1,150 @@
+/*
+    Nostromo_n50 configuration tools to support Belkin's Nostromo n50
+    Copyright (C) 2003 Paul Bohme and others
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+/**
+ * @file rcu.cxx
+ * Readers only ever store their own epoch; the list of readers and the
+ * retired list are the writer's.  Everything is sequentially consistent
+ * so that a reader's epoch store is ordered before its pointer load,
+ * and the writer's publish before its epoch bump.
+ **/
+
+#include <stdlib.h>
+
+#include "rcu.h"
+
+/**
+ * Something replaced, waiting for its readers to finish.
+ **/
+typedef struct retired {
+    void* p;
+    void (*release)(void*);
+    unsigned long epoch;        /**< Readers from before this may still see it */
+    struct retired* next;
+} retired;
+
+static unsigned long global_epoch = 1;
+static rcu_reader* readers = NULL;
+static retired* retired_list = NULL;
+
+/**
+ * Add a reader.  Call before the reader thread starts using data.
+ **/
+void rcu_register(rcu_reader* r)
+{
+    rcu_reader* head = __atomic_load_n(&readers, __ATOMIC_SEQ_CST);
+
+    r->epoch = 0;
+    do {
+        r->next = head;
+    } while(!__atomic_compare_exchange_n(&readers, &head, r, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST));
+}
+
+/**
+ * Start using published data.  Doesn't nest.
+ **/
+void rcu_read_lock(rcu_reader* r)
+{
+    __atomic_store_n(&r->epoch, __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST), __ATOMIC_SEQ_CST);
+}
+
+/**
+ * Done with published data, nothing loaded since the lock may be used.
+ **/
+void rcu_read_unlock(rcu_reader* r)
+{
+    __atomic_store_n(&r->epoch, 0, __ATOMIC_RELEASE);
+}
+
+/**
+ * Load a published pointer, inside a read section.
+ **/
+void* rcu_dereference(void** p)
+{
+    return __atomic_load_n(p, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * Replace a published pointer.  Writer only.
+ **/
+void rcu_publish(void** p, void* value)
+{
+    __atomic_store_n(p, value, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * Hand over something that has been unpublished, release() is called
+ * on it once no reader can have it.  Writer only, after rcu_publish().
+ **/
+void rcu_retire(void* p, void (*release)(void*))
+{
+    retired* r = (retired*)malloc(sizeof(retired));
+
+    if(r == NULL) {
+        /* Better to leak it than free it under a reader */
+        return;
+    }
+    r->p = p;
+    r->release = release;
+    r->epoch = __atomic_add_fetch(&global_epoch, 1, __ATOMIC_SEQ_CST);
+    r->next = retired_list;
+    retired_list = r;
+
+    rcu_reclaim();
+}
+
+/**
+ * Release whatever no reader can still be looking at.  Writer only,
+ * cheap enough to call on every pass of a loop.
+ * @return The number of things still waiting.
+ **/
+int rcu_reclaim()
+{
+    retired** rp = &retired_list;
+    retired* r;
+    rcu_reader* reader;
+    unsigned long oldest = 0;
+    unsigned long epoch;
+    int waiting = 0;
+
+    if(retired_list == NULL) {
+        return 0;
+    }
+
+    /* The oldest epoch any reader is in */
+    for(reader = __atomic_load_n(&readers, __ATOMIC_SEQ_CST); reader; reader = reader->next) {
+        epoch = __atomic_load_n(&reader->epoch, __ATOMIC_SEQ_CST);
+        if(epoch && (oldest == 0 || epoch < oldest)) {
+            oldest = epoch;
+        }
+    }
+
+    while((r = *rp) != NULL) {
+        if(oldest == 0 || oldest >= r->epoch) {
+            *rp = r->next;
+            r->release(r->p);
+            free(r);
+        } else {
+            rp = &r->next;
+            waiting++;
+        }
+    }
+
+    return waiting;
+}
@@ -0,0 +1,49 @@
+/*
+    Nostromo_n50 configuration tools to support Belkin's Nostromo n50
+    Copyright (C) 2003 Paul Bohme and others
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+#ifndef RCU_H
+#define RCU_H
+
+/**
+ * @file rcu.h
+ * Epoch based reclamation for data that one thread replaces and other
+ * threads read.  The writer publishes a new pointer, then retires the
+ * old one; it is freed once every reader that might still be looking
+ * at it has left its read section.  Readers never block or take a
+ * lock, they just note the epoch they entered at.
+ **/
+
+/**
+ * A thread that reads published data.  Register once, then bracket
+ * every use of the data with rcu_read_lock()/rcu_read_unlock().
+ **/
+typedef struct rcu_reader {
+    unsigned long epoch;        /**< Epoch the read section started in, 0 when outside */
+    struct rcu_reader* next;
+} rcu_reader;
+
+void rcu_register(rcu_reader* r);
+void rcu_read_lock(rcu_reader* r);
+void rcu_read_unlock(rcu_reader* r);
+
+void* rcu_dereference(void** p);
+void rcu_publish(void** p, void* value);
+void rcu_retire(void* p, void (*release)(void*));
+int rcu_reclaim();
+
+#endif // RCU_H
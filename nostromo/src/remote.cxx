@@ -44,19 +44,78 @@
 
 #include <signal.h>
 #include <netdb.h>
+#include <poll.h>
+#include <time.h>
 #include <sys/socket.h>
 
-#define XK_MISCELLANY
-#include <X11/keysymdef.h>
-#include <X11/extensions/XTest.h>
-#include <X11/X.h>
-
 #include "nost_data.h"
+#include "output.h"
+#include "cache.h"
+#include "timer.h"
+#include "wire.h"
+#include "playout.h"
 
 #define PIDFILE "/tmp/nostromo_n50_remote.pid"
 
-Display* display;
-nost_data* all_cfg = NULL;
+output_sink* output;
+
+/** What the remote needs from the config file */
+int network_enabled = 0;
+int port = 0;
+const char* server = NULL;
+const char* transport = NULL;
+const char* sink = NULL;
+int playout_delay = 0;
+const char* remote_name = NULL;
+
+/** What we tell the daemon we're called, keys are routed by it */
+static char name[WIRE_MAX_NAME + 1];
+
+/**
+ * One of a macro's events.
+ **/
+typedef struct {
+    int offset;             /**< Milliseconds after the macro starts */
+    unsigned short code;
+    unsigned char mouse;
+    unsigned char press;
+} macro_event;
+
+/**
+ * A macro the daemon has sent, to run when it says.
+ **/
+typedef struct {
+    uint32_t id;
+    size_t count;           /**< Events in it, 0 for an empty slot */
+    size_t filled;          /**< How many have come in */
+    macro_event* events;
+} remote_macro;
+
+/** Macros, open addressed on the id */
+static remote_macro* macros = NULL;
+static int num_macros = 0;
+static int macros_size = 0;     /**< A power of 2, kept at least twice num_macros */
+
+/** Macro events, and timed ones waiting their turn, to be played */
+static timer_queue timers;
+
+/** When timed events from the daemon play */
+static playout_buffer playout;
+
+/** SIGUSR1 came in, log the playout figures */
+static volatile sig_atomic_t report = 0;
+
+/** Key codes and buttons whose order is tracked over UDP, covers uinput's KEY_MAX */
+#define MAX_CODES 1024
+
+/**
+ * Newest datagram that's pressed or released a key or button, so an
+ * older one that turns up late can't undo it.
+ **/
+typedef struct {
+    int played;
+    uint32_t seq;
+} code_state;
 
 /**
  * There can be only one.
@@ -99,19 +158,463 @@ int ensure_singleton()
 }
 
 /**
- * Load our configuration information.
+ * Load our configuration information.  The daemon's compiled image
+ * has it if it's up to date, used in place; otherwise it comes from
+ * the XML.  Rebuilding the image is left to the daemon, only it knows
+ * the keycodes the programs are compiled for.
  **/
 void load()
 {
-    /* Load our keymap settings */
     char fname[PATH_MAX+1];
+    char cache[PATH_MAX+1];
     struct passwd* pw = getpwuid(getuid());
-    int count, current, n;
-    nost_data* oldcfg = all_cfg;
+    const config_image* image;
+    nost_data* data;
+
+    snprintf(fname, sizeof(fname), "%s/" CFG_FILE_NAME, (pw ? pw->pw_dir : "."));
+    snprintf(cache, sizeof(cache), "%s/" CACHE_FILE_NAME, (pw ? pw->pw_dir : "."));
+
+    if((image = map_image(cache, fname, NULL)) != NULL) {
+        network_enabled = image->network_enabled;
+        port = image->port;
+        server = image_string(image, image->server);
+        transport = image_string(image, image->transport);
+        sink = image_string(image, image->output);
+        playout_delay = image->playout_delay;
+        remote_name = image_string(image, image->remote_name);
+        return;
+    }
 
-    sprintf(fname, "%s/.nostromorc", (pw ? pw->pw_dir : "."));
     printf("Loading configs from %s\n", fname);
-    all_cfg = load_configs(fname);
+    data = load_configs(fname);
+    network_enabled = data->network_enabled;
+    port = data->port;
+    server = data->server;
+    transport = data->transport;
+    sink = data->output;
+    playout_delay = data->playout_delay;
+    remote_name = data->remote_name;
+}
+
+/**
+ * What we ask the daemon for: timed events only if we buffer them.
+ **/
+uint32_t remote_caps()
+{
+    return WIRE_CAP_MACROS | (playout_delay > 0 ? WIRE_CAP_TIMED : 0);
+}
+
+void report_handler(int sig)
+{
+    report = 1;
+}
+
+/**
+ * Queue one event to play at a given time.
+ * @return 0 if there's no room, play it now instead.
+ **/
+int queue_event(const struct timespec* due, int mouse, int code, int press, int offset, int group)
+{
+    timer_entry* e;
+
+    if((e = timer_entry_alloc()) == NULL) {
+        return 0;
+    }
+    e->expires = *due;
+    e->origin = *due;
+    e->type = mouse ? TIMER_MOUSE_CLICK : TIMER_PRESS_KEY;
+    e->arg = code;
+    e->flag = press;
+    e->delay = offset;
+    e->id = group;
+    e->key = -1;
+    if(timer_queue_push(&timers, e) < 0) {
+        timer_entry_free(e);
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * Inject a batch of events from the daemon, all in one flush, or
+ * queue them to play together later.
+ * @param codes Over UDP, where each key and button is up to; events
+ *              older than that are skipped.  NULL over TCP, where
+ *              everything comes in order.
+ * @param seq The datagram's sequence number.
+ * @param due When to play them, NULL for now.
+ * @param drop Leave out the presses, they're too late to mean anything.
+ **/
+void play_events(const unsigned char* p, size_t length, code_state (*codes)[MAX_CODES], uint32_t seq,
+                 const struct timespec* due, int drop)
+{
+    int mouse, code, press;
+    code_state* st;
+    int played = 0;
+    size_t i;
+
+    for(i = 0; i + WIRE_EVENT_SIZE <= length; i += WIRE_EVENT_SIZE) {
+        wire_get_event(p + i, &mouse, &code, &press);
+        if(codes && code < MAX_CODES) {
+            st = &codes[mouse][code];
+            if(st->played && wire_seq_after(st->seq, seq)) {
+                continue;
+            }
+            st->played = 1;
+            st->seq = seq;
+        }
+        if(drop && press) {
+            playout.dropped++;
+            continue;
+        }
+        if(due && queue_event(due, mouse, code, press, 0, -1)) {
+            continue;
+        }
+        if(mouse) {
+            output_button(output, code, press);
+        } else {
+            output_key(output, code, press);
+        }
+        played++;
+    }
+    if(played) {
+        output_flush(output);
+    }
+}
+
+/**
+ * Take a WIRE_EVENTS or WIRE_DATAGRAM.  Timed ones go through the
+ * jitter buffer, the rest play now.
+ **/
+void take_events(const wire_frame* frame, code_state (*codes)[MAX_CODES], uint32_t seq)
+{
+    const unsigned char* p;
+    size_t length;
+    uint64_t stamp;
+    struct timespec now;
+    struct timespec due;
+    int64_t due_us;
+    int64_t late;
+    int timed;
+
+    if((timed = wire_get_events(frame, &p, &length, &stamp)) < 0) {
+        return;
+    }
+    if(!timed || playout_delay <= 0) {
+        play_events(p, length, codes, seq, NULL, 0);
+        return;
+    }
+
+    /* Nothing queued, macros included, is when the buffer can move */
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    late = playout_frame(&playout, stamp, now.tv_sec * 1000000LL + now.tv_nsec / 1000,
+                         timer_queue_peek(&timers) == NULL, &due_us);
+    due.tv_sec = due_us / 1000000;
+    due.tv_nsec = (due_us % 1000000) * 1000;
+    play_events(p, length, codes, seq, &due, late > PLAYOUT_DROP_LATE * 1000LL);
+}
+
+/**
+ * Where a macro is or would go.
+ **/
+static remote_macro* macro_slot(remote_macro* table, int size, uint32_t id)
+{
+    unsigned n = id * 2654435761u;
+
+    while(table[n & (size - 1)].count && table[n & (size - 1)].id != id) {
+        n++;
+    }
+    return &table[n & (size - 1)];
+}
+
+/**
+ * Drop every macro, the daemon's loaded something else.  Ones already
+ * started play out, their events are already queued.
+ **/
+void forget_macros()
+{
+    int n;
+
+    for(n = 0; n < macros_size; n++) {
+        free(macros[n].events);
+        macros[n].events = NULL;
+        macros[n].count = 0;
+    }
+    num_macros = 0;
+}
+
+/**
+ * Take some or all of a macro's events.
+ * @return 0 if out of memory.
+ **/
+int add_macro(const wire_frame* frame)
+{
+    remote_macro* table;
+    remote_macro* m;
+    uint32_t id;
+    size_t total, first, count, i;
+    int mouse, code, press, offset;
+    int n;
+
+    if(wire_get_macro(frame, &id, &total, &first, &count) < 0 || total == 0) {
+        return 1;
+    }
+
+    if(2 * (num_macros + 1) > macros_size) {
+        n = macros_size ? 2 * macros_size : 256;
+        if((table = (remote_macro*)calloc(n, sizeof(remote_macro))) == NULL) {
+            return 0;
+        }
+        for(i = 0; i < (size_t)macros_size; i++) {
+            if(macros[i].count) {
+                *macro_slot(table, n, macros[i].id) = macros[i];
+            }
+        }
+        free(macros);
+        macros = table;
+        macros_size = n;
+    }
+
+    m = macro_slot(macros, macros_size, id);
+    if(m->count != total) {
+        /* New, or sent again with a different length */
+        if(m->count == 0) {
+            num_macros++;
+        }
+        free(m->events);
+        m->id = id;
+        m->count = total;
+        m->filled = 0;
+        if((m->events = (macro_event*)calloc(total, sizeof(macro_event))) == NULL) {
+            return 0;
+        }
+    }
+    for(i = 0; i < count; i++) {
+        wire_get_macro_event(frame->payload + WIRE_MACRO_HEADER_SIZE + i * WIRE_MACRO_EVENT_SIZE,
+                             &mouse, &code, &press, &offset);
+        m->events[first + i].offset = offset;
+        m->events[first + i].code = code;
+        m->events[first + i].mouse = mouse;
+        m->events[first + i].press = press;
+    }
+    m->filled += count;
+    return 1;
+}
+
+/**
+ * Queue a macro's events to play, timed from now.  The daemon
+ * handles the key down, everything after that is timed here.
+ **/
+void start_macro(const wire_frame* frame)
+{
+    struct timespec now;
+    struct timespec due;
+    remote_macro* m;
+    uint32_t id;
+    unsigned group;
+    size_t n;
+
+    if(wire_get_start(frame, &id, &group) < 0 || macros_size == 0) {
+        return;
+    }
+    m = macro_slot(macros, macros_size, id);
+    if(m->count == 0 || m->filled < m->count) {
+        syslog(LOG_NOTICE, "Daemon started macro %u we don't have", id);
+        return;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    for(n = 0; n < m->count; n++) {
+        due = now;
+        timespec_add_ms(&due, m->events[n].offset);
+        if(!queue_event(&due, m->events[n].mouse, m->events[n].code, m->events[n].press,
+                        m->events[n].offset, group == WIRE_NO_GROUP ? -1 : (int)group)) {
+            break;
+        }
+    }
+}
+
+/**
+ * Play every queued event that's due, with one flush.
+ **/
+void run_timers()
+{
+    struct timespec now;
+    timer_entry* t;
+    int fired = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    while((t = timer_queue_peek(&timers)) != NULL && !timespec_before(&now, &t->expires)) {
+        timer_queue_pop(&timers);
+        if(t->type == TIMER_MOUSE_CLICK) {
+            output_button(output, t->arg, t->flag);
+        } else {
+            output_key(output, t->arg, t->flag);
+        }
+        timer_entry_free(t);
+        fired++;
+    }
+    if(fired) {
+        output_flush(output);
+    }
+    if(report) {
+        report = 0;
+        playout_log(&playout);
+    }
+}
+
+/**
+ * Wait for the daemon or the next queued event, whichever's first.
+ * @param limit Longest to wait in milliseconds, -1 for no limit.
+ * @return What poll() does.
+ **/
+int wait_for(int sockd, int limit)
+{
+    struct pollfd pfd;
+    struct timespec now;
+    struct timespec timeout;
+    timer_entry* t;
+    long us;
+
+    pfd.fd = sockd;
+    pfd.events = POLLIN;
+    if((t = timer_queue_peek(&timers)) == NULL) {
+        return poll(&pfd, 1, limit);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    us = timespec_diff_us(&t->expires, &now);
+    if(us < 0) {
+        us = 0;
+    }
+    if(limit >= 0 && us > limit * 1000L) {
+        us = limit * 1000L;
+    }
+    timeout.tv_sec = us / 1000000;
+    timeout.tv_nsec = (us % 1000000) * 1000;
+    return ppoll(&pfd, 1, &timeout, NULL);
+}
+
+/**
+ * Take whatever the daemon sent, which can be any number of frames
+ * or only part of one.  The first has to be its hello.
+ * @return 0 if the connection is no good any more.
+ **/
+int read_frames(int sockd, wire_reader* in, int* greeted)
+{
+    wire_frame frame;
+    unsigned char* p;
+    size_t room;
+    ssize_t len;
+    unsigned version;
+    unsigned group;
+    uint32_t caps;
+    int ret;
+
+    p = wire_reader_space(in, &room);
+    if((len = recv(sockd, p, room, 0)) <= 0) {
+        return len < 0 && errno == EINTR;
+    }
+    wire_reader_fill(in, len);
+    wire_quickack(sockd);
+
+    while((ret = wire_next_frame(in, &frame)) > 0) {
+        if(!*greeted) {
+            if(wire_get_hello(&frame, &version, &caps) < 0 || version != WIRE_VERSION) {
+                syslog(LOG_ERR, "Daemon doesn't speak protocol %d", WIRE_VERSION);
+                return 0;
+            }
+            *greeted = 1;
+        } else if(frame.type == WIRE_EVENTS) {
+            take_events(&frame, NULL, 0);
+        } else if(frame.type == WIRE_MACRO) {
+            if(!add_macro(&frame)) {
+                syslog(LOG_ERR, "Out of memory for macros");
+                return 0;
+            }
+        } else if(frame.type == WIRE_START) {
+            start_macro(&frame);
+        } else if(frame.type == WIRE_STOP) {
+            if(wire_get_stop(&frame, &group) == 0) {
+                timer_queue_cancel(&timers, group);
+            }
+        } else if(frame.type == WIRE_FORGET) {
+            forget_macros();
+        }
+        /* Anything else is newer than us and can be skipped */
+    }
+    return ret == 0;
+}
+
+/**
+ * Milliseconds on the monotonic clock.
+ **/
+long long now_ms()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/**
+ * Over UDP: say hello until the daemon answers, and every
+ * WIRE_KEEPALIVE after so a restarted daemon finds us again.  Its
+ * first hello, or one flagged WIRE_HELLO_NEW, starts the numbering
+ * over.  Datagrams are played unless
+ * they've been seen or are too far behind, and then only their events
+ * for keys nothing newer has touched; timed ones wait in the jitter
+ * buffer with the rest.
+ **/
+void run_udp(int sockd)
+{
+    unsigned char buf[WIRE_MAX_DATAGRAM];
+    unsigned char hello[WIRE_HEADER_SIZE + WIRE_HELLO_SIZE + WIRE_MAX_NAME];
+    static code_state codes[2][MAX_CODES];
+    wire_window window;
+    wire_frame frame;
+    long long next = 0;
+    long long now;
+    unsigned version;
+    uint32_t caps;
+    uint32_t seq;
+    int greeted = 0;
+    ssize_t len;
+
+    wire_window_init(&window);
+    while(1) {
+        if((now = now_ms()) >= next) {
+            /* Refused until the daemon's up, that's fine */
+            send(sockd, hello, wire_put_hello(hello, remote_caps(), 0, name), 0);
+            next = now + (greeted ? WIRE_KEEPALIVE : WIRE_HELLO_RETRY);
+        }
+        if(wait_for(sockd, (int)(next - now)) <= 0) {
+            run_timers();
+            continue;
+        }
+        if((len = recv(sockd, buf, sizeof(buf), 0)) < 0 || wire_get_datagram(buf, len, &frame) < 0) {
+            continue;
+        }
+
+        if(frame.type == WIRE_HELLO) {
+            if(wire_get_hello(&frame, &version, &caps) < 0 || version != WIRE_VERSION) {
+                syslog(LOG_ERR, "Daemon doesn't speak protocol %d", WIRE_VERSION);
+                exit(-1);
+            }
+            if(!greeted || (frame.flags & WIRE_HELLO_NEW)) {
+                wire_window_init(&window);
+                memset(codes, 0, sizeof(codes));
+                playout_restart(&playout);
+            }
+            greeted = 1;
+            next = now_ms() + WIRE_KEEPALIVE;
+        } else if(frame.type == WIRE_DATAGRAM && greeted) {
+            seq = wire_get_seq(&frame);
+            if(wire_window_check(&window, seq)) {
+                take_events(&frame, codes, seq);
+            }
+        }
+        run_timers();
+    }
 }
 
 /**
@@ -121,19 +624,26 @@ int main(int argc, char *argv[])
 {
     int pid, pidfd = 0;
     int sockd;
-    int key, flags;
-    key_stroke_type type;
+    int greeted = 0;
+    int udp;
+    int ret;
+    unsigned char hello[WIRE_HEADER_SIZE + WIRE_HELLO_SIZE + WIRE_MAX_NAME];
+    size_t len;
+    static wire_reader in;
     struct sockaddr_in s;
     struct hostent* h;
-    char* hostname;
-    short port;
+    const char* hostname;
 
     load();
 
-    hostname = all_cfg->server;
-    port = all_cfg->port;
+    hostname = server;
+    if(remote_name && *remote_name) {
+        snprintf(name, sizeof(name), "%s", remote_name);
+    } else if(gethostname(name, sizeof(name) - 1) < 0) {
+        name[0] = 0;
+    }
 
-    if(!all_cfg->network_enabled || !all_cfg->server || !all_cfg->port) {
+    if(!network_enabled || !server || !port) {
         fprintf(stderr, "Networking not enabled or not configured.  Please be sure\n" 
                         "that settings are correct between client and server and resetart.\n"
                         "Look in the Options/Preferences dialog in the Nostromo\n"
@@ -149,14 +659,18 @@ int main(int argc, char *argv[])
     s.sin_family = AF_INET;
     s.sin_addr.s_addr = *((unsigned long*)h->h_addr);
     s.sin_port = htons(port);
-    sockd = socket(PF_INET, SOCK_STREAM, 0);
+    udp = transport && !strcmp(transport, TRANSPORT_UDP);
+    sockd = socket(PF_INET, udp ? SOCK_DGRAM : SOCK_STREAM, 0);
     if(connect(sockd, (struct sockaddr*)&s, sizeof(s)) < 0) {
         perror(hostname);
         exit(errno);
     }
 
-    /* Set up X necessaries */
-    display = XOpenDisplay(NULL);
+    /* Set up wherever the events get injected */
+    if((output = open_output_sink(sink)) == NULL) {
+        syslog(LOG_ERR, "Couldn't open %s output", sink);
+        exit(-1);
+    }
 
     pid = getpid();
     if(write(pidfd, &pid, sizeof(pid)) != sizeof(pid)) {
@@ -164,24 +678,39 @@ int main(int argc, char *argv[])
     }
     close(pidfd);
 
+    if(timer_pool_init(&timers, TIMER_POOL_SIZE, TIMER_POOL_OVERFLOW) < 0) {
+        syslog(LOG_ERR, "Couldn't allocate timer pool");
+        exit(-1);
+    }
+    playout_init(&playout, playout_delay);
+    signal(SIGUSR1, report_handler);
+
+    if(udp) {
+        run_udp(sockd);
+    }
+
+    /* Say what we speak, the daemon sends nothing until it hears it */
+    wire_tune_stream(sockd);
+    wire_reader_init(&in);
+    len = wire_put_hello(hello, remote_caps(), 0, name);
+    if(send(sockd, hello, len, 0) != (ssize_t)len) {
+        syslog(LOG_ERR, "Couldn't greet daemon: %m");
+        exit(-1);
+    }
+
     /* Do our thing */
     while(1) {
-        /* Read a key or mouse data from the socket */
-        if(recv(sockd, &type, sizeof(type), 0) < 0 || 
-           recv(sockd, &key, sizeof(key), 0) < 0 || 
-          recv(sockd, &flags, sizeof(flags), 0) < 0) {
+        if((ret = wait_for(sockd, -1)) < 0 && errno != EINTR) {
             break;
         }
-
-        printf("%d/%d/%d\n", type,key, flags);
-        
-        /* Shove it to X */
-        if(type == STROKE_KEY) {
-            XTestFakeKeyEvent(display, key, flags, 0);
-        } else if(type == STROKE_MOUSE) {
-            XTestFakeButtonEvent(display, key, flags, CurrentTime);
+        if(ret > 0 && !read_frames(sockd, &in, &greeted)) {
+            break;
         }
-        XFlush(display);
+        run_timers();
     }
+    syslog(LOG_INFO, "Lost connection to daemon");
+    if(playout_delay > 0) {
+        playout_log(&playout);
+    }
+    return 0;
 }
-
@@ -18,71 +18,381 @@
 */
 
 #include "nost_data.h"
-#include <libxml/parser.h>
-#include <libxml/tree.h>
+#include <libxml/xmlwriter.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
 
-static const xmlChar* nstr(int n)
+/** gzip level used when the file being replaced was gzipped */
+#define SAVE_GZIP_LEVEL 6
+
+/**
+ * Is a key what the loader makes of one that isn't in the file?
+ **/
+static int default_key(const nost_key_config_data* key, int k)
 {
-  static xmlChar tmp[256];
-  sprintf((char*)tmp, "%d", n);
-  return tmp;
+    return key->type == SINGLE_KEY && !key->repeat && !key->repeat_delay && !key->remote
+        && !key->targets && !key->layer && key->key_count == 0
+        && (key->name == NULL || !strcmp(key->name, default_key_names[k]));
 }
 
 /**
- * Use libxml2 to pump out an XML representation of the config data.
+ * Whether a file starts with the gzip magic.
  **/
-void save_configs(const char* fname, const nost_data* data)
+static int gzipped(const char* fname)
 {
-    xmlDoc* doc = NULL;       /* document pointer */
+    unsigned char magic[2];
+    int fd;
+    int ret = 0;
+
+    if((fd = open(fname, O_RDONLY | O_CLOEXEC)) >= 0) {
+        ret = read(fd, magic, sizeof(magic)) == sizeof(magic) && magic[0] == 0x1f && magic[1] == 0x8b;
+        close(fd);
+    }
+    return ret;
+}
 
-    xmlNode* e_root = NULL;
-    xmlNode* e_tmp = NULL;
-    xmlNode* e_config = NULL;
-    xmlNode* e_mode = NULL;
-    xmlNode* e_key = NULL;
-    xmlNode* e_stroke = NULL;
-    int c, m, k, s;
+/**
+ * An integer attribute, left out when it's the default.
+ **/
+static int write_int(xmlTextWriterPtr w, const char* name, int value, int dflt)
+{
+    if(value == dflt) {
+        return 0;
+    }
+    return xmlTextWriterWriteFormatAttribute(w, BAD_CAST name, "%d", value) < 0 ? -1 : 0;
+}
+
+/**
+ * A string attribute, left out when there isn't one.
+ **/
+static int write_str(xmlTextWriterPtr w, const char* name, const char* value)
+{
+    if(value == NULL) {
+        return 0;
+    }
+    return xmlTextWriterWriteAttribute(w, BAD_CAST name, BAD_CAST value) < 0 ? -1 : 0;
+}
 
-    doc = xmlNewDoc(BAD_CAST "1.0");
-    e_root = xmlNewNode(NULL, BAD_CAST "nostromo");
-    xmlDocSetRootElement(doc, e_root);
+/**
+ * One key, unless there's nothing about it the loader wouldn't assume.
+ **/
+static int write_key(xmlTextWriterPtr w, const nost_key_config_data* key, int k)
+{
+    int s;
 
-    e_tmp = xmlNewChild(e_root, NULL, BAD_CAST "current_config", NULL);
-    xmlNewProp(e_tmp, BAD_CAST "value", nstr(data->current_config));
+    if(xmlTextWriterStartElement(w, BAD_CAST "key") < 0
+    || write_int(w, "num", k, -1) < 0
+    || (key->name && strcmp(key->name, default_key_names[k]) && write_str(w, "name", key->name) < 0)
+    || write_int(w, "type", key->type, SINGLE_KEY) < 0
+    || write_int(w, "repeat", key->repeat, 0) < 0
+    || write_int(w, "delay", key->repeat_delay, 0) < 0
+    || write_int(w, "remote", key->remote, 0) < 0
+    || write_str(w, "targets", key->targets) < 0
+    || write_int(w, "layer", key->layer, 0) < 0) {
+        return -1;
+    }
 
-    e_tmp = xmlNewChild(e_root, NULL, BAD_CAST "networking", NULL);
-    xmlNewProp(e_tmp, BAD_CAST "enabled", nstr(data->network_enabled));
-    xmlNewProp(e_tmp, BAD_CAST "port", nstr(data->port));
-    xmlNewProp(e_tmp, BAD_CAST "server", BAD_CAST data->server);
+    for(s = 0; s < key->key_count; s++) {
+        if(xmlTextWriterStartElement(w, BAD_CAST "stroke") < 0
+        || write_int(w, "type", key->data[s].type, STROKE_KEY) < 0
+        || write_int(w, "code", key->data[s].code, 0) < 0
+        || write_int(w, "state", key->data[s].state, 0) < 0
+        || write_str(w, "display", key->data[s].display) < 0
+        || write_int(w, "delay", key->data[s].delay, 0) < 0
+        || xmlTextWriterEndElement(w) < 0) {
+            return -1;
+        }
+    }
+    return xmlTextWriterEndElement(w) < 0 ? -1 : 0;
+}
 
-    for(c = 0; c < data->num_configs; c++) {
-        e_config = xmlNewChild(e_root, NULL, BAD_CAST "config", NULL);
-        xmlNewProp(e_config, BAD_CAST "name", BAD_CAST data->configs[c].name);
-        xmlNewProp(e_config, BAD_CAST "model", nstr((int)data->configs[c].model));
-        for(m = 0; m < MAX_MODES; m++) {
-            e_mode = xmlNewChild(e_config, NULL, BAD_CAST "mode", NULL);
-            xmlNewProp(e_mode, BAD_CAST "num", nstr(m));
-            for(k = 0; k < MAX_KEYS; k++) {
-                e_key = xmlNewChild(e_mode, NULL, BAD_CAST "key", NULL);
-                xmlNewProp(e_key, BAD_CAST "name", BAD_CAST data->configs[c].keys[m][k].name);
-                xmlNewProp(e_key, BAD_CAST "type", nstr(data->configs[c].keys[m][k].type));
-                xmlNewProp(e_key, BAD_CAST "repeat", nstr(data->configs[c].keys[m][k].repeat));
-                xmlNewProp(e_key, BAD_CAST "delay", nstr(data->configs[c].keys[m][k].repeat_delay));
-                xmlNewProp(e_key, BAD_CAST "num", nstr(k));
-                xmlNewProp(e_key, BAD_CAST "remote", nstr(data->configs[c].keys[m][k].remote));
-                for(s = 0; s < data->configs[c].keys[m][k].key_count; s++) {
-                    e_stroke = xmlNewChild(e_key, NULL, BAD_CAST "stroke", NULL);
-                    xmlNewProp(e_stroke, BAD_CAST "type", nstr((int)data->configs[c].keys[m][k].data[s].type));
-                    xmlNewProp(e_stroke, BAD_CAST "code", nstr(data->configs[c].keys[m][k].data[s].code));
-                    xmlNewProp(e_stroke, BAD_CAST "state", nstr(data->configs[c].keys[m][k].data[s].state));
-                    xmlNewProp(e_stroke, BAD_CAST "display", BAD_CAST data->configs[c].keys[m][k].data[s].display);
-                    xmlNewProp(e_stroke, BAD_CAST "delay", nstr(data->configs[c].keys[m][k].data[s].delay));
+/**
+ * Open a <mode>.  Its LEDs are only written when they aren't what the
+ * mode number lights anyway.
+ **/
+static int start_mode(xmlTextWriterPtr w, const nost_mode_data* mode, int m)
+{
+    if(xmlTextWriterStartElement(w, BAD_CAST "mode") < 0
+    || write_int(w, "num", m, -1) < 0
+    || write_int(w, "leds", mode->leds, default_mode_leds(m)) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * One config.  Modes and keys that are all defaults are left out,
+ * the rest say which they are.
+ **/
+static int write_config(xmlTextWriterPtr w, const nost_config_data* cfg)
+{
+    const nost_mode_data* mode;
+    int m, k, open;
+
+    if(xmlTextWriterStartElement(w, BAD_CAST "config") < 0
+    || xmlTextWriterWriteAttribute(w, BAD_CAST "name", BAD_CAST (cfg->name ? cfg->name : "")) < 0
+    || write_int(w, "model", cfg->model, N50) < 0) {
+        return -1;
+    }
+
+    for(m = 0; m < cfg->num_modes; m++) {
+        mode = &cfg->modes[m];
+        open = 0;
+        if(mode->leds != default_mode_leds(m)) {
+            if(start_mode(w, mode, m) < 0) {
+                return -1;
+            }
+            open = 1;
+        }
+        for(k = 0; k < MAX_KEYS; k++) {
+            if(default_key(&mode->keys[k], k)) {
+                continue;
+            }
+            if(!open) {
+                if(start_mode(w, mode, m) < 0) {
+                    return -1;
                 }
+                open = 1;
             }
+            if(write_key(w, &mode->keys[k], k) < 0) {
+                return -1;
+            }
+        }
+        if(open && xmlTextWriterEndElement(w) < 0) {
+            return -1;
+        }
+    }
+    return xmlTextWriterEndElement(w) < 0 ? -1 : 0;
+}
+
+/**
+ * What goes in the config file itself: the settings, and the configs
+ * that aren't in the library.
+ **/
+static int write_settings(xmlTextWriterPtr w, const nost_data* data)
+{
+    const nost_config_data* current = NULL;
+    int c;
+
+    if(data->current_config >= 0 && data->current_config < data->num_configs) {
+        current = &data->configs[data->current_config];
+    }
+
+    if(xmlTextWriterStartElement(w, BAD_CAST "current_config") < 0
+    || xmlTextWriterWriteFormatAttribute(w, BAD_CAST "value", "%d", data->current_config) < 0
+    || (current && write_str(w, "name", current->name) < 0)
+    || xmlTextWriterEndElement(w) < 0
+
+    || xmlTextWriterStartElement(w, BAD_CAST "networking") < 0
+    || xmlTextWriterWriteFormatAttribute(w, BAD_CAST "enabled", "%d", data->network_enabled) < 0
+    || xmlTextWriterWriteFormatAttribute(w, BAD_CAST "port", "%d", data->port) < 0
+    || xmlTextWriterWriteAttribute(w, BAD_CAST "server", BAD_CAST (data->server ? data->server : "")) < 0
+    || xmlTextWriterWriteAttribute(w, BAD_CAST "transport", BAD_CAST (data->transport ? data->transport : DEFAULT_TRANSPORT)) < 0
+    || xmlTextWriterWriteFormatAttribute(w, BAD_CAST "playout_delay", "%d", data->playout_delay) < 0
+    || write_str(w, "name", data->remote_name) < 0
+    || xmlTextWriterEndElement(w) < 0
+
+    || xmlTextWriterStartElement(w, BAD_CAST "output") < 0
+    || xmlTextWriterWriteAttribute(w, BAD_CAST "sink", BAD_CAST (data->output ? data->output : DEFAULT_OUTPUT)) < 0
+    || xmlTextWriterEndElement(w) < 0) {
+        return -1;
+    }
+
+    for(c = 0; c < data->num_configs; c++) {
+        if(data->configs[c].file == NULL && write_config(w, &data->configs[c]) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Write a <nostromo> document with libxml2's writer.  The file is
+ * written beside the old one and renamed over it, so anything reading
+ * it meanwhile (a reloading daemon) sees the old file or the new one,
+ * never part of one.
+ * @param compression gzip level, 0 for none, or SAVE_KEEP_COMPRESSION
+ *        to gzip only if the file being replaced is.
+ * @param body Writes what goes inside <nostromo>.
+ * @return 0 on success, -1 with the old file untouched on failure.
+ **/
+static int replace_file(const char* fname, int compression,
+                        int (*body)(xmlTextWriterPtr, const void*), const void* arg)
+{
+    char path[PATH_MAX+1];
+    char tmp[PATH_MAX+1];
+    xmlTextWriterPtr w;
+    struct stat st;
+    mode_t mode = 0644;
+    int fd, ret;
+
+    /* Replace what a symlinked config points at, not the link */
+    if(realpath(fname, path) == NULL) {
+        snprintf(path, sizeof(path), "%s", fname);
+    }
+    if(stat(path, &st) == 0) {
+        mode = st.st_mode & 07777;
+    }
+    if(compression == SAVE_KEEP_COMPRESSION) {
+        compression = gzipped(path) ? SAVE_GZIP_LEVEL : 0;
+    }
+
+    snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path);
+    if((fd = mkstemp(tmp)) < 0) {
+        fprintf(stderr, "Failed to save [%s]\n", fname);
+        return -1;
+    }
+    close(fd);
+
+    if((w = xmlNewTextWriterFilename(tmp, compression)) == NULL) {
+        unlink(tmp);
+        fprintf(stderr, "Failed to save [%s]\n", fname);
+        return -1;
+    }
+
+    ret = xmlTextWriterStartDocument(w, "1.0", NULL, NULL) < 0
+       || xmlTextWriterStartElement(w, BAD_CAST "nostromo") < 0
+       || body(w, arg) < 0
+       || xmlTextWriterEndDocument(w) < 0 ? -1 : 0;
+    xmlFreeTextWriter(w);
+
+    /* On disk before it replaces anything */
+    if(ret == 0) {
+        if((fd = open(tmp, O_RDONLY | O_CLOEXEC)) < 0 || fsync(fd) < 0) {
+            ret = -1;
+        }
+        if(fd >= 0) {
+            close(fd);
+        }
+    }
+    if(ret == 0 && (chmod(tmp, mode) < 0 || rename(tmp, path) < 0)) {
+        ret = -1;
+    }
+
+    if(ret < 0) {
+        unlink(tmp);
+        fprintf(stderr, "Failed to save [%s]\n", fname);
+    }
+    return ret;
+}
+
+static int write_settings_body(xmlTextWriterPtr w, const void* arg)
+{
+    return write_settings(w, (const nost_data*)arg);
+}
+
+static int write_profile_body(xmlTextWriterPtr w, const void* arg)
+{
+    return write_config(w, (const nost_config_data*)arg);
+}
+
+/**
+ * Whether a library file name is taken, by a config or on disk.
+ **/
+static int file_taken(const nost_data* data, const char* file)
+{
+    char path[PATH_MAX+1];
+    int n;
+
+    for(n = 0; n < data->num_configs; n++) {
+        if(data->configs[n].file && !strcmp(data->configs[n].file, file)) {
+            return 1;
         }
     }
-    xmlSaveFile(fname, doc);
-    xmlFreeDoc(doc);
+    snprintf(path, sizeof(path), "%s/%s", data->library, file);
+    return access(path, F_OK) == 0;
 }
 
+/**
+ * Pick a library file for a config that doesn't have one yet, named
+ * after it as far as the name makes a sensible file name.
+ **/
+static const char* profile_file(nost_data* data, const nost_config_data* cfg)
+{
+    char base[64];
+    char file[NAME_MAX+1];
+    const char* name = cfg->name ? cfg->name : "";
+    size_t len = 0;
+    int n;
+
+    for(; *name && len < sizeof(base) - 1; name++) {
+        if((*name >= 'a' && *name <= 'z') || (*name >= 'A' && *name <= 'Z')
+        || (*name >= '0' && *name <= '9') || *name == '-' || *name == '_') {
+            base[len++] = *name;
+        } else if(len && base[len - 1] != '_') {
+            base[len++] = '_';
+        }
+    }
+    while(len && base[len - 1] == '_') {
+        len--;
+    }
+    base[len] = 0;
+    if(len == 0) {
+        strcpy(base, "profile");
+    }
+
+    snprintf(file, sizeof(file), "%s" PROFILE_SUFFIX, base);
+    for(n = 2; file_taken(data, file); n++) {
+        snprintf(file, sizeof(file), "%s-%d" PROFILE_SUFFIX, base, n);
+    }
+    return arena_intern(&data->mem, file);
+}
+
+/**
+ * Save the settings to the config file, and each config that's been
+ * read in to its own file in the profile library.  Configs still in
+ * the config file move to the library.  Profiles that were never read
+ * in haven't changed and are left alone, profiles taken out with
+ * remove_config() are deleted.  The config file goes last, so that a
+ * daemon reloading on it sees the library as it's meant to be.
+ * Everything load_configs() fills in by itself is left out.
+ * @param compression gzip level, 0 for none, or SAVE_KEEP_COMPRESSION
+ *        to keep whatever each file already uses.
+ * @return 0 on success, -1 on failure, when the config file is untouched.
+ **/
+int save_configs(const char* fname, nost_data* data, int compression)
+{
+    char path[PATH_MAX+1];
+    nost_config_data* cfg;
+    struct stat st;
+    int c;
+
+    if(data->library == NULL || (mkdir(data->library, 0755) < 0 && errno != EEXIST)) {
+        fprintf(stderr, "Failed to save [%s]\n", data->library ? data->library : LIBRARY_DIR_NAME);
+        return -1;
+    }
+
+    /* First, a new config may be about to get the file of a removed one */
+    for(c = 0; c < data->num_removed; c++) {
+        snprintf(path, sizeof(path), "%s/%s", data->library, data->removed[c]);
+        unlink(path);
+    }
+    data->num_removed = 0;
+
+    for(c = 0; c < data->num_configs; c++) {
+        cfg = &data->configs[c];
+        if(!cfg->loaded) {
+            continue;
+        }
+        if(cfg->file == NULL && (cfg->file = profile_file(data, cfg)) == NULL) {
+            return -1;
+        }
+        snprintf(path, sizeof(path), "%s/%s", data->library, cfg->file);
+        if(replace_file(path, compression, write_profile_body, cfg) < 0) {
+            return -1;
+        }
+        if(stat(path, &st) == 0) {
+            stamp_file(&st, &cfg->stamp);
+        }
+    }
+    /* Saves the next load looking in every file it just wrote */
+    write_index(data);
+
+    return replace_file(fname, compression, write_settings_body, data);
+}
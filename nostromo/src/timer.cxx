@@ -0,0 +1,341 @@
+/*
+    Nostromo_n50 configuration tools to support Belkin's Nostromo n50
+    Copyright (C) 2003 Paul Bohme and others
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+/**
+ * @file timer.cxx
+ **/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "timer.h"
+
+#define GROUP(id) ((unsigned int)(id) % TIMER_GROUPS)
+
+timer_pool_stats timer_stats;
+
+/**
+ * Fixed slab of timer entries, chained through group_next while free.
+ **/
+static struct {
+    timer_entry* slab;
+    timer_entry* free_list;
+    int size;
+    timer_overflow_policy policy;
+} pool;
+
+/**
+ * Fill in a CLOCK_MONOTONIC deadline 'delay' milliseconds from now.
+ **/
+void timer_deadline(struct timespec* ts, int delay)
+{
+    clock_gettime(CLOCK_MONOTONIC, ts);
+    timespec_add_ms(ts, delay);
+}
+
+/**
+ * Push a timespec 'delay' milliseconds later.
+ **/
+void timespec_add_ms(struct timespec* ts, int delay)
+{
+    ts->tv_sec += delay / 1000;
+    ts->tv_nsec += (long)(delay % 1000) * 1000000L;
+    if(ts->tv_nsec >= 1000000000L) {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000L;
+    }
+}
+
+/**
+ * Is a earlier than b?
+ **/
+int timespec_before(const struct timespec* a, const struct timespec* b)
+{
+    if(a->tv_sec != b->tv_sec) {
+        return a->tv_sec < b->tv_sec;
+    }
+    return a->tv_nsec < b->tv_nsec;
+}
+
+/**
+ * Microseconds from b to a, negative if a is earlier.
+ **/
+long timespec_diff_us(const struct timespec* a, const struct timespec* b)
+{
+    return (a->tv_sec - b->tv_sec) * 1000000L + (a->tv_nsec - b->tv_nsec) / 1000L;
+}
+
+/**
+ * Preallocate the timer entry pool, and size the queue's heap to
+ * match, so that queueing a timer never touches the allocator.
+ * @return 0 on success, -1 if the memory couldn't be had.
+ **/
+int timer_pool_init(timer_queue* q, int size, timer_overflow_policy policy)
+{
+    int n;
+
+    pool.slab = (timer_entry*)calloc(size, sizeof(timer_entry));
+    q->heap = (timer_entry**)calloc(size, sizeof(timer_entry*));
+    if(pool.slab == NULL || q->heap == NULL) {
+        return -1;
+    }
+    q->size = size;
+
+    pool.size = size;
+    pool.policy = policy;
+    pool.free_list = NULL;
+    for(n = size - 1; n >= 0; n--) {
+        pool.slab[n].group_next = pool.free_list;
+        pool.free_list = &pool.slab[n];
+    }
+
+    return 0;
+}
+
+/**
+ * Grab a fresh, zeroed timer entry.  Comes off the pool's free list,
+ * and only goes to the heap allocator if the pool is exhausted and the
+ * overflow policy allows it.
+ **/
+timer_entry* timer_entry_alloc()
+{
+    timer_entry* e = pool.free_list;
+
+    if(e) {
+        pool.free_list = e->group_next;
+        memset(e, 0, sizeof(timer_entry));
+    } else if(pool.policy == TIMER_OVERFLOW_GROW) {
+        if((e = (timer_entry*)calloc(1, sizeof(timer_entry))) == NULL) {
+            timer_stats.drops++;
+            return NULL;
+        }
+        timer_stats.heap_allocs++;
+    } else {
+        timer_stats.drops++;
+        return NULL;
+    }
+
+    timer_stats.allocs++;
+    if(++timer_stats.in_use > timer_stats.high_water) {
+        timer_stats.high_water = timer_stats.in_use;
+    }
+    return e;
+}
+
+/**
+ * Hand a timer entry back once it has fired or been cancelled.
+ **/
+void timer_entry_free(timer_entry* e)
+{
+    timer_stats.in_use--;
+    if(e >= pool.slab && e < pool.slab + pool.size) {
+        e->group_next = pool.free_list;
+        pool.free_list = e;
+    } else {
+        free(e);
+    }
+}
+
+/**
+ * Heap ordering: earliest expiry first, insertion order on ties so
+ * that timers queued for the same instant fire in the order given.
+ **/
+static int timer_before(const timer_entry* a, const timer_entry* b)
+{
+    if(a->expires.tv_sec != b->expires.tv_sec || a->expires.tv_nsec != b->expires.tv_nsec) {
+        return timespec_before(&a->expires, &b->expires);
+    }
+    return a->seq < b->seq;
+}
+
+static void heap_set(timer_queue* q, int n, timer_entry* e)
+{
+    q->heap[n] = e;
+    e->heap_index = n;
+}
+
+static void sift_up(timer_queue* q, int n)
+{
+    timer_entry* e = q->heap[n];
+
+    while(n > 0) {
+        int parent = (n - 1) / 2;
+        if(!timer_before(e, q->heap[parent])) {
+            break;
+        }
+        heap_set(q, n, q->heap[parent]);
+        n = parent;
+    }
+    heap_set(q, n, e);
+}
+
+static void sift_down(timer_queue* q, int n)
+{
+    timer_entry* e = q->heap[n];
+
+    while(1) {
+        int child = n * 2 + 1;
+        if(child >= q->count) {
+            break;
+        }
+        if(child + 1 < q->count && timer_before(q->heap[child + 1], q->heap[child])) {
+            child++;
+        }
+        if(!timer_before(q->heap[child], e)) {
+            break;
+        }
+        heap_set(q, n, q->heap[child]);
+        n = child;
+    }
+    heap_set(q, n, e);
+}
+
+/**
+ * Chain a timer into its id's group.  Ones without an id (< 0) can't
+ * be cancelled, so they stay off the chains rather than all piling
+ * into one that a real id shares.
+ **/
+static void group_link(timer_queue* q, timer_entry* e)
+{
+    timer_entry** head = &q->groups[GROUP(e->id)];
+
+    if(e->id < 0) {
+        e->group_next = e->group_prev = NULL;
+        return;
+    }
+    e->group_prev = NULL;
+    e->group_next = *head;
+    if(*head) {
+        (*head)->group_prev = e;
+    }
+    *head = e;
+}
+
+static void group_unlink(timer_queue* q, timer_entry* e)
+{
+    if(e->id < 0) {
+        return;
+    }
+    if(e->group_prev) {
+        e->group_prev->group_next = e->group_next;
+    } else {
+        q->groups[GROUP(e->id)] = e->group_next;
+    }
+    if(e->group_next) {
+        e->group_next->group_prev = e->group_prev;
+    }
+    e->group_next = e->group_prev = NULL;
+}
+
+/**
+ * Queue up a timer.  O(log n).  The heap only grows past the pool
+ * size when overflow entries are being handed out.
+ * @return 0 on success, -1 if the heap couldn't grow.
+ **/
+int timer_queue_push(timer_queue* q, timer_entry* e)
+{
+    if(q->count == q->size) {
+        int size = q->size ? q->size * 2 : 64;
+        timer_entry** heap = (timer_entry**)realloc(q->heap, size * sizeof(timer_entry*));
+        if(heap == NULL) {
+            return -1;
+        }
+        q->heap = heap;
+        q->size = size;
+    }
+
+    e->seq = q->next_seq++;
+    heap_set(q, q->count++, e);
+    sift_up(q, e->heap_index);
+    group_link(q, e);
+
+    return 0;
+}
+
+/**
+ * The next timer to expire, or NULL if nothing is queued.
+ **/
+timer_entry* timer_queue_peek(const timer_queue* q)
+{
+    return q->count ? q->heap[0] : NULL;
+}
+
+/**
+ * Take a timer out of the queue without freeing it.  O(log n).
+ **/
+void timer_queue_remove(timer_queue* q, timer_entry* e)
+{
+    int n = e->heap_index;
+
+    if(n < 0 || n >= q->count || q->heap[n] != e) {
+        return;
+    }
+
+    group_unlink(q, e);
+    e->heap_index = -1;
+
+    if(n != --q->count) {
+        heap_set(q, n, q->heap[q->count]);
+        if(n > 0 && timer_before(q->heap[n], q->heap[(n - 1) / 2])) {
+            sift_up(q, n);
+        } else {
+            sift_down(q, n);
+        }
+    }
+}
+
+/**
+ * Remove and return the earliest timer, or NULL if empty.
+ **/
+timer_entry* timer_queue_pop(timer_queue* q)
+{
+    timer_entry* e = timer_queue_peek(q);
+
+    if(e) {
+        timer_queue_remove(q, e);
+    }
+    return e;
+}
+
+/**
+ * Cancel every timer with the given id, handing each to release().
+ * Only walks the group chain for that id, so the cost is proportional
+ * to the number of timers being cancelled rather than the size of the
+ * queue.  Timers without an id (< 0) aren't in any group and can't
+ * be cancelled.
+ * @return The number of timers cancelled.
+ **/
+int timer_queue_cancel(timer_queue* q, int id, void (*release)(timer_entry*))
+{
+    timer_entry* e = id < 0 ? NULL : q->groups[GROUP(id)];
+    timer_entry* next;
+    int count = 0;
+
+    while(e) {
+        next = e->group_next;
+        if(e->id == id) {
+            timer_queue_remove(q, e);
+            release(e);
+            count++;
+        }
+        e = next;
+    }
+
+    return count;
+}
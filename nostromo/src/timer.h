@@ -0,0 +1,128 @@
+/*
+    Nostromo_n50 configuration tools to support Belkin's Nostromo n50
+    Copyright (C) 2003 Paul Bohme and others
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <time.h>
+
+/**
+ * @file timer.h
+ * Timer queue used by the daemon to schedule keystrokes.  Timers
+ * live in an indexed binary min-heap ordered by expiry time, and
+ * those with an id are also chained into a per-id group so that all
+ * of the timers belonging to one key can be cancelled without
+ * scanning the queue.
+ **/
+
+/** Number of group chains, ids are hashed into these. */
+#define TIMER_GROUPS 256
+
+/** Timer entries preallocated at startup (configure --with-timer-pool). */
+#ifndef TIMER_POOL_SIZE
+#define TIMER_POOL_SIZE 1024
+#endif
+
+/** What to do when the pool runs dry (configure --with-timer-overflow). */
+#ifndef TIMER_POOL_OVERFLOW
+#define TIMER_POOL_OVERFLOW TIMER_OVERFLOW_GROW
+#endif
+
+/**
+ * Pool overflow policy.
+ **/
+typedef enum {
+    TIMER_OVERFLOW_GROW,    /**< Fall back to the heap allocator */
+    TIMER_OVERFLOW_DROP,    /**< Refuse the timer */
+} timer_overflow_policy;
+
+/**
+ * Actions that we can schedule to happen in the future.  They are scheduled
+ * in response to user actions (key presses) and delayed until wanted.
+ **/
+typedef enum {
+    TIMER_REPEAT_KEY,   /**< Repeat key sequence when timer expires */
+    TIMER_PRESS_KEY,    /**< Press/release single key when timer expires */
+    TIMER_MOUSE_CLICK,  /**< Press/release mouse button when timer expires */
+    TIMER_LED_SHOW,     /**< Next step of a device's startup LED pattern */
+    TIMER_RELOAD,       /**< The config file has settled after a change */
+    TIMER_RESEND,       /**< Send a copy of a UDP datagram to the remote */
+    TIMER_EXPIRE_REMOTE,    /**< A UDP remote has gone quiet for too long */
+} timer_type;
+
+/**
+ * A simple way to schedule things to happen in the future.
+ **/
+typedef struct timer_entry {
+    struct timespec expires;        /**< When the timer fires (CLOCK_MONOTONIC) */
+    struct timespec origin;         /**< Input event that caused it, for latency tracking */
+    unsigned long seq;              /**< Insertion order, breaks ties on expires */
+    int heap_index;                 /**< Slot in the heap, -1 if not queued */
+    struct timer_entry* group_next; /**< Next timer in the same group chain */
+    struct timer_entry* group_prev; /**< Previous timer in the same group chain */
+    int id;
+    int key;                        /**< Nostromo key that queued it, -1 for none */
+    timer_type type;
+    int arg;
+    int flag;
+    int delay;
+    unsigned int remote;            /**< Route bits, where a key or click goes */
+    void* data;                     /**< Extra context for the action */
+} timer_entry;
+
+/**
+ * The queue itself.  Not locked, callers provide their own, which
+ * also has to cover the entry pool.
+ **/
+typedef struct {
+    timer_entry** heap;                 /**< Min-heap on (expires, seq) */
+    int count;                          /**< Timers in the heap */
+    int size;                           /**< Allocated heap slots */
+    unsigned long next_seq;             /**< Sequence number for the next insert */
+    timer_entry* groups[TIMER_GROUPS];  /**< Group chains, hashed by id */
+} timer_queue;
+
+void timer_deadline(struct timespec* ts, int delay);
+void timespec_add_ms(struct timespec* ts, int delay);
+int timespec_before(const struct timespec* a, const struct timespec* b);
+long timespec_diff_us(const struct timespec* a, const struct timespec* b);
+
+/**
+ * Pool counters, for proving the keypress path stays off the heap.
+ **/
+typedef struct {
+    unsigned long allocs;       /**< Entries handed out */
+    unsigned long heap_allocs;  /**< ...of which came from calloc() */
+    unsigned long drops;        /**< Allocations refused on overflow */
+    int in_use;                 /**< Entries currently out of the pool */
+    int high_water;             /**< Most entries ever out at once */
+} timer_pool_stats;
+
+extern timer_pool_stats timer_stats;
+
+int timer_pool_init(timer_queue* q, int size, timer_overflow_policy policy);
+timer_entry* timer_entry_alloc();
+void timer_entry_free(timer_entry* e);
+
+int timer_queue_push(timer_queue* q, timer_entry* e);
+timer_entry* timer_queue_peek(const timer_queue* q);
+timer_entry* timer_queue_pop(timer_queue* q);
+void timer_queue_remove(timer_queue* q, timer_entry* e);
+int timer_queue_cancel(timer_queue* q, int id, void (*release)(timer_entry*) = timer_entry_free);
+
+#endif // TIMER_H
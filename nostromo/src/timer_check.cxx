@@ -0,0 +1,184 @@
+/*
+    Nostromo_n50 configuration tools to support Belkin's Nostromo n50
+    Copyright (C) 2003 Paul Bohme and others
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+/**
+ * @file timer_check.cxx
+ * make check: strokes queued with known delays have to be due exactly
+ * that long after they're queued, all fire, in order, and within
+ * LATENESS_P99 of their deadline.  Driven the
+ * way the daemon drives its queue, a TFD_TIMER_ABSTIME timerfd armed
+ * for the head and everything due fired on each expiry.  A busy build
+ * machine can push one run's tail out, so it gets TRIALS goes at the
+ * bound; every one has to fire everything in order.
+ **/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/timerfd.h>
+
+#include "timer.h"
+#include "histogram.h"
+
+/** Strokes queued, in macros like a keypress queues */
+#define STROKES 2000
+
+/** Longest macro, and the most between two of its strokes (ms) */
+#define MACRO_STROKES 8
+#define MACRO_GAP 100
+
+/** Spread of when the macros start (ms), some strokes land past a second */
+#define START_SPREAD 800
+
+/** 99th percentile of deadline to firing that has to be met (ns) */
+#define LATENESS_P99 (10 * 1000000L)
+
+/** Runs the bound gets to be met in */
+#define TRIALS 3
+
+static timer_queue timers;
+
+/**
+ * Point the timerfd at the head of the queue.
+ **/
+static void arm(int fd)
+{
+    struct itimerspec its;
+    timer_entry* head = timer_queue_peek(&timers);
+
+    memset(&its, 0, sizeof(its));
+    if(head) {
+        its.it_value = head->expires;
+    }
+    timerfd_settime(fd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+/**
+ * Queue a stroke delay ms after start, numbered so the order it fires
+ * in can be checked.
+ **/
+static int queue_stroke(const struct timespec* start, int delay, int n)
+{
+    timer_entry* e = timer_entry_alloc();
+
+    if(e == NULL) {
+        return -1;
+    }
+    memset(e, 0, sizeof(timer_entry));
+    e->heap_index = -1;
+    e->id = -1;
+    e->type = TIMER_PRESS_KEY;
+    e->arg = n;
+    e->delay = delay;
+    e->expires = *start;
+    timespec_add_ms(&e->expires, delay);
+    return timer_queue_push(&timers, e);
+}
+
+/**
+ * Queue STROKES strokes and fire them all.
+ * @return The 99th percentile lateness in ns, -1 if any were due at
+ *         the wrong time, went missing or came out of order.
+ **/
+static long run_trial(int fd)
+{
+    histogram lateness = { "deadline->fire" };
+    struct timespec start;
+    struct timespec now;
+    struct timespec last;
+    struct pollfd pfd;
+    uint64_t expirations;
+    timer_entry* t;
+    int fired = 0, out_of_order = 0, misdue = 0;
+    int n, i, count, delay;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(n = 0; n < STROKES; n += count) {
+        count = 1 + rand() % MACRO_STROKES;
+        delay = rand() % START_SPREAD;
+        for(i = 0; i < count && n + i < STROKES; i++) {
+            if(queue_stroke(&start, delay, n + i) < 0) {
+                perror("timer_check");
+                return -1;
+            }
+            delay += rand() % MACRO_GAP;
+        }
+    }
+
+    memset(&last, 0, sizeof(last));
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    while(timer_queue_peek(&timers)) {
+        arm(fd);
+        if(poll(&pfd, 1, -1) < 0 || read(fd, &expirations, sizeof(expirations)) < 0) {
+            continue;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        while((t = timer_queue_peek(&timers)) != NULL && !timespec_before(&now, &t->expires)) {
+            timer_queue_pop(&timers);
+            if(timespec_before(&t->expires, &last)) {
+                out_of_order++;
+            }
+            if(timespec_diff_us(&t->expires, &start) != t->delay * 1000L) {
+                misdue++;
+            }
+            last = t->expires;
+            hist_record_span(&lateness, &t->expires, &now);
+            timer_entry_free(t);
+            fired++;
+        }
+    }
+
+    printf("%d strokes: deadline->fire p50=%.1fus p99=%.1fus p99.9=%.1fus max=%.1fus\n",
+        fired, hist_percentile(&lateness, 50.0) / 1000.0, hist_percentile(&lateness, 99.0) / 1000.0,
+        hist_percentile(&lateness, 99.9) / 1000.0, lateness.max / 1000.0);
+    if(fired != STROKES || out_of_order || misdue) {
+        printf("FAIL: %d fired, %d out of order, %d due at the wrong time\n", fired, out_of_order, misdue);
+        return -1;
+    }
+    return (long)hist_percentile(&lateness, 99.0);
+}
+
+int main()
+{
+    long p99;
+    int trial;
+    int fd;
+
+    if(timer_pool_init(&timers, STROKES, TIMER_OVERFLOW_GROW) < 0
+    || (fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC)) < 0) {
+        perror("timer_check");
+        return 1;
+    }
+
+    srand(1);
+    for(trial = 0; trial < TRIALS; trial++) {
+        if((p99 = run_trial(fd)) < 0) {
+            return 1;
+        }
+        if(p99 <= LATENESS_P99) {
+            return 0;
+        }
+    }
+    printf("FAIL: p99 over %ldus in %d runs\n", LATENESS_P99 / 1000, TRIALS);
+    return 1;
+}
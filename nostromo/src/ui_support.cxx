@@ -29,12 +29,19 @@
 
 #include "nost_data.h"
 #include <FL/Fl_Choice.H>
+#include <FL/fl_ask.H>
 #include <FL/Fl.H>
 #include <FL/x.H>
 
 /// Dynamically managed list of configurations
 Fl_Menu_Item* configuration_list = NULL;
 
+/// Dynamically managed list of the current configuration's modes
+static Fl_Menu_Item* mode_list = NULL;
+
+/// What the first modes are called, after the LED each lights
+static const char* const mode_names[COLOR_MODES] = { "Normal", "Blue", "Green", "Red" };
+
 /// Master configuration data
 nost_data* nost_cfg = NULL;
 
@@ -47,32 +54,20 @@ int current_key = -1;
 /// Index of keystroke being manipulated
 int current_keystroke = -1;
 
-/// Default names of key mappings for new configs
-static char* default_key_names[] = {
-    "Button 01",
-    "Button 02",
-    "Button 03",
-    "Button 04",
-    "Button 05",
-    "Button 06",
-    "Button 07",
-    "Button 08",
-    "Button 09",
-    "Button 10",
-    "DPad up (top)",
-    "DPad down (bottom)",
-    "DPad right (front)",
-    "DPad left (rear)",
-    "Button 11",
-    "Button 12",
-    "Button 13",
-    "Button 14",
-    "Button 15",
-    "Orange button",
-    "Mouse wheel up (forward)",
-    "Press mouse wheel",
-    "Mouse wheel down (back)"
-};
+/**
+ * A key of the current mode, the mode being added if it's new.
+ * @return NULL if the mode couldn't be added, after saying so.
+ **/
+nost_key_config_data* key_config(int cfg, int key)
+{
+    nost_mode_data* m = config_mode(nost_cfg, &nost_cfg->configs[cfg], current_mode);
+
+    if(m == NULL) {
+        fl_alert("Out of memory adding mode %d.", current_mode);
+        return NULL;
+    }
+    return &m->keys[key];
+}
 
 /**
  * Clear out a configuration, set names to defaults, etc.
@@ -82,32 +77,70 @@ static char* default_key_names[] = {
 void initialize_new_config(nost_config_data* cfg, int othercfg)
 {
     nost_config_data* p = NULL;
-    int n, m, s;
+    nost_key_config_data* key;
+    int n, m;
 
-    if(othercfg < (nost_cfg->num_configs - 1) && othercfg >= 0) {
-        p = &nost_cfg->configs[othercfg];
+    memset(cfg, 0, sizeof(nost_config_data));
+    cfg->loaded = 1;
 
-        memcpy(cfg, p, sizeof(nost_config_data));
+    if(othercfg < (nost_cfg->num_configs - 1) && othercfg >= 0) {
+        if((p = load_profile(nost_cfg, othercfg)) == NULL) {
+            return;
+        }
 
-        /* Now fix the strings */
-        cfg->name = strdup(cfg->name);
-        for(m = 0; m < MAX_MODES; m++) {
+        /* Strings are shared, but modes and strokes are its own */
+        if(p->num_modes == 0 || config_mode(nost_cfg, cfg, p->num_modes - 1) == NULL) {
+            return;
+        }
+        for(m = 0; m < p->num_modes; m++) {
+            cfg->modes[m] = p->modes[m];
             for(n = 0; n < MAX_KEYS; n++) {
-                cfg->keys[m][n].name = strdup(cfg->keys[m][n].name);
-                for(s = 0; s < cfg->keys[m][n].key_count; s++) {
-                    cfg->keys[m][n].data[s].display = strdup(cfg->keys[m][n].data[s].display);
+                key = &cfg->modes[m].keys[n];
+                key->data = NULL;
+                key->key_count = key->strokes_allocated = 0;
+                while(key->key_count < p->modes[m].keys[n].key_count && add_stroke(nost_cfg, key)) {
+                    key->data[key->key_count - 1] = p->modes[m].keys[n].data[key->key_count - 1];
                 }
             }
         }
-    } else {
-        memset(cfg, 0, sizeof(cfg));
+    }
+}
 
-        for(m = 0; m < MAX_MODES; m++) {
-            for(n = 0; n < MAX_KEYS; n++) {
-                cfg->keys[m][n].name = strdup(default_key_names[n]);
-            }
+/**
+ * Fill the mode dropdown with the current configuration's modes, and
+ * an entry at the end for adding another.
+ **/
+static void populate_mode_list()
+{
+    Fl_Menu_Item tmp = { 0 };
+    char name[32];
+    int num = COLOR_MODES;
+    int n;
+
+    /* The colors are always there to pick, they're added when picked */
+    if(nost_cfg->current_config >= 0 && nost_cfg->configs[nost_cfg->current_config].num_modes > num) {
+        num = nost_cfg->configs[nost_cfg->current_config].num_modes;
+    }
+
+    mode_choice->menu(&tmp);
+    delete [] mode_list;
+
+    mode_list = new Fl_Menu_Item[num + 2];
+    memset(mode_list, 0, sizeof(Fl_Menu_Item) * (num + 2));
+    for(n = 0; n < num; n++) {
+        if(n < COLOR_MODES) {
+            mode_list[n].label(mode_names[n]);
+        } else {
+            snprintf(name, sizeof(name), "Layer %d", n);
+            mode_list[n].label(arena_intern(&nost_cfg->mem, name));
         }
     }
+    if(num < MAX_LAYERS) {
+        mode_list[num].label("New layer...");
+    }
+    mode_choice->menu(mode_list);
+    mode_choice->value(current_mode < num ? current_mode : 0);
+    mode_choice->redraw();
 }
 
 /**
@@ -149,18 +182,13 @@ static void populate_configuration_list()
 void add_new_configuration(const char* newtxt, model_type model, int othercfg)
 {
     Fl_Menu_Item* old = configuration_list;
-    char* txt = strdup(newtxt);
-
-    ++nost_cfg->num_configs;
 
     /* Open up a new spot in the configuration data */
-    nost_config_data* olddata = nost_cfg->configs;
-    nost_cfg->configs = new nost_config_data[nost_cfg->num_configs];
-    memset(nost_cfg->configs, 0, sizeof(nost_config_data) * nost_cfg->num_configs);
-    memcpy(nost_cfg->configs, olddata, sizeof(nost_config_data) * (nost_cfg->num_configs - 1));
-    delete [] olddata;
+    if(add_config(nost_cfg) == NULL) {
+        return;
+    }
     initialize_new_config(nost_cfg->configs + (nost_cfg->num_configs - 1), othercfg);
-    nost_cfg->configs[nost_cfg->num_configs-1].name = txt;
+    nost_cfg->configs[nost_cfg->num_configs-1].name = arena_intern(&nost_cfg->mem, newtxt);
     nost_cfg->configs[nost_cfg->num_configs-1].model = model;
     set_current_configuration(nost_cfg->num_configs-1);
 
@@ -189,8 +217,7 @@ void startup()
  **/
 void shutdown()
 {
-    /* Cheap and sleazy - tell any nostromo_daemons to reload */
-    system("killall -HUP nostromo_daemon");
+    /* The daemon watches the config file, saving is enough to reload it */
     delete main_window;
 }
 
@@ -199,31 +226,28 @@ void shutdown()
  **/
 static void set_buttons()
 {
-    int k;
+    static Fl_Color colors[COLOR_MODES] = {
+        FL_WHITE,
+        FL_BLUE,
+        FL_GREEN,
+        FL_RED
+    };
+    nost_mode_data* m = NULL;
+    int k, layer;
 
     if(key_buttons[0]->active()) {
+        if(nost_cfg->current_config >= 0) {
+            m = config_mode(nost_cfg, &nost_cfg->configs[nost_cfg->current_config], current_mode);
+        }
         for(k = 0; k < MAX_KEYS; k++) {
-            if(nost_cfg->current_config >= 0) {
-                switch(nost_cfg->configs[nost_cfg->current_config].keys[current_mode][k].type) {
-                    default:
-                        key_buttons[k]->color(FL_GRAY, FL_GRAY);
-                        break;
-                    case NORMAL_SHIFT:
-                    case NORMAL_LOCK:
-                        key_buttons[k]->color(FL_WHITE, FL_WHITE);
-                        break;
-                    case BLUE_SHIFT:
-                    case BLUE_LOCK:
-                        key_buttons[k]->color(FL_BLUE, FL_BLUE);
-                        break;
-                    case GREEN_SHIFT:
-                    case GREEN_LOCK:
-                        key_buttons[k]->color(FL_GREEN, FL_GREEN);
-                        break;
-                    case RED_SHIFT:
-                    case RED_LOCK:
-                        key_buttons[k]->color(FL_RED, FL_RED);
-                        break;
+            if(m != NULL) {
+                layer = key_layer(&m->keys[k]);
+                if(layer < 0) {
+                    key_buttons[k]->color(FL_GRAY, FL_GRAY);
+                } else if(layer < COLOR_MODES) {
+                    key_buttons[k]->color(colors[layer], colors[layer]);
+                } else {
+                    key_buttons[k]->color(FL_YELLOW, FL_YELLOW);
                 }
             } else {
                 key_buttons[k]->color(FL_GRAY, FL_GRAY);
@@ -235,30 +259,71 @@ static void set_buttons()
 
 /**
  * Set the current mode, flipping the color on the key_mapping_box
- * to match as a visual indicator.
+ * to match as a visual indicator.  Picking the entry past the last
+ * mode adds one.
  **/
 void set_current_mode(int mode)
 {
-    static Fl_Color colors[] = {
+    static Fl_Color colors[COLOR_MODES] = {
         FL_GRAY,
         FL_BLUE,
         FL_GREEN,
         FL_RED
     };
+    nost_mode_data* m = NULL;
+
+    if(nost_cfg->current_config >= 0) {
+        m = config_mode(nost_cfg, &nost_cfg->configs[nost_cfg->current_config], mode);
+    }
+    if(m == NULL) {
+        mode = 0;
+    }
 
     current_mode = mode;
-    key_mappings_box->color(colors[mode]);
+    populate_mode_list();
+    mode_leds_choice->value(m ? m->leds : 0);
+    key_mappings_box->color(mode < COLOR_MODES ? colors[mode] : FL_YELLOW);
     key_mappings_box->redraw();
     set_current_key(current_key);
     set_buttons();
 }
 
+/**
+ * Change which LEDs the current mode lights.
+ **/
+void set_current_mode_leds(int leds)
+{
+    nost_mode_data* m;
+
+    if(nost_cfg->current_config >= 0) {
+        if((m = config_mode(nost_cfg, &nost_cfg->configs[nost_cfg->current_config], current_mode)) == NULL) {
+            fl_alert("Out of memory adding mode %d.", current_mode);
+            return;
+        }
+        m->leds = leds;
+    }
+}
+
+/**
+ * The layer input is only for the keys that go to one.
+ **/
+static void set_layer_input(const nost_key_config_data* mapping)
+{
+    if(mapping->type == LAYER_SHIFT || mapping->type == LAYER_LOCK) {
+        key_layer_input->activate();
+        key_layer_input->value(mapping->layer);
+    } else {
+        key_layer_input->deactivate();
+    }
+}
+
 /**
  * Set the current key, by index into global arrays.
  * Pass in -1 to clear the current selection to nothing.
  **/
 void set_current_key(int key)
 {
+    nost_key_config_data* mapping;
     int n;
 
     if(current_key >= 0) {
@@ -266,46 +331,52 @@ void set_current_key(int key)
     }
 
     current_key = key;
+    if(current_key >= 0 && (mapping = key_config(nost_cfg->current_config, key)) == NULL) {
+        current_key = -1;
+    }
     if(current_key >= 0) {
         key_buttons[key]->set();
 
         /* List the key(s) mapped in the browser */
         key_browser->clear();
-        if(nost_cfg->configs[nost_cfg->current_config].keys[current_mode][key].key_count > 0) {
-            for(n = 0; n < nost_cfg->configs[nost_cfg->current_config].keys[current_mode][key].key_count; n++) {
-                key_browser->add(nost_cfg->configs[nost_cfg->current_config].keys[current_mode][key].data[n].display);
+        if(mapping->key_count > 0) {
+            for(n = 0; n < mapping->key_count; n++) {
+                key_browser->add(mapping->data[n].display);
             }
         }
 
         /* Activate the proper controls */
-        if(nost_cfg->configs[nost_cfg->current_config].keys[current_mode][key].type == SINGLE_KEY ||
-           nost_cfg->configs[nost_cfg->current_config].keys[current_mode][key].type == MULTI_KEY) {
+        if(mapping->type == SINGLE_KEY ||
+           mapping->type == MULTI_KEY) {
             set_key_mapping_button->activate();
         } else {
             set_key_mapping_button->deactivate();
         }
-        key_remote_check_button->value(nost_cfg->configs[nost_cfg->current_config].keys[current_mode][key].remote);
+        key_remote_check_button->value(mapping->remote);
         key_remote_check_button->activate();
+        key_targets_input->value(mapping->targets ? mapping->targets : "");
+        key_targets_input->activate();
 
-        key_mapping_name_input->value(nost_cfg->configs[nost_cfg->current_config].keys[current_mode][key].name);
+        key_mapping_name_input->value(mapping->name);
         key_mapping_name_input->activate();
-        key_mapping_type_choice->value((int)nost_cfg->configs[nost_cfg->current_config].keys[current_mode][key].type);
+        key_mapping_type_choice->value((int)mapping->type);
         key_mapping_type_choice->activate();
 
         /* Set our repeat button/delay input properly */
-        if(nost_cfg->configs[nost_cfg->current_config].keys[current_mode][key].type == MULTI_KEY) {
+        if(mapping->type == MULTI_KEY) {
             key_repeat_check_button->activate();
-            key_repeat_check_button->value(nost_cfg->configs[nost_cfg->current_config].keys[current_mode][key].repeat);
+            key_repeat_check_button->value(mapping->repeat);
         } else {
             key_repeat_check_button->deactivate();
         }
 
         if(key_repeat_check_button->active() && key_repeat_check_button->value()) {
             key_repeat_delay_input->activate();
-            key_repeat_delay_input->value(nost_cfg->configs[nost_cfg->current_config].keys[current_mode][key].repeat_delay);
+            key_repeat_delay_input->value(mapping->repeat_delay);
         } else {
             key_repeat_delay_input->deactivate();
         }
+        set_layer_input(mapping);
     } else {
       /* No key map active, clear all relevant controls */
         key_browser->clear();
@@ -316,6 +387,9 @@ void set_current_key(int key)
         key_repeat_check_button->deactivate();
         key_repeat_delay_input->deactivate();
         key_remote_check_button->deactivate();
+        key_targets_input->value("");
+        key_targets_input->deactivate();
+        key_layer_input->deactivate();
     }
 
     set_buttons();
@@ -333,6 +407,10 @@ void set_current_configuration(int cfg)
     int max = MAX_KEYS;
 
     set_current_key(-1);
+    /* Library profiles are only read in once they're picked */
+    if(cfg >= 0 && load_profile(nost_cfg, cfg) == NULL) {
+        cfg = -1;
+    }
     nost_cfg->current_config = cfg;
 
     if(cfg >= 0 && nost_cfg->configs[cfg].model == N50) {
@@ -349,11 +427,18 @@ void set_current_configuration(int cfg)
 
     if(cfg >= 0) {
         mode_choice->activate();
+        mode_leds_choice->activate();
     } else {
         mode_choice->deactivate();
+        mode_leds_choice->deactivate();
     }
 
-    set_buttons();
+    /* Stay on the mode if this config has it */
+    if(cfg >= 0 && current_mode < nost_cfg->configs[cfg].num_modes) {
+        set_current_mode(current_mode);
+    } else {
+        set_current_mode(0);
+    }
 }
 
 /**
@@ -361,7 +446,11 @@ void set_current_configuration(int cfg)
  **/
 void change_key_repeat_delay(int value, int cfg, int key)
 {
-    nost_cfg->configs[cfg].keys[current_mode][key].repeat_delay = value;
+    nost_key_config_data* mapping = key_config(cfg, key);
+
+    if(mapping != NULL) {
+        mapping->repeat_delay = value;
+    }
 }
 
 /**
@@ -369,7 +458,11 @@ void change_key_repeat_delay(int value, int cfg, int key)
  **/
 void change_key_repeat_flag(int value, int cfg, int key)
 {
-    nost_cfg->configs[cfg].keys[current_mode][key].repeat = value;
+    nost_key_config_data* mapping = key_config(cfg, key);
+
+    if(mapping != NULL) {
+        mapping->repeat = value;
+    }
 }
 
 /**
@@ -377,7 +470,46 @@ void change_key_repeat_flag(int value, int cfg, int key)
  **/
 void change_key_remote_flag(int value, int cfg, int key)
 {
-    nost_cfg->configs[cfg].keys[current_mode][key].remote = value;
+    nost_key_config_data* mapping = key_config(cfg, key);
+
+    if(mapping != NULL) {
+        mapping->remote = value;
+    }
+}
+
+/**
+ * Handle changes to the remotes a key goes to.  Blank is every remote.
+ **/
+void change_key_targets(const char* txt, int cfg, int key)
+{
+    nost_key_config_data* mapping = key_config(cfg, key);
+
+    if(mapping != NULL) {
+        mapping->targets = *txt ? arena_intern(&nost_cfg->mem, txt) : NULL;
+    }
+}
+
+/**
+ * Handle changes to the layer a mode changing key goes to.  The layer
+ * is added if it's new, so that it can be picked and filled in.
+ **/
+void change_key_layer(int value, int cfg, int key)
+{
+    nost_key_config_data* mapping;
+
+    if(value < 0 || value >= MAX_LAYERS) {
+        value = 0;
+        key_layer_input->value(value);
+    }
+    if((mapping = key_config(cfg, key)) == NULL) {
+        return;
+    }
+    mapping->layer = value;
+    if(config_mode(nost_cfg, &nost_cfg->configs[cfg], value) == NULL) {
+        fl_alert("Out of memory adding mode %d.", value);
+    }
+    populate_mode_list();
+    set_buttons();
 }
 
 /**
@@ -385,10 +517,11 @@ void change_key_remote_flag(int value, int cfg, int key)
  **/
 void change_key_mapping_name(const char* txt, int cfg, int key)
 {
-    if(nost_cfg->configs[cfg].keys[current_mode][key].name) {
-        free(nost_cfg->configs[cfg].keys[current_mode][key].name);
+    nost_key_config_data* mapping = key_config(cfg, key);
+
+    if(mapping != NULL) {
+        mapping->name = arena_intern(&nost_cfg->mem, txt);
     }
-    nost_cfg->configs[cfg].keys[current_mode][key].name = strdup(txt);
 }
 
 /**
@@ -396,28 +529,36 @@ void change_key_mapping_name(const char* txt, int cfg, int key)
  **/
 void set_current_key_mapping_type(int type)
 {
-    if(nost_cfg->current_config >= 0 && current_key >= 0) {
-        nost_cfg->configs[nost_cfg->current_config].keys[current_mode][current_key].type = (key_map_type)type;
+    nost_key_config_data* mapping;
+
+    if(nost_cfg->current_config < 0 || current_key < 0) {
+        return;
     }
-    if(nost_cfg->configs[nost_cfg->current_config].keys[current_mode][current_key].type == SINGLE_KEY ||
-       nost_cfg->configs[nost_cfg->current_config].keys[current_mode][current_key].type == MULTI_KEY) {
+    if((mapping = key_config(nost_cfg->current_config, current_key)) == NULL) {
+        return;
+    }
+    mapping->type = (key_map_type)type;
+
+    if(mapping->type == SINGLE_KEY ||
+       mapping->type == MULTI_KEY) {
         set_key_mapping_button->activate();
     } else {
         set_key_mapping_button->deactivate();
     }
     /* Enable key repeat check button and delay input if this is a 'keys in sequence' */
-    if(nost_cfg->configs[nost_cfg->current_config].keys[current_mode][current_key].type == MULTI_KEY) {
+    if(mapping->type == MULTI_KEY) {
         key_repeat_check_button->activate();
-        key_repeat_check_button->value(nost_cfg->configs[nost_cfg->current_config].keys[current_mode][current_key].repeat);
+        key_repeat_check_button->value(mapping->repeat);
     } else {
         key_repeat_check_button->deactivate();
     }
     if(key_repeat_check_button->active() && key_repeat_check_button->value()) {
         key_repeat_delay_input->activate();
-        key_repeat_delay_input->value(nost_cfg->configs[nost_cfg->current_config].keys[current_mode][current_key].repeat_delay);
+        key_repeat_delay_input->value(mapping->repeat_delay);
     } else {
         key_repeat_delay_input->deactivate();
     }
+    set_layer_input(mapping);
     set_buttons();
 }
 
@@ -427,8 +568,7 @@ void set_current_key_mapping_type(int type)
 void rename_current_configuration_done(const char* txt)
 {
     if(nost_cfg->current_config >= 0) {
-        free(nost_cfg->configs[nost_cfg->current_config].name);
-        nost_cfg->configs[nost_cfg->current_config].name = strdup(txt);
+        nost_cfg->configs[nost_cfg->current_config].name = arena_intern(&nost_cfg->mem, txt);
     }
     configuration_list[nost_cfg->current_config].label(nost_cfg->configs[nost_cfg->current_config].name);
     configuration->redraw();
@@ -439,27 +579,10 @@ void rename_current_configuration_done(const char* txt)
  **/
 void delete_current_configuration_done()
 {
-    int m, k;
-    
     if(nost_cfg->current_config >= 0) {
-        /* Free up all of the name strings */
-        free(nost_cfg->configs[nost_cfg->current_config].name);
-        for(m = 0; m < MAX_MODES; m++) {
-            for(k = 0; k < MAX_KEYS; k++) {
-                if(nost_cfg->configs[nost_cfg->current_config].keys[m][k].name) {
-                    free(nost_cfg->configs[nost_cfg->current_config].keys[m][k].name);
-                }
-            }
-        }
-
-        /* If it's not the last config, compress the array down one */
-        if(nost_cfg->current_config < nost_cfg->num_configs - 1) {
-            memcpy(&nost_cfg->configs[nost_cfg->current_config], 
-                   &nost_cfg->configs[nost_cfg->current_config + 1],
-                   sizeof(nost_config_data) * (nost_cfg->num_configs - nost_cfg->current_config - 1));
-        }
-
-        nost_cfg->num_configs--;
+        /* Its strings and strokes stay in the arena until the configs are freed,
+         * its library file until the next save */
+        remove_config(nost_cfg, nost_cfg->current_config);
 
         set_current_configuration(nost_cfg->num_configs - 1);
 
@@ -514,6 +637,6 @@ void save()
 
     snprintf(fname, sizeof(fname), "%s/%s", (pw ? pw->pw_dir : "."), CFG_FILE_NAME);
 
-    save_configs(fname, nost_cfg);
+    save_configs(fname, nost_cfg, SAVE_KEEP_COMPRESSION);
 }
 
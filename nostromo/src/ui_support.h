@@ -35,9 +35,13 @@ extern void set_current_configuration(int cfg);
 extern void change_key_mapping_name(const char* txt, int cfg, int key);
 extern void change_key_repeat_flag(int value, int cfg, int key);
 extern void change_key_remote_flag(int value, int cfg, int key);
+extern void change_key_targets(const char* txt, int cfg, int key);
 extern void change_key_repeat_delay(int value, int cfg, int key);
+extern void change_key_layer(int value, int cfg, int key);
 extern void set_current_key_mapping_type(int type);
 extern void set_current_mode(int type);
+extern void set_current_mode_leds(int leds);
+extern nost_key_config_data* key_config(int cfg, int key);
 extern void rename_current_configuration_done(const char* txt);
 extern void delete_current_configuration_done();
 
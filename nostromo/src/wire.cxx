@@ -0,0 +1,473 @@
+/*
+    Nostromo_n50 configuration tools to support Belkin's Nostromo n50
+    Copyright (C) 2003 Paul Bohme and others
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+/**
+ * @file wire.cxx
+ * Building and taking apart wire frames.
+ **/
+
+#include <string.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "wire.h"
+
+static void put16(unsigned char* p, unsigned v)
+{
+    p[0] = v >> 8;
+    p[1] = v;
+}
+
+static void put32(unsigned char* p, uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static unsigned get16(const unsigned char* p)
+{
+    return (p[0] << 8) | p[1];
+}
+
+static uint32_t get32(const unsigned char* p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+/**
+ * Write a frame header.
+ * @return Bytes written.
+ **/
+size_t wire_put_header(unsigned char* p, int type, size_t length)
+{
+    p[0] = type;
+    p[1] = 0;
+    put16(p + 2, length);
+    return WIRE_HEADER_SIZE;
+}
+
+/**
+ * Write a whole hello frame.
+ * @param caps What this side can do.
+ * @param flags Header flags, WIRE_HELLO_NEW.
+ * @param name What a remote calls itself, cut to WIRE_MAX_NAME.
+ * @return Bytes written, up to WIRE_HEADER_SIZE + WIRE_HELLO_SIZE + WIRE_MAX_NAME.
+ **/
+size_t wire_put_hello(unsigned char* p, uint32_t caps, int flags, const char* name)
+{
+    size_t len = name ? strnlen(name, WIRE_MAX_NAME) : 0;
+
+    wire_put_header(p, WIRE_HELLO, WIRE_HELLO_SIZE + len);
+    p[1] = flags;
+    p += WIRE_HEADER_SIZE;
+    memcpy(p, WIRE_MAGIC, 4);
+    put16(p + 4, WIRE_VERSION);
+    put32(p + 6, caps);
+    if(len) {
+        memcpy(p + WIRE_HELLO_SIZE, name, len);
+    }
+    return WIRE_HEADER_SIZE + WIRE_HELLO_SIZE + len;
+}
+
+/**
+ * Write one event into a WIRE_EVENTS payload.
+ * @return Bytes written.
+ **/
+size_t wire_put_event(unsigned char* p, int mouse, int code, int press)
+{
+    p[0] = (press ? WIRE_PRESS : 0) | (mouse ? WIRE_MOUSE : 0);
+    put16(p + 1, code);
+    return WIRE_EVENT_SIZE;
+}
+
+/**
+ * Read a hello.  Fields it may grow later are after the ones here,
+ * so a longer one is fine.
+ * @return 0, or -1 if it isn't a hello.
+ **/
+int wire_get_hello(const wire_frame* frame, unsigned* version, uint32_t* caps)
+{
+    if(frame->type != WIRE_HELLO || frame->length < WIRE_HELLO_SIZE
+    || memcmp(frame->payload, WIRE_MAGIC, 4)) {
+        return -1;
+    }
+    *version = get16(frame->payload + 4);
+    *caps = get32(frame->payload + 6);
+    return 0;
+}
+
+/**
+ * The name after a hello's capabilities, if it has one.
+ * @param size Room in name, at least 1; a longer one is cut.
+ * @return Its length, 0 if there isn't one.
+ **/
+size_t wire_get_hello_name(const wire_frame* frame, char* name, size_t size)
+{
+    size_t len = frame->length > WIRE_HELLO_SIZE ? frame->length - WIRE_HELLO_SIZE : 0;
+
+    if(len > WIRE_MAX_NAME) {
+        len = WIRE_MAX_NAME;
+    }
+    if(len >= size) {
+        len = size - 1;
+    }
+    memcpy(name, frame->payload + WIRE_HELLO_SIZE, len);
+    name[len] = 0;
+    return len;
+}
+
+/**
+ * Read one event out of a WIRE_EVENTS payload.
+ **/
+void wire_get_event(const unsigned char* p, int* mouse, int* code, int* press)
+{
+    *press = (p[0] & WIRE_PRESS) != 0;
+    *mouse = (p[0] & WIRE_MOUSE) != 0;
+    *code = get16(p + 1);
+}
+
+void wire_reader_init(wire_reader* r)
+{
+    r->len = 0;
+    r->at = 0;
+}
+
+/**
+ * Where the next read goes.  Frames already taken are dropped first
+ * to make room.
+ * @param room Set to how much can be read.
+ **/
+unsigned char* wire_reader_space(wire_reader* r, size_t* room)
+{
+    if(r->at) {
+        memmove(r->buf, r->buf + r->at, r->len - r->at);
+        r->len -= r->at;
+        r->at = 0;
+    }
+    *room = sizeof(r->buf) - r->len;
+    return r->buf + r->len;
+}
+
+/**
+ * Take the next whole frame out of a reader.
+ * @return 1 if there was one, 0 if more has to be read, -1 if what's
+ *         there can't be a frame and the stream is no good.
+ **/
+int wire_next_frame(wire_reader* r, wire_frame* frame)
+{
+    const unsigned char* p = r->buf + r->at;
+    size_t left = r->len - r->at;
+    size_t length;
+
+    if(left < WIRE_HEADER_SIZE) {
+        return 0;
+    }
+    length = get16(p + 2);
+    if(length > WIRE_MAX_PAYLOAD) {
+        return -1;
+    }
+    if(left < WIRE_HEADER_SIZE + length) {
+        return 0;
+    }
+
+    frame->type = p[0];
+    frame->flags = p[1];
+    frame->payload = p + WIRE_HEADER_SIZE;
+    frame->length = length;
+    r->at += WIRE_HEADER_SIZE + length;
+    return 1;
+}
+
+/**
+ * Write the header and sequence number of a WIRE_DATAGRAM, its events
+ * go right after.
+ * @param events How many there are.
+ * @param stamp When they were sent, or NULL to leave it off.
+ * @return Bytes written.
+ **/
+size_t wire_put_datagram(unsigned char* p, uint32_t seq, size_t events, const uint64_t* stamp)
+{
+    size_t len = WIRE_SEQ_SIZE + (stamp ? WIRE_STAMP_SIZE : 0);
+
+    wire_put_header(p, WIRE_DATAGRAM, len + events * WIRE_EVENT_SIZE);
+    put32(p + WIRE_HEADER_SIZE, seq);
+    if(stamp) {
+        p[1] = WIRE_TIMED;
+        put32(p + WIRE_HEADER_SIZE + WIRE_SEQ_SIZE, *stamp >> 32);
+        put32(p + WIRE_HEADER_SIZE + WIRE_SEQ_SIZE + 4, *stamp);
+    }
+    return WIRE_HEADER_SIZE + len;
+}
+
+/**
+ * Write the header of a WIRE_EVENTS frame, its events go right after.
+ * @param events How many there are.
+ * @param stamp When they were sent, or NULL to leave it off.
+ * @return Bytes written.
+ **/
+size_t wire_put_events(unsigned char* p, size_t events, const uint64_t* stamp)
+{
+    size_t len = stamp ? WIRE_STAMP_SIZE : 0;
+
+    wire_put_header(p, WIRE_EVENTS, len + events * WIRE_EVENT_SIZE);
+    if(stamp) {
+        p[1] = WIRE_TIMED;
+        put32(p + WIRE_HEADER_SIZE, *stamp >> 32);
+        put32(p + WIRE_HEADER_SIZE + 4, *stamp);
+    }
+    return WIRE_HEADER_SIZE + len;
+}
+
+/**
+ * Find the events in a WIRE_EVENTS or WIRE_DATAGRAM.
+ * @param stamp Set to when they were sent, if they're WIRE_TIMED.
+ * @return 1 if they're timed, 0 if not, -1 if it doesn't add up.
+ **/
+int wire_get_events(const wire_frame* frame, const unsigned char** events, size_t* length, uint64_t* stamp)
+{
+    const unsigned char* p = frame->payload;
+    size_t len = frame->length;
+
+    if(frame->type == WIRE_DATAGRAM) {
+        if(len < WIRE_SEQ_SIZE) {
+            return -1;
+        }
+        p += WIRE_SEQ_SIZE;
+        len -= WIRE_SEQ_SIZE;
+    } else if(frame->type != WIRE_EVENTS) {
+        return -1;
+    }
+    if(frame->flags & WIRE_TIMED) {
+        if(len < WIRE_STAMP_SIZE) {
+            return -1;
+        }
+        *stamp = ((uint64_t)get32(p) << 32) | get32(p + 4);
+        p += WIRE_STAMP_SIZE;
+        len -= WIRE_STAMP_SIZE;
+    }
+    *events = p;
+    *length = len;
+    return (frame->flags & WIRE_TIMED) != 0;
+}
+
+/**
+ * Take the frame out of a datagram, which has to be exactly one.
+ * A WIRE_DATAGRAM's payload starts at the sequence number.
+ * @return 0, or -1 if it isn't a frame.
+ **/
+int wire_get_datagram(const unsigned char* p, size_t len, wire_frame* frame)
+{
+    if(len < WIRE_HEADER_SIZE || len != WIRE_HEADER_SIZE + get16(p + 2)) {
+        return -1;
+    }
+    frame->type = p[0];
+    frame->flags = p[1];
+    frame->payload = p + WIRE_HEADER_SIZE;
+    frame->length = len - WIRE_HEADER_SIZE;
+    if(frame->type == WIRE_DATAGRAM && frame->length < WIRE_SEQ_SIZE) {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * A WIRE_DATAGRAM's sequence number.
+ **/
+uint32_t wire_get_seq(const wire_frame* frame)
+{
+    return get32(frame->payload);
+}
+
+/**
+ * Whether sequence number a is newer than b, allowing for wrapping.
+ **/
+int wire_seq_after(uint32_t a, uint32_t b)
+{
+    return (int32_t)(a - b) > 0;
+}
+
+void wire_window_init(wire_window* w)
+{
+    w->started = 0;
+    w->top = 0;
+    w->seen = 0;
+}
+
+/**
+ * Note a datagram's arrival.
+ * @return 1 if it's new, 0 if it's a duplicate or older than the
+ *         window and should be dropped.
+ **/
+int wire_window_check(wire_window* w, uint32_t seq)
+{
+    uint32_t back;
+
+    if(!w->started) {
+        w->started = 1;
+        w->top = seq;
+        w->seen = 1;
+        return 1;
+    }
+    if(wire_seq_after(seq, w->top)) {
+        back = seq - w->top;
+        w->seen = back < WIRE_WINDOW ? (w->seen << back) | 1 : 1;
+        w->top = seq;
+        return 1;
+    }
+    back = w->top - seq;
+    if(back >= WIRE_WINDOW || (w->seen & ((uint64_t)1 << back))) {
+        return 0;
+    }
+    w->seen |= (uint64_t)1 << back;
+    return 1;
+}
+
+/**
+ * Write the headers of a WIRE_MACRO, the count events in it go
+ * right after.
+ * @param id Which macro.
+ * @param total Events in the whole macro.
+ * @param first Index of the first one in this frame.
+ * @return Bytes written.
+ **/
+size_t wire_put_macro(unsigned char* p, uint32_t id, size_t total, size_t first, size_t count)
+{
+    wire_put_header(p, WIRE_MACRO, WIRE_MACRO_HEADER_SIZE + count * WIRE_MACRO_EVENT_SIZE);
+    p += WIRE_HEADER_SIZE;
+    put32(p, id);
+    put32(p + 4, total);
+    put32(p + 8, first);
+    return WIRE_HEADER_SIZE + WIRE_MACRO_HEADER_SIZE;
+}
+
+/**
+ * Write one of a macro's events.
+ * @param offset When it happens, ms after the macro starts.
+ * @return Bytes written.
+ **/
+size_t wire_put_macro_event(unsigned char* p, int mouse, int code, int press, int offset)
+{
+    wire_put_event(p, mouse, code, press);
+    put32(p + WIRE_EVENT_SIZE, offset);
+    return WIRE_MACRO_EVENT_SIZE;
+}
+
+/**
+ * Read a WIRE_MACRO's headers.  Its events start at
+ * WIRE_MACRO_HEADER_SIZE into the payload.
+ * @param count Set to how many are in this frame.
+ * @return 0, or -1 if it doesn't add up.
+ **/
+int wire_get_macro(const wire_frame* frame, uint32_t* id, size_t* total, size_t* first, size_t* count)
+{
+    if(frame->type != WIRE_MACRO || frame->length < WIRE_MACRO_HEADER_SIZE
+    || (frame->length - WIRE_MACRO_HEADER_SIZE) % WIRE_MACRO_EVENT_SIZE) {
+        return -1;
+    }
+    *id = get32(frame->payload);
+    *total = get32(frame->payload + 4);
+    *first = get32(frame->payload + 8);
+    *count = (frame->length - WIRE_MACRO_HEADER_SIZE) / WIRE_MACRO_EVENT_SIZE;
+    if(*first > *total || *count > *total - *first) {
+        return -1;
+    }
+    return 0;
+}
+
+void wire_get_macro_event(const unsigned char* p, int* mouse, int* code, int* press, int* offset)
+{
+    wire_get_event(p, mouse, code, press);
+    *offset = (int32_t)get32(p + WIRE_EVENT_SIZE);
+}
+
+/**
+ * Write a whole WIRE_START frame.
+ * @param group What a WIRE_STOP cancels it by, or WIRE_NO_GROUP.
+ * @return Bytes written.
+ **/
+size_t wire_put_start(unsigned char* p, uint32_t id, unsigned group)
+{
+    p += wire_put_header(p, WIRE_START, WIRE_START_SIZE);
+    put32(p, id);
+    put16(p + 4, group);
+    return WIRE_HEADER_SIZE + WIRE_START_SIZE;
+}
+
+/**
+ * @return 0, or -1 if it isn't a WIRE_START.
+ **/
+int wire_get_start(const wire_frame* frame, uint32_t* id, unsigned* group)
+{
+    if(frame->type != WIRE_START || frame->length < WIRE_START_SIZE) {
+        return -1;
+    }
+    *id = get32(frame->payload);
+    *group = get16(frame->payload + 4);
+    return 0;
+}
+
+/**
+ * Write a whole WIRE_STOP frame.
+ * @return Bytes written.
+ **/
+size_t wire_put_stop(unsigned char* p, unsigned group)
+{
+    p += wire_put_header(p, WIRE_STOP, WIRE_STOP_SIZE);
+    put16(p, group);
+    return WIRE_HEADER_SIZE + WIRE_STOP_SIZE;
+}
+
+/**
+ * @return 0, or -1 if it isn't a WIRE_STOP.
+ **/
+int wire_get_stop(const wire_frame* frame, unsigned* group)
+{
+    if(frame->type != WIRE_STOP || frame->length < WIRE_STOP_SIZE) {
+        return -1;
+    }
+    *group = get16(frame->payload);
+    return 0;
+}
+
+/**
+ * Set a TCP stream up so frames go as soon as they're written: no
+ * Nagle holding small ones back for an ACK, and ACKs of our own
+ * straight away rather than delayed.
+ **/
+void wire_tune_stream(int fd)
+{
+    int on = 1;
+
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    wire_quickack(fd);
+}
+
+/**
+ * Ask for quick ACKs again.  The kernel drops back to delayed ACKs on
+ * its own, so a reader sets this after each read.
+ **/
+void wire_quickack(int fd)
+{
+    int on = 1;
+
+    setsockopt(fd, IPPROTO_TCP, TCP_QUICKACK, &on, sizeof(on));
+}
@@ -0,0 +1,201 @@
+/*
+    Nostromo_n50 configuration tools to support Belkin's Nostromo n50
+    Copyright (C) 2003 Paul Bohme and others
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+#ifndef WIRE_H
+#define WIRE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @file wire.h
+ * What the daemon and nostromo_remote say to each other.  Everything
+ * goes in frames: a 4 byte header (type, flags, payload length, big
+ * endian) and the payload.  Each side opens with a WIRE_HELLO giving
+ * the protocol version it speaks and what it can do; after that the
+ * daemon sends WIRE_EVENTS frames, each a batch of events that the
+ * remote injects and flushes together.  An event is 3 bytes: op bits
+ * and a big endian code.
+ *
+ * Over UDP each datagram is one whole frame and the daemon sends
+ * WIRE_DATAGRAMs instead, numbered so the remote can drop duplicates
+ * and tell what's newer.  Datagrams with releases in them go out more
+ * than once, a lost release would leave a key stuck down.
+ *
+ * A remote with WIRE_CAP_MACROS on a stream runs macros itself: the
+ * daemon sends each one's events and their offsets once, as WIRE_MACRO,
+ * then only WIRE_START and WIRE_STOP when keys go down and up, so the
+ * link's jitter doesn't land between strokes.  Events that are still
+ * streamed can be WIRE_TIMED, for a remote that plays them out on the
+ * spacing they were sent with.
+ *
+ * A remote can give its name after the capabilities in its hello, the
+ * daemon routes keys to remotes by it.
+ **/
+
+#define WIRE_MAGIC "NOST"       /**< Starts a hello, 4 bytes without the terminator */
+#define WIRE_VERSION 1          /**< Bump whenever a frame changes meaning */
+
+/** Capability bits.  Each side only uses what both have. */
+#define WIRE_CAP_MACROS 0x01    /**< Remote keeps WIRE_MACROs and runs them itself on WIRE_START */
+#define WIRE_CAP_TIMED 0x02     /**< Remote wants events WIRE_TIMED, it plays them out on their spacing */
+
+/** Capabilities this build can have, the remote only asks for WIRE_CAP_TIMED if it buffers */
+#define WIRE_CAPS (WIRE_CAP_MACROS | WIRE_CAP_TIMED)
+
+#define WIRE_HEADER_SIZE 4
+#define WIRE_HELLO_SIZE 10      /**< Magic, version and capabilities */
+#define WIRE_MAX_NAME 32        /**< Longest name a remote's hello can carry */
+#define WIRE_EVENT_SIZE 3
+
+/** Most events in one frame, the daemon flushes when it has this many */
+#define WIRE_MAX_EVENTS 1024
+
+/** Biggest payload a reader has to hold */
+#define WIRE_MAX_PAYLOAD (WIRE_STAMP_SIZE + WIRE_MAX_EVENTS * WIRE_EVENT_SIZE)
+
+/** Sender's CLOCK_MONOTONIC in microseconds, in front of WIRE_TIMED events */
+#define WIRE_STAMP_SIZE 8
+
+/** Sequence number in front of a WIRE_DATAGRAM's events */
+#define WIRE_SEQ_SIZE 4
+
+/** Most events in one datagram, so it fits in an ethernet frame */
+#define WIRE_MAX_DATAGRAM_EVENTS 256
+
+/** Biggest datagram either side sends */
+#define WIRE_MAX_DATAGRAM (WIRE_HEADER_SIZE + WIRE_SEQ_SIZE + WIRE_STAMP_SIZE + WIRE_MAX_DATAGRAM_EVENTS * WIRE_EVENT_SIZE)
+
+/** How far behind the newest a datagram can be and still be played */
+#define WIRE_WINDOW 64
+
+/** How often the remote says hello over UDP until it's answered (ms) */
+#define WIRE_HELLO_RETRY 1000
+
+/** ...and after, so a restarted daemon finds it (ms) */
+#define WIRE_KEEPALIVE 2000
+
+/** Ways of carrying frames, the <networking transport> setting */
+#define TRANSPORT_TCP "tcp"     /**< One stream, frames in order */
+#define TRANSPORT_UDP "udp"     /**< One frame per datagram */
+
+/**
+ * Frame types.
+ **/
+typedef enum {
+    WIRE_HELLO = 1,             /**< Version and capabilities, first thing each way */
+    WIRE_EVENTS = 2,            /**< A batch of events */
+    WIRE_DATAGRAM = 3,          /**< A sequence number and a batch of events, over UDP */
+    WIRE_MACRO = 4,             /**< Some or all of a macro's events, with their offsets */
+    WIRE_START = 5,             /**< Run a macro */
+    WIRE_STOP = 6,              /**< Cancel what's left of the macros started in a group */
+    WIRE_FORGET = 7             /**< Drop every macro, their ids are about to mean something else */
+} wire_frame_type;
+
+/** Macro id, total events and the index of the first one in this frame */
+#define WIRE_MACRO_HEADER_SIZE 12
+
+/** A macro's event: op bits, code and its offset in ms */
+#define WIRE_MACRO_EVENT_SIZE 7
+
+/** Most of a macro's events in one frame, longer ones take several */
+#define WIRE_MAX_MACRO_EVENTS ((WIRE_MAX_PAYLOAD - WIRE_MACRO_HEADER_SIZE) / WIRE_MACRO_EVENT_SIZE)
+
+#define WIRE_START_SIZE 6       /**< Macro id and group */
+#define WIRE_STOP_SIZE 2        /**< Group */
+
+/** Group for macros nothing will stop */
+#define WIRE_NO_GROUP 0xffff
+
+/** Flag on the daemon's UDP hello: the remote is new to it, numbering starts over */
+#define WIRE_HELLO_NEW 0x01
+
+/** Flag on WIRE_EVENTS and WIRE_DATAGRAM: the events have a sender timestamp in front */
+#define WIRE_TIMED 0x02
+
+/** Event op bits */
+#define WIRE_PRESS 0x01         /**< Press, otherwise release */
+#define WIRE_MOUSE 0x02         /**< Mouse button, otherwise key */
+
+/**
+ * Frames as they come in off a stream, which can split them anywhere.
+ **/
+typedef struct {
+    unsigned char buf[WIRE_HEADER_SIZE + WIRE_MAX_PAYLOAD];
+    size_t len;                 /**< Bytes in buf */
+    size_t at;                  /**< Start of the next frame */
+} wire_reader;
+
+/**
+ * Which datagrams have been seen, so duplicates and ones too far out
+ * of date are dropped.
+ **/
+typedef struct {
+    int started;                /**< Anything has come in yet */
+    uint32_t top;               /**< Newest sequence number seen */
+    uint64_t seen;              /**< Bit n set if top - n has been seen */
+} wire_window;
+
+/**
+ * One frame taken from a wire_reader.  The payload is only good until
+ * the reader is filled again.
+ **/
+typedef struct {
+    int type;
+    int flags;                  /**< Header flags, WIRE_HELLO_NEW or WIRE_TIMED */
+    const unsigned char* payload;
+    size_t length;
+} wire_frame;
+
+size_t wire_put_header(unsigned char* p, int type, size_t length);
+size_t wire_put_hello(unsigned char* p, uint32_t caps, int flags, const char* name = NULL);
+size_t wire_put_event(unsigned char* p, int mouse, int code, int press);
+int wire_get_hello(const wire_frame* frame, unsigned* version, uint32_t* caps);
+size_t wire_get_hello_name(const wire_frame* frame, char* name, size_t size);
+void wire_get_event(const unsigned char* p, int* mouse, int* code, int* press);
+void wire_reader_init(wire_reader* r);
+unsigned char* wire_reader_space(wire_reader* r, size_t* room);
+int wire_next_frame(wire_reader* r, wire_frame* frame);
+size_t wire_put_events(unsigned char* p, size_t events, const uint64_t* stamp);
+size_t wire_put_datagram(unsigned char* p, uint32_t seq, size_t events, const uint64_t* stamp);
+int wire_get_events(const wire_frame* frame, const unsigned char** events, size_t* length, uint64_t* stamp);
+int wire_get_datagram(const unsigned char* p, size_t len, wire_frame* frame);
+uint32_t wire_get_seq(const wire_frame* frame);
+void wire_window_init(wire_window* w);
+int wire_window_check(wire_window* w, uint32_t seq);
+int wire_seq_after(uint32_t a, uint32_t b);
+size_t wire_put_macro(unsigned char* p, uint32_t id, size_t total, size_t first, size_t count);
+size_t wire_put_macro_event(unsigned char* p, int mouse, int code, int press, int offset);
+int wire_get_macro(const wire_frame* frame, uint32_t* id, size_t* total, size_t* first, size_t* count);
+void wire_get_macro_event(const unsigned char* p, int* mouse, int* code, int* press, int* offset);
+size_t wire_put_start(unsigned char* p, uint32_t id, unsigned group);
+int wire_get_start(const wire_frame* frame, uint32_t* id, unsigned* group);
+size_t wire_put_stop(unsigned char* p, unsigned group);
+int wire_get_stop(const wire_frame* frame, unsigned* group);
+void wire_tune_stream(int fd);
+void wire_quickack(int fd);
+
+/**
+ * Tell a reader how much was read into wire_reader_space().
+ **/
+inline void wire_reader_fill(wire_reader* r, size_t len)
+{
+    r->len += len;
+}
+
+#endif // WIRE_H